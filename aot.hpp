@@ -0,0 +1,569 @@
+#ifndef aot_hpp
+#define aot_hpp
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <unordered_map>
+#include <cstddef>
+#include <cstdlib>
+#include <cstdio>
+#include <cerrno>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "objects.hpp"
+#include "lex.hpp"
+#include "list.hpp"
+#include "reader.hpp"
+#include "evalapply.hpp"
+#include "image.hpp"
+using namespace std;
+
+/*
+ * Ahead of time compilation. mgclisp --aot in.lisp -o out.so evaluates
+ * in.lisp once, translates each top level (define name (lambda ...)) whose
+ * body it understands into a C++ function, and has the system compiler
+ * build them into a shared object. Loading that object defines each
+ * compiled lambda as a COMPILED procedure and evaluates every other top
+ * level form, in order, as loading the source would.
+ *
+ * A body can use its parameters, constants, globals, quote, if and do, and
+ * calls. Anything else, like an inner lambda, leaves that define to the
+ * interpreter. Compiled code reaches the runtime only through AotRuntime,
+ * a table of plain function pointers, so it doesn't need any of these
+ * headers. The forms that aren't compiled, and the constants compiled code
+ * uses, travel inside the shared object as a forms image.
+ *
+ * These are EvalApply's members for it; they live here because the forms
+ * image needs HeapImage, which is built on EvalApply.
+ */
+
+//The generated source declares this same struct from AOT_TEXT.
+#define AOT_RUNTIME struct AotRuntime { \
+    Object* (*call)(Object** values, int count); \
+    Object* (*lookup)(Object* symbol, Object*** cell); \
+    Object* (*makeInt)(long value); \
+    bool (*isTrue)(Object* value); \
+    Object* trueValue; \
+    Object* falseValue; \
+}
+#define AOT_STR(...) #__VA_ARGS__
+#define AOT_TEXT(...) AOT_STR(__VA_ARGS__)
+
+AOT_RUNTIME;
+
+typedef Object* (*AotEntry)(Object** args, int count);
+typedef void (*AotBind)(const AotRuntime* runtime, Object** constants);
+
+//Compiled code reads an Object's type and int straight out of it, so the
+//shared object is only loaded by a build with the same layout.
+string aotLayout() {
+    return "mgclisp aot " + string(imageMagic, sizeof(imageMagic))
+        + " type@" + to_string(offsetof(Object, type)) + "/" + to_string(sizeof(objType))
+        + " int@" + to_string(offsetof(Object, intVal))
+        + " types " + to_string(AS_INT) + "," + to_string(AS_ERROR) + "," + to_string(AS_PROMISE)
+        + " runtime " + to_string(sizeof(AotRuntime));
+}
+
+/*
+ * Translates lambda bodies into C++ statements. Every value is computed
+ * into a temporary in the order the interpreter would compute it, so a
+ * form's side effects happen when they would have. Constants are K[i] and
+ * globals are looked up through a cell cached the first time they're
+ * found.
+ */
+class AotTranslator {
+    private:
+        JitResolver resolve;
+        List* constants;
+        unordered_map<Object*, int> constantIndex;
+        vector<int> cells;
+        stringstream functions;
+        List* params;
+        stringstream body;
+        int temps;
+        bool failed;
+        string temp();
+        int param(Object* symbol);
+        int constant(Object* obj);
+        string global(Object* symbol);
+        string value(Object* form, string indent);
+        string call(List* form, string indent);
+        string binary(JitOp op, List* form, string indent);
+        string special(List* form, string indent);
+    public:
+        AotTranslator(JitResolver resolver);
+        bool translate(List* lambdaParams, Object* code, int index);
+        List* getConstants();
+        string source(int entries);
+};
+
+AotTranslator::AotTranslator(JitResolver resolver) {
+    resolve = resolver;
+    constants = new List();
+}
+
+string AotTranslator::temp() {
+    return "t" + to_string(temps++);
+}
+
+int AotTranslator::param(Object* symbol) {
+    int i = 0;
+    for (Object* it : *params) {
+        if (compareObject(symbol, it))
+            return i;
+        i++;
+    }
+    return -1;
+}
+
+//Symbols and shared objects are kept once however often they're used.
+int AotTranslator::constant(Object* obj) {
+    auto known = constantIndex.find(obj);
+    if (known != constantIndex.end())
+        return known->second;
+    int index = constants->size();
+    constants->append(obj);
+    constantIndex[obj] = index;
+    return index;
+}
+
+string AotTranslator::global(Object* symbol) {
+    int k = constant(symbol);
+    bool seen = false;
+    for (int it : cells)
+        seen = seen || it == k;
+    if (!seen)
+        cells.push_back(k);
+    return "global(" + to_string(k) + ", &c" + to_string(k) + ")";
+}
+
+//The statements computing form go into body; what's returned names the
+//result.
+string AotTranslator::value(Object* form, string indent) {
+    if (failed)
+        return "0";
+    if (form->type == AS_SYMBOL) {
+        if (form->special != SF_NONE) {
+            failed = true;
+            return "0";
+        }
+        if (param(form) >= 0)
+            return "a" + to_string(param(form));
+        string t = temp();
+        body<<indent<<"Object* "<<t<<" = "<<global(form)<<";\n";
+        return t;
+    }
+    if (form->type != AS_LIST || form->listVal->empty())
+        return "K[" + to_string(constant(form)) + "]";
+    Object* head = form->listVal->first()->info;
+    if (head->type == AS_SYMBOL && head->special != SF_NONE)
+        return special(form->listVal, indent);
+    return call(form->listVal, indent);
+}
+
+string AotTranslator::special(List* form, string indent) {
+    Object* head = form->first()->info;
+    ListNode* args = form->first()->next;
+    if (head->special == SF_QUOTE && form->size() == 2)
+        return "K[" + to_string(constant(args->info)) + "]";
+    string t = temp();
+    if (head->special == SF_IF && form->size() == 4) {
+        string test = value(args->info, indent);
+        body<<indent<<"Object* "<<t<<";\n";
+        body<<indent<<"if (truth("<<test<<")) {\n";
+        string yes = value(args->next->info, indent + "    ");
+        body<<indent<<"    "<<t<<" = "<<yes<<";\n";
+        body<<indent<<"} else {\n";
+        string no = value(args->next->next->info, indent + "    ");
+        body<<indent<<"    "<<t<<" = "<<no<<";\n";
+        body<<indent<<"}\n";
+        return t;
+    }
+    //do stops at the first error, like specialDo.
+    if (head->special == SF_DO && args != nullptr) {
+        body<<indent<<"Object* "<<t<<";\n";
+        body<<indent<<"do {\n";
+        for (ListNode* it = args; it != nullptr; it = it->next) {
+            string v = value(it->info, indent + "    ");
+            body<<indent<<"    "<<t<<" = "<<v<<";\n";
+            if (it->next != nullptr)
+                body<<indent<<"    if (TYPE("<<t<<") == ERROR_TYPE) break;\n";
+        }
+        body<<indent<<"} while (0);\n";
+        return t;
+    }
+    failed = true;
+    return "0";
+}
+
+//Evaluates every element and hands them to the runtime, which applies
+//the first or makes a list, like evalList.
+string AotTranslator::call(List* form, string indent) {
+    Object* head = form->first()->info;
+    if (form->size() == 3 && head->type == AS_SYMBOL && head->special == SF_NONE && param(head) < 0) {
+        JitOp op = resolve(head).op;
+        if (op == JIT_ADD || op == JIT_SUB || op == JIT_MUL || op == JIT_LT || op == JIT_GT || op == JIT_EQ)
+            return binary(op, form, indent);
+    }
+    vector<string> values;
+    for (Object* it : *form)
+        values.push_back(value(it, indent));
+    string v = temp();
+    body<<indent<<"Object* "<<v<<"["<<values.size()<<"] = {";
+    for (size_t i = 0; i < values.size(); i++)
+        body<<(i > 0 ? ", ":"")<<values[i];
+    body<<"};\n";
+    string t = temp();
+    body<<indent<<"Object* "<<t<<" = rt->call("<<v<<", "<<values.size()<<");\n";
+    return t;
+}
+
+//A global that named + - * < > or eq when this was compiled is taken to
+//still name it, and works on two ints in place. Anything else goes
+//through the runtime.
+string AotTranslator::binary(JitOp op, List* form, string indent) {
+    string x = value(form->first()->next->info, indent);
+    string y = value(form->first()->next->next->info, indent);
+    string t = temp();
+    body<<indent<<"Object* "<<t<<";\n";
+    body<<indent<<"if (TYPE("<<x<<") == INT_TYPE && TYPE("<<y<<") == INT_TYPE) {\n";
+    string lhs = "(long)INTOF(" + x + ")", rhs = "INTOF(" + y + ")";
+    switch (op) {
+        case JIT_ADD: body<<indent<<"    "<<t<<" = rt->makeInt("<<lhs<<" + "<<rhs<<");\n"; break;
+        case JIT_SUB: body<<indent<<"    "<<t<<" = rt->makeInt("<<lhs<<" - "<<rhs<<");\n"; break;
+        case JIT_MUL: body<<indent<<"    "<<t<<" = rt->makeInt("<<lhs<<" * "<<rhs<<");\n"; break;
+        case JIT_LT: body<<indent<<"    "<<t<<" = "<<lhs<<" < "<<rhs<<" ? rt->trueValue:rt->falseValue;\n"; break;
+        case JIT_GT: body<<indent<<"    "<<t<<" = "<<lhs<<" > "<<rhs<<" ? rt->trueValue:rt->falseValue;\n"; break;
+        default: body<<indent<<"    "<<t<<" = "<<lhs<<" == "<<rhs<<" ? rt->trueValue:rt->falseValue;\n"; break;
+    }
+    body<<indent<<"} else {\n";
+    body<<indent<<"    Object* v["<<3<<"] = {"<<global(form->first()->info)<<", "<<x<<", "<<y<<"};\n";
+    body<<indent<<"    "<<t<<" = rt->call(v, 3);\n";
+    body<<indent<<"}\n";
+    return t;
+}
+
+//Adds f<index> for a lambda, or returns false if its body can't be
+//compiled.
+bool AotTranslator::translate(List* lambdaParams, Object* code, int index) {
+    params = lambdaParams;
+    body.str("");
+    temps = 0;
+    failed = false;
+    string result = value(code, "    ");
+    if (failed)
+        return false;
+    functions<<"static Object* f"<<index<<"(Object** args, int count) {\n";
+    for (int i = 0; i < params->size(); i++)
+        functions<<"    Object* a"<<i<<" = args["<<i<<"];\n";
+    functions<<body.str();
+    functions<<"    return "<<result<<";\n";
+    functions<<"}\n\n";
+    return true;
+}
+
+List* AotTranslator::getConstants() {
+    return constants;
+}
+
+string AotTranslator::source(int entries) {
+    stringstream out;
+    out<<"//Generated by mgclisp --aot.\n";
+    out<<"#include <cstddef>\n\n";
+    out<<"struct Object;\n";
+    out<<AOT_TEXT(AOT_RUNTIME)<<";\n\n";
+    out<<"#define TYPE(v) (*(const int*)((const char*)(v) + "<<offsetof(Object, type)<<"))\n";
+    out<<"#define INTOF(v) (*(const int*)((const char*)(v) + "<<offsetof(Object, intVal)<<"))\n";
+    out<<"#define INT_TYPE "<<AS_INT<<"\n";
+    out<<"#define ERROR_TYPE "<<AS_ERROR<<"\n";
+    out<<"#define PROMISE_TYPE "<<AS_PROMISE<<"\n\n";
+    out<<"static const AotRuntime* rt;\n";
+    out<<"static Object** K;\n";
+    for (int k : cells)
+        out<<"static Object** c"<<k<<";\n";
+    out<<"\n";
+    out<<"static inline Object* global(int k, Object*** cell) {\n";
+    out<<"    if (*cell != nullptr && TYPE(**cell) != PROMISE_TYPE)\n";
+    out<<"        return **cell;\n";
+    out<<"    return rt->lookup(K[k], cell);\n";
+    out<<"}\n\n";
+    out<<"static inline bool truth(Object* v) {\n";
+    out<<"    return v == rt->trueValue ? true:v == rt->falseValue ? false:rt->isTrue(v);\n";
+    out<<"}\n\n";
+    out<<functions.str();
+    out<<"typedef Object* (*Entry)(Object**, int);\n";
+    out<<"extern \"C\" const Entry mgclisp_entries[] = {";
+    for (int i = 0; i < entries; i++)
+        out<<(i > 0 ? ", ":"")<<"f"<<i;
+    out<<(entries == 0 ? "nullptr":"")<<"};\n";
+    out<<"extern \"C\" const int mgclisp_entry_count = "<<entries<<";\n";
+    out<<"extern \"C\" const char mgclisp_layout[] = \""<<aotLayout()<<"\";\n\n";
+    out<<"extern \"C\" void mgclisp_bind(const AotRuntime* runtime, Object** constants) {\n";
+    out<<"    rt = runtime;\n";
+    out<<"    K = constants;\n";
+    out<<"}\n";
+    return out.str();
+}
+
+//The binding define just made for symbol, which is the last one.
+Object* lastDefinition(List* bindings, Object* symbol) {
+    Object* found = nullptr;
+    for (Object* it : *bindings)
+        if (it->type == AS_BINDING && compareObject(symbol, it->bindingVal->symbol))
+            found = it->bindingVal->value;
+    return found;
+}
+
+//Runs command and waits for it: 0 if it exits with 0, the errno exec
+//failed with if it couldn't be started, or -1 otherwise. The child writes
+//that errno to a pipe that closes on a successful exec.
+int runCompiler(vector<string>& command) {
+    vector<char*> argv;
+    for (string& arg : command)
+        argv.push_back(&arg[0]);
+    argv.push_back(nullptr);
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0)
+        return -1;
+    cout.flush();
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        execvp(argv[0], argv.data());
+        int failure = errno;
+        ssize_t written = write(fds[1], &failure, sizeof(failure));
+        _exit(written == sizeof(failure) ? 127:126);
+    }
+    close(fds[1]);
+    int failure = 0;
+    ssize_t got;
+    while ((got = read(fds[0], &failure, sizeof(failure))) < 0 && errno == EINTR)
+        ;
+    close(fds[0]);
+    int status;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+        ;
+    if (got == sizeof(failure))
+        return failure;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0:-1;
+}
+
+//Evaluates source as --load would, then writes output: the compiled
+//lambdas, and as a forms image (constants items...), where an item is
+//(compiled name params body) for the nth compiled lambda or (eval form).
+bool EvalApply::compileAot(string source, string output, string& error) {
+    ifstream file(source);
+    if (!file) {
+        error = "could not open " + source;
+        return false;
+    }
+    stringstream contents;
+    contents<<file.rdbuf();
+    Lexer lexer;
+    auto tokens = lexer.lex(contents.str());
+    if (!tokens.empty() && tokens[0].token == ERROR) {
+        error = source + ": " + tokens[0].strVal;
+        return false;
+    }
+    AotTranslator translator([this](Object* symbol) { return jitResolve(symbol); });
+    List* items = new List();
+    int formNo = 1, entries = 0;
+    for (int index = 0; index < (int)tokens.size(); index++) {
+        if (tokens[index].token != LPAREN)
+            continue;
+        List* form = parseToList(tokens, index);
+        List* copy = copyTree(makeListObject(form))->listVal;
+        Object* result = eval(form);
+        if (result->type == AS_ERROR)
+            cout<<source<<": form "<<formNo<<": "<<toString(result)<<endl;
+        formNo++;
+        List* item = new List();
+        Object* head = copy->empty() ? nullptr:copy->first()->info;
+        Object* lambda = nullptr;
+        if (head != nullptr && head->special == SF_DEFINE && copy->size() == 3 && result->type == AS_SYMBOL) {
+            Object* value = lastDefinition(globalEnv->bindings, result);
+            if (value != nullptr && value->type == AS_FUNCTION && value->procedureVal->type == LAMBDA
+                && value->procedureVal->env == globalEnv)
+                lambda = value;
+        }
+        if (lambda != nullptr && translator.translate(lambda->procedureVal->freeVars, lambda->procedureVal->code, entries)) {
+            item->append(makeSymbolObject("compiled"));
+            item->append(result);
+            item->append(makeListObject(lambda->procedureVal->freeVars));
+            item->append(lambda->procedureVal->code);
+            entries++;
+        } else {
+            item->append(makeSymbolObject("eval"));
+            item->append(makeListObject(copy));
+        }
+        items->append(makeListObject(item));
+    }
+    items->push(makeListObject(translator.getConstants()));
+    string imagePath = output + ".img", sourcePath = output + ".cpp";
+    HeapImage image(*this);
+    if (!image.saveForms(imagePath, items)) {
+        error = image.lastError();
+        return false;
+    }
+    ifstream imageFile(imagePath, ios::binary);
+    string bytes((istreambuf_iterator<char>(imageFile)), istreambuf_iterator<char>());
+    remove(imagePath.c_str());
+    ofstream out(sourcePath);
+    out<<translator.source(entries);
+    out<<"alignas(8) static const unsigned char image[] = {";
+    for (size_t i = 0; i < bytes.size(); i++)
+        out<<(i % 16 == 0 ? "\n    ":" ")<<(int)(unsigned char)bytes[i]<<",";
+    out<<"\n};\n";
+    out<<"extern \"C\" const unsigned char* const mgclisp_image = image;\n";
+    out<<"extern \"C\" const size_t mgclisp_image_size = sizeof(image);\n";
+    out.close();
+    if (!out) {
+        error = "could not write " + sourcePath;
+        return false;
+    }
+    //the compiler is run without a shell, so the paths are passed as they
+    //are. $CXX may hold arguments of its own, split at spaces.
+    const char* cxx = getenv("CXX");
+    stringstream words(cxx != nullptr ? cxx:"");
+    vector<string> command;
+    for (string word; words>>word;)
+        command.push_back(word);
+    if (command.empty())
+        command.push_back("c++");
+    for (string arg : {"-std=c++17", "-O2", "-shared", "-fPIC", "-o", output.c_str(), sourcePath.c_str()})
+        command.push_back(arg);
+    int status = runCompiler(command);
+    if (status == ENOENT) {
+        error = "no compiler " + command[0] + " was found; set CXX to one";
+        return false;
+    }
+    if (status != 0) {
+        error = "compiling " + sourcePath + " failed";
+        return false;
+    }
+    remove(sourcePath.c_str());
+    cout<<"compiled "<<entries<<" of "<<formNo - 1<<" forms from "<<source<<" to "<<output<<endl;
+    return true;
+}
+
+//Loads a shared object --aot made, reporting forms that fail as loading
+//the source would. It's never unloaded, since its procedures can be held
+//anywhere.
+bool EvalApply::loadCompiled(string path, string& error) {
+    if (path.find('/') == string::npos)
+        path = "./" + path;
+    void* handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (handle == nullptr) {
+        error = dlerror();
+        return false;
+    }
+    auto layout = (const char*)dlsym(handle, "mgclisp_layout");
+    auto entries = (const AotEntry*)dlsym(handle, "mgclisp_entries");
+    auto entryCount = (const int*)dlsym(handle, "mgclisp_entry_count");
+    auto data = (const unsigned char* const*)dlsym(handle, "mgclisp_image");
+    auto size = (const size_t*)dlsym(handle, "mgclisp_image_size");
+    auto bind = (AotBind)dlsym(handle, "mgclisp_bind");
+    if (layout == nullptr || entries == nullptr || entryCount == nullptr || data == nullptr || size == nullptr || bind == nullptr) {
+        error = path + " was not made by mgclisp --aot";
+        return false;
+    }
+    if (aotLayout() != layout) {
+        error = path + " was compiled by a different build of mgclisp";
+        return false;
+    }
+    List* items;
+    HeapImage image(*this);
+    if (!image.loadForms((const char*)*data, *size, items) || items->empty() || items->first()->info->type != AS_LIST) {
+        error = path + ": " + image.lastError();
+        return false;
+    }
+    List* constantList = items->first()->info->listVal;
+    Object** constants = new Object*[constantList->size() + 1];
+    int k = 0;
+    for (Object* it : *constantList)
+        constants[k++] = it;
+    static AotRuntime runtime = {&EvalApply::aotCall, &EvalApply::aotLookup, &EvalApply::aotMakeInt, &EvalApply::aotIsTrue,
+                                 makeBoolObject(true), makeBoolObject(false)};
+    aotHost = this;
+    bind(&runtime, constants);
+    int entry = 0, formNo = 1;
+    for (ListNode* it = items->first()->next; it != nullptr; it = it->next) {
+        List* item = it->info->listVal;
+        formNo++;
+        Object* kind = item->first()->info;
+        if (*kind->strVal == "compiled") {
+            if (entry >= *entryCount) {
+                error = path + " has more compiled lambdas than code";
+                return false;
+            }
+            ListNode* name = item->first()->next;
+            Procedure* proc = allocFunction(name->next->info->listVal, name->next->next->info, globalEnv, COMPILED);
+            proc->compiled = entries[entry++];
+            proc->noJit = true;
+            jit.invalidate(*name->info->strVal);
+            defineIn(globalEnv, name->info, makeFunctionObject(proc));
+            continue;
+        }
+        Object* result = eval(item->first()->next->info->listVal);
+        if (result->type == AS_ERROR)
+            cout<<path<<": form "<<formNo - 1<<": "<<toString(result)<<endl;
+    }
+    return true;
+}
+
+//Like a lambda's call, short of an argument count the lambda doesn't take,
+//which compiled code would read past.
+Object* EvalApply::applyCompiled(Procedure* procedure, Object** args, int count) {
+    if (count < procedure->freeVars->size())
+        return makeErrorObject("<Error: procedure expects " + to_string(procedure->freeVars->size()) + " arguments>");
+    if (heapStats.exceeded)
+        return memoryError;
+    evalStats.compiledApplies++;
+    //compiled code recurses on the C stack, through here.
+    if (scheduler.stackLow()) {
+        Object* result = scheduler.onNewStack([procedure, args, count]() { return procedure->compiled(args, count); });
+        return result != nullptr ? result:makeErrorObject("<Error: out of memory for the stack>");
+    }
+    scheduler.tick();
+    return procedure->compiled(args, count);
+}
+
+Object* EvalApply::aotCall(Object** values, int count) {
+    return aotHost->finishCall(values, count);
+}
+
+//The cell is cached by compiled code, which looks again while it holds
+//a promise.
+Object* EvalApply::aotLookup(Object* symbol, Object*** cell) {
+    Object* value = aotHost->envLookUp(aotHost->globalEnv, symbol);
+    *cell = aotHost->envFind(aotHost->globalEnv, symbol);
+    return value;
+}
+
+Object* EvalApply::aotMakeInt(long value) {
+    return makeIntegerObject(value);
+}
+
+bool EvalApply::aotIsTrue(Object* value) {
+    return aotHost->isTrue(value);
+}
+
+//(load-compiled path) loads a shared object made by mgclisp --aot.
+Object* EvalApply::primitiveLoadCompiled(Object** args, int count) {
+    if (count != 1 || args[0]->type != AS_STRING)
+        return makeErrorObject("<Error: load-compiled requires a file name>");
+    string error;
+    if (!loadCompiled(toString(args[0]), error))
+        return makeErrorObject("<Error: " + error + ">");
+    return makeBoolObject(true);
+}
+
+#endif
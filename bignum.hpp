@@ -0,0 +1,325 @@
+#ifndef bignum_hpp
+#define bignum_hpp
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <climits>
+#include <cmath>
+using namespace std;
+
+/*
+ * Arbitrary precision integers, stored as a sign and a magnitude of 32 bit
+ * limbs, least significant first, with no leading zero limbs. Integer
+ * arithmetic that overflows an int lands here.
+ *
+ * The magnitude routines take the base as a template argument, so the same
+ * Karatsuba multiplication also works on limbs of nine decimal digits,
+ * which is what converting to decimal is done in.
+ */
+
+typedef vector<uint32_t> Limbs;
+
+//below this many limbs schoolbook multiplication beats splitting.
+const int karatsubaThreshold = 32;
+const uint32_t decimalChunk = 1000000000;
+const uint64_t binaryBase = 1ULL << 32;
+//below this many limbs a number is turned into decimal nine digits at a
+//time rather than split.
+const int decimalSplitThreshold = 64;
+
+class BigInt {
+    private:
+        static void trim(Limbs& a);
+        static int compareMagnitude(const Limbs& a, const Limbs& b);
+        template <uint64_t base = binaryBase> static Limbs addMagnitude(const Limbs& a, const Limbs& b);
+        template <uint64_t base = binaryBase> static Limbs subMagnitude(const Limbs& a, const Limbs& b);
+        template <uint64_t base = binaryBase> static Limbs mulSchoolbook(const Limbs& a, const Limbs& b);
+        template <uint64_t base = binaryBase> static Limbs mulKaratsuba(const Limbs& a, const Limbs& b);
+        template <uint64_t base = binaryBase> static void addShifted(Limbs& acc, const Limbs& a, size_t shift);
+        static uint32_t divSmall(Limbs& a, uint32_t d);
+        static void mulSmallAdd(Limbs& a, uint32_t m, uint32_t add);
+        static Limbs toDecimal(const Limbs& a, size_t begin, size_t end, vector<Limbs>& powers);
+    public:
+        bool negative;
+        Limbs limbs;
+        BigInt(long value = 0);
+        static bool fromString(const string& digits, BigInt& result);
+        BigInt add(const BigInt& other) const;
+        BigInt sub(const BigInt& other) const;
+        BigInt mul(const BigInt& other) const;
+        int compare(const BigInt& other) const;
+        bool fitsInt() const;
+        int toInt() const;
+        double toDouble() const;
+        string toString() const;
+};
+
+BigInt::BigInt(long value) {
+    negative = value < 0;
+    unsigned long mag = negative ? -(unsigned long)value:value;
+    while (mag != 0) {
+        limbs.push_back(mag & 0xffffffff);
+        mag >>= 32;
+    }
+}
+
+void BigInt::trim(Limbs& a) {
+    while (!a.empty() && a.back() == 0)
+        a.pop_back();
+}
+
+int BigInt::compareMagnitude(const Limbs& a, const Limbs& b) {
+    if (a.size() != b.size())
+        return a.size() < b.size() ? -1:1;
+    for (size_t i = a.size(); i-- > 0;) {
+        if (a[i] != b[i])
+            return a[i] < b[i] ? -1:1;
+    }
+    return 0;
+}
+
+template <uint64_t base>
+Limbs BigInt::addMagnitude(const Limbs& a, const Limbs& b) {
+    const Limbs& longer = a.size() >= b.size() ? a:b;
+    const Limbs& shorter = a.size() >= b.size() ? b:a;
+    Limbs result(longer.size() + 1);
+    uint64_t carry = 0;
+    for (size_t i = 0; i < longer.size(); i++) {
+        uint64_t sum = (uint64_t)longer[i] + (i < shorter.size() ? shorter[i]:0) + carry;
+        result[i] = sum % base;
+        carry = sum / base;
+    }
+    result[longer.size()] = carry;
+    trim(result);
+    return result;
+}
+
+//|a| >= |b|
+template <uint64_t base>
+Limbs BigInt::subMagnitude(const Limbs& a, const Limbs& b) {
+    Limbs result(a.size());
+    int64_t borrow = 0;
+    for (size_t i = 0; i < a.size(); i++) {
+        int64_t diff = (int64_t)a[i] - (i < b.size() ? b[i]:0) - borrow;
+        borrow = diff < 0;
+        result[i] = diff + borrow * (int64_t)base;
+    }
+    trim(result);
+    return result;
+}
+
+template <uint64_t base>
+Limbs BigInt::mulSchoolbook(const Limbs& a, const Limbs& b) {
+    if (a.empty() || b.empty())
+        return Limbs();
+    Limbs result(a.size() + b.size());
+    for (size_t i = 0; i < a.size(); i++) {
+        uint64_t carry = 0;
+        for (size_t j = 0; j < b.size(); j++) {
+            uint64_t cur = (uint64_t)a[i] * b[j] + result[i+j] + carry;
+            result[i+j] = cur % base;
+            carry = cur / base;
+        }
+        result[i + b.size()] = carry;
+    }
+    trim(result);
+    return result;
+}
+
+template <uint64_t base>
+void BigInt::addShifted(Limbs& acc, const Limbs& a, size_t shift) {
+    if (acc.size() < a.size() + shift + 1)
+        acc.resize(a.size() + shift + 1);
+    uint64_t carry = 0;
+    size_t i = 0;
+    for (; i < a.size(); i++) {
+        uint64_t sum = (uint64_t)acc[i+shift] + a[i] + carry;
+        acc[i+shift] = sum % base;
+        carry = sum / base;
+    }
+    for (; carry != 0; i++) {
+        if (i + shift == acc.size())
+            acc.push_back(0);
+        uint64_t sum = (uint64_t)acc[i+shift] + carry;
+        acc[i+shift] = sum % base;
+        carry = sum / base;
+    }
+}
+
+//x*y = z2*B^2m + ((x0+x1)(y0+y1) - z2 - z0)*B^m + z0, three half size
+//products instead of four.
+template <uint64_t base>
+Limbs BigInt::mulKaratsuba(const Limbs& a, const Limbs& b) {
+    if (a.size() < karatsubaThreshold || b.size() < karatsubaThreshold)
+        return mulSchoolbook<base>(a, b);
+    size_t m = max(a.size(), b.size()) / 2;
+    Limbs a0(a.begin(), a.begin() + min(m, a.size()));
+    Limbs a1(a.begin() + min(m, a.size()), a.end());
+    Limbs b0(b.begin(), b.begin() + min(m, b.size()));
+    Limbs b1(b.begin() + min(m, b.size()), b.end());
+    trim(a0);
+    trim(b0);
+    Limbs z0 = mulKaratsuba<base>(a0, b0);
+    Limbs z2 = mulKaratsuba<base>(a1, b1);
+    Limbs z1 = mulKaratsuba<base>(addMagnitude<base>(a0, a1), addMagnitude<base>(b0, b1));
+    z1 = subMagnitude<base>(z1, z0);
+    z1 = subMagnitude<base>(z1, z2);
+    Limbs result = z0;
+    addShifted<base>(result, z1, m);
+    addShifted<base>(result, z2, 2*m);
+    trim(result);
+    return result;
+}
+
+uint32_t BigInt::divSmall(Limbs& a, uint32_t d) {
+    uint64_t rem = 0;
+    for (size_t i = a.size(); i-- > 0;) {
+        uint64_t cur = (rem << 32) | a[i];
+        a[i] = cur / d;
+        rem = cur % d;
+    }
+    trim(a);
+    return rem;
+}
+
+void BigInt::mulSmallAdd(Limbs& a, uint32_t m, uint32_t add) {
+    uint64_t carry = add;
+    for (size_t i = 0; i < a.size(); i++) {
+        uint64_t cur = (uint64_t)a[i] * m + carry;
+        a[i] = cur;
+        carry = cur >> 32;
+    }
+    if (carry != 0)
+        a.push_back(carry);
+}
+
+bool BigInt::fromString(const string& digits, BigInt& result) {
+    result = BigInt(0);
+    size_t pos = 0;
+    if (!digits.empty() && digits[0] == '-')
+        pos = 1;
+    if (pos == digits.size())
+        return false;
+    //nine digits at a time.
+    size_t first = (digits.size() - pos) % 9;
+    if (first == 0)
+        first = 9;
+    while (pos < digits.size()) {
+        uint32_t chunk = 0;
+        uint32_t scale = 1;
+        for (size_t k = 0; k < first; k++, pos++) {
+            if (!isdigit(digits[pos]))
+                return false;
+            chunk = chunk*10 + (digits[pos] - '0');
+            scale *= 10;
+        }
+        mulSmallAdd(result.limbs, scale, chunk);
+        first = 9;
+    }
+    trim(result.limbs);
+    result.negative = digits[0] == '-' && !result.limbs.empty();
+    return true;
+}
+
+BigInt BigInt::add(const BigInt& other) const {
+    BigInt result;
+    if (negative == other.negative) {
+        result.limbs = addMagnitude(limbs, other.limbs);
+        result.negative = negative;
+    } else if (compareMagnitude(limbs, other.limbs) >= 0) {
+        result.limbs = subMagnitude(limbs, other.limbs);
+        result.negative = negative;
+    } else {
+        result.limbs = subMagnitude(other.limbs, limbs);
+        result.negative = other.negative;
+    }
+    if (result.limbs.empty())
+        result.negative = false;
+    return result;
+}
+
+BigInt BigInt::sub(const BigInt& other) const {
+    BigInt negated = other;
+    negated.negative = !other.negative && !other.limbs.empty();
+    return add(negated);
+}
+
+BigInt BigInt::mul(const BigInt& other) const {
+    BigInt result;
+    result.limbs = mulKaratsuba(limbs, other.limbs);
+    result.negative = !result.limbs.empty() && negative != other.negative;
+    return result;
+}
+
+int BigInt::compare(const BigInt& other) const {
+    if (negative != other.negative)
+        return negative ? -1:1;
+    int cmp = compareMagnitude(limbs, other.limbs);
+    return negative ? -cmp:cmp;
+}
+
+bool BigInt::fitsInt() const {
+    if (limbs.size() > 1)
+        return false;
+    if (limbs.empty())
+        return true;
+    return negative ? limbs[0] <= (uint32_t)INT_MAX + 1:limbs[0] <= (uint32_t)INT_MAX;
+}
+
+int BigInt::toInt() const {
+    if (limbs.empty())
+        return 0;
+    return negative ? (int)(-(int64_t)limbs[0]):(int)limbs[0];
+}
+
+double BigInt::toDouble() const {
+    double result = 0;
+    for (size_t i = limbs.size(); i-- > 0;)
+        result = result * 4294967296.0 + limbs[i];
+    return negative ? -result:result;
+}
+
+//a[begin, end) in limbs of nine decimal digits. A short run peels off
+//nine digits per pass over its limbs; a long one is split in two at a
+//power of two limbs, hi*2^(32*half) + lo, and both halves and the power
+//are converted and combined with decimal Karatsuba, which makes the whole
+//conversion subquadratic. powers[k] is 2^(32*2^k) in decimal.
+Limbs BigInt::toDecimal(const Limbs& a, size_t begin, size_t end, vector<Limbs>& powers) {
+    while (end > begin && a[end - 1] == 0)
+        end--;
+    if (end - begin <= decimalSplitThreshold) {
+        Limbs mag(a.begin() + begin, a.begin() + end);
+        Limbs chunks;
+        while (!mag.empty())
+            chunks.push_back(divSmall(mag, decimalChunk));
+        return chunks;
+    }
+    size_t k = 0;
+    while ((size_t)2 << k < end - begin)
+        k++;
+    size_t half = (size_t)1 << k;
+    while (powers.size() <= k)
+        powers.push_back(mulKaratsuba<decimalChunk>(powers.back(), powers.back()));
+    Limbs hi = mulKaratsuba<decimalChunk>(toDecimal(a, begin + half, end, powers), powers[k]);
+    Limbs result = addMagnitude<decimalChunk>(hi, toDecimal(a, begin, begin + half, powers));
+    trim(result);
+    return result;
+}
+
+string BigInt::toString() const {
+    if (limbs.empty())
+        return "0";
+    vector<Limbs> powers = {{294967296, 4}};
+    Limbs chunks = toDecimal(limbs, 0, limbs.size(), powers);
+    string result = negative ? "-":"";
+    result += to_string(chunks.back());
+    for (size_t i = chunks.size() - 1; i-- > 0;) {
+        string chunk = to_string(chunks[i]);
+        result.append(9 - chunk.size(), '0');
+        result += chunk;
+    }
+    return result;
+}
+
+#endif
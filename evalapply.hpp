@@ -4,13 +4,85 @@
 #include <vector>
 #include <stack>
 #include <unordered_map>
+#include <unordered_set>
+#include <chrono>
+#include <memory>
 #include "objects.hpp"
 #include "lex.hpp"
 #include "list.hpp"
+#include "jit.hpp"
+#include "scheduler.hpp"
+#include "sort.hpp"
+#include "port.hpp"
+#include "reader.hpp"
+#include "persistent.hpp"
+#include "vmap.hpp"
 using namespace std;
 
+//calls a lambda gets through the interpreter before it's handed to the JIT.
+const int jitThreshold = 100;
+//guard failures a call site survives before it stops specializing.
+const int quickMissLimit = 4;
+//lists map will walk side by side.
+const int mapMaxLists = 16;
+//how long a native call has to have been taking before it's worth
+//handing to another thread.
+const long parallelMinNanos = 100000;
+
+//Thrown by calling a continuation and caught by the call/cc that made it,
+//unwinding everything in between.
+struct Escape {
+    Procedure* target;
+    Object* value;
+};
+
+//A module's exports are known as soon as its source has been read, but
+//its body is only evaluated, in env, when one of them is first used.
+struct Module {
+    string name;
+    string path;
+    string cachePath;
+    List* exports;
+    List* body;
+    Env* env;
+    bool loaded;
+    bool loading;
+    bool expanded;
+};
+
+//An operand evalParallel runs as native code, possibly on another thread.
+struct ParallelCall {
+    int index;
+    Procedure* proc;
+    JitCode* native;
+    Object** args;
+    int count;
+    long argv[jitMaxArgs];
+    long value;
+    bool ran;
+    bool tooDeep;
+    long nanos;
+};
+
+//Gives back a frame taken by allocFrame when the call using it is left,
+//by returning or by an escape unwinding through it.
+struct FrameGuard {
+    EvalApply* evaluator;
+    Env* frame;
+    ~FrameGuard();
+};
+
+//Sets flag to value until it goes out of scope, the same way.
+struct FlagGuard {
+    bool& flag;
+    bool saved;
+    FlagGuard(bool& flag, bool value);
+    ~FlagGuard();
+};
+
 class EvalApply {
     private:
+        friend struct FrameGuard;
         bool loud;
         int d;
         void enter();
@@ -18,49 +90,318 @@ class EvalApply {
         void leave();
         void leave(string s);
         void say(string s);
-        unordered_map<string, SpecialForm> specialForms;
-        Object* specialDefine(List* args, List* env);
-        Object* specialIf(List* args, List* env);
-        Object* specialLambda(List* args, List* env);
-        Object* specialQuote(List* args, List* env);
-        Object* specialSet(List* args, List* env);
-        Object* specialDo(List* args, List* env);
-        Object* specialCond(List* args, List* env);
-        Object* specialLet(List* args, List* env);
-        Object* primitivePlus(List* args);
-        Object* primitiveMinus(List* args);
-        Object* primitiveMultiply(List* args);
-        Object* primitiveDivide(List* args);
-        Object* primitiveLess(List* args);
-        Object* primitiveGreater(List* args);
-        Object* primitiveEquals(List* args); 
-        Object* primitivePrint(List* args);
-        Object* primitiveCar(List* args);
-        Object* primitiveCdr(List* args);
-        Object* primitivePush(List* args);
-        Object* primitiveList(List* args);
-        Object* applySpecial(SpecialForm* special, List* args, List* environment);
-        Object* applyMathPrimitive(List* args, string op);
-        Object* apply(Procedure* proc, List* args, List* env);
-        Object* evalList(List* list, List* env);
-        Object* eval(Object* obj, List* env);
-
-        List* makeNewEnvironment(List* vars, List* vals);
+        SpecialForm specialForms[SF_COUNT];
+        unordered_map<string, Procedure*> macros;
+        int macroGeneration;
+        int gensymCount;
+        Object* specialDefine(ListNode* args, Env* env);
+        Object* specialIf(ListNode* args, Env* env);
+        Object* specialLambda(ListNode* args, Env* env);
+        Object* specialQuote(ListNode* args, Env* env);
+        Object* specialSet(ListNode* args, Env* env);
+        Object* specialDo(ListNode* args, Env* env);
+        Object* specialCond(ListNode* args, Env* env);
+        Object* specialLet(ListNode* args, Env* env);
+        Object* specialDefmacro(ListNode* args, Env* env);
+        Object* specialDelay(ListNode* args, Env* env);
+        Object* specialStreamCons(ListNode* args, Env* env);
+        Object* specialDefineRecord(ListNode* args, Env* env);
+        void defineRecordProcedure(Env* env, string name, RecordType* type, funcType kind, int slot);
+        Object* applyRecord(Procedure* procedure, Object** args, int count);
+        Object* applyCompiled(Procedure* procedure, Object** args, int count);
+        inline static EvalApply* aotHost = nullptr;
+        static Object* aotCall(Object** values, int count);
+        static Object* aotLookup(Object* symbol, Object*** cell);
+        static Object* aotMakeInt(long value);
+        static bool aotIsTrue(Object* value);
+        Object* specialModule(ListNode* args, Env* env);
+        Object* specialImport(ListNode* args, Env* env);
+        Object* primitivePlus(Object** args, int count);
+        Object* primitiveMinus(Object** args, int count);
+        Object* primitiveMultiply(Object** args, int count);
+        Object* primitiveDivide(Object** args, int count);
+        Object* primitiveLess(Object** args, int count);
+        Object* primitiveGreater(Object** args, int count);
+        Object* primitiveEquals(Object** args, int count); 
+        Object* primitivePrint(Object** args, int count);
+        Object* primitiveCar(Object** args, int count);
+        Object* primitiveCdr(Object** args, int count);
+        Object* primitivePush(Object** args, int count);
+        Object* primitiveList(Object** args, int count);
+        Object* primitiveGensym(Object** args, int count);
+        Object* primitiveSpawn(Object** args, int count);
+        Object* primitiveSend(Object** args, int count);
+        Object* primitiveReceive(Object** args, int count);
+        Object* primitiveSelf(Object** args, int count);
+        Object* primitiveYield(Object** args, int count);
+        Object* primitiveLength(Object** args, int count);
+        Object* primitiveAppend(Object** args, int count);
+        Object* primitiveReverse(Object** args, int count);
+        Object* primitiveNth(Object** args, int count);
+        Object* primitiveAssoc(Object** args, int count);
+        Object* primitiveMember(Object** args, int count);
+        Object* primitiveMap(Object** args, int count);
+        Object* primitiveFilter(Object** args, int count);
+        Object* primitiveFoldLeft(Object** args, int count);
+        Object* primitiveFoldRight(Object** args, int count);
+        Object* primitiveLast(Object** args, int count);
+        Object* primitiveSort(Object** args, int count);
+        Object* primitiveForce(Object** args, int count);
+        Object* primitiveStreamCar(Object** args, int count);
+        Object* primitiveStreamCdr(Object** args, int count);
+        Object* primitiveStreamRange(Object** args, int count);
+        Object* primitiveStreamMap(Object** args, int count);
+        Object* primitiveStreamFilter(Object** args, int count);
+        Object* primitiveStreamTake(Object** args, int count);
+        Object* primitiveStreamFold(Object** args, int count);
+        Object* primitiveStreamList(Object** args, int count);
+        Object* primitiveOpenInputFile(Object** args, int count);
+        Object* primitiveReadLine(Object** args, int count);
+        Object* primitiveRead(Object** args, int count);
+        Object* primitiveClosePort(Object** args, int count);
+        Object* primitiveWithLines(Object** args, int count);
+        Object* primitiveReadFileBytes(Object** args, int count);
+        Object* primitiveStreamLines(Object** args, int count);
+        Object* primitiveStringLength(Object** args, int count);
+        Object* primitiveWrite(Object** args, int count);
+        Object* primitiveNewline(Object** args, int count);
+        Object* primitiveFlush(Object** args, int count);
+        Object* primitiveOpenOutputFile(Object** args, int count);
+        Object* primitiveOpenOutputString(Object** args, int count);
+        Object* primitiveGetOutputString(Object** args, int count);
+        Object* primitiveWriteToString(Object** args, int count);
+        Port* outputPort(Object** args, int count, int index);
+        Object* primitiveVector(Object** args, int count);
+        Object* primitiveVectorRef(Object** args, int count);
+        Object* primitiveVectorSet(Object** args, int count);
+        Object* primitiveVectorPush(Object** args, int count);
+        Object* primitiveVectorLength(Object** args, int count);
+        Object* primitiveVectorList(Object** args, int count);
+        Object* primitiveVmap(Object** args, int count);
+        Object* primitiveHashMap(Object** args, int count);
+        Object* primitiveMapGet(Object** args, int count);
+        Object* primitiveMapPut(Object** args, int count);
+        Object* primitiveMapRemove(Object** args, int count);
+        Object* primitiveMapHas(Object** args, int count);
+        Object* primitiveMapCount(Object** args, int count);
+        Object* primitiveMapKeys(Object** args, int count);
+        Object* primitiveMapEntries(Object** args, int count);
+        Object* primitiveTransient(Object** args, int count);
+        Object* primitivePersistent(Object** args, int count);
+        Object* primitiveCallCC(Object** args, int count);
+        Object* primitiveAutoload(Object** args, int count);
+        Object* primitiveLoadCompiled(Object** args, int count);
+        Object* escapeTo(Procedure* continuation, Object** args, int count);
+        Object* force(Object* obj);
+        Object* forceStream(Object* obj);
+        Object* pullStream(Object* tail, bool& fresh);
+        void releaseCell(Object* cell);
+        Object* streamCell(Object* head, Object* tail);
+        ThreadPool& threadPool();
+        bool isTrue(Object* obj);
+        Object* expand(Object* form);
+        bool expandLet(Object* form);
+        void expandBody(Object* code);
+        Object* copyTree(Object* form);
+        Object* applySpecial(SpecialForm* special, List* form, Env* env);
+        Object* applyMathPrimitive(Object** args, int count, char op);
+        Object* applyIntegerMath(Object** args, int count, char op);
+        Object* apply(Procedure* proc, Object** args, int count);
+        Object* applyList(Procedure* proc, List* args);
+        bool applyNative(Procedure* proc, Object** args, int count, Object*& result);
+        JitSymbol jitResolve(Object* symbol);
+        VmapOp vmapResolve(Object* symbol, Env* env);
+        void quicken(List* list, Object** evaluated, int count, Env* env);
+        void resolveSlot(QuickSlot& slot, Object* operand, Env* env);
+        Object* quickOperand(QuickSlot& slot, Object* operand, Env* env);
+        Object* evalQuick(List* list, QuickForm* quick, Env* env);
+        bool definesSymbol(List* bindings, Object* symbol);
+        Object* finishCall(Object** values, int count);
+        Procedure* parallelCallee(Object* operand, Env* env);
+        Object* evalParallel(List* list, Env* env);
+        Object* evalList(List* list, Env* env);
+        Object* eval(Object* obj, Env* env);
+
+        Env* allocFrame(Procedure* proc, Object** args);
+        void releaseFrame(Env* frame);
+        void captureFrame(Env* frame);
+        void defineIn(Env* env, Object* symbol, Object* value);
+        Object** envFind(Env* env, Object* symbol);
         void addBinding(Binding* binding);
-        void addPrimitive(string symbol, Object* (EvalApply::*func)(List*));
-        Object* envLookUp(List* env, Object* obj);
+        void addPrimitive(string symbol, Object* (EvalApply::*func)(Object**, int));
+        Object* envLookUp(Env* env, Object* obj);
         List* environment;
+        Env* globalEnv;
+        Env* freeFrames;
+        vector<pair<string, Object* (EvalApply::*)(Object**, int)>> primitives;
+        Jit jit;
+        int nativeFloor;
+        bool jitEnabled;
+        bool parallelEnabled;
+        bool unfolding;
+        bool pulling;
+        bool quickenEnabled;
+        Object* memoryError;
+        Scheduler scheduler;
+        ThreadPool* pool;
+        pid_t poolOwner;
+        Port* output;
+        unordered_map<Procedure*, int> liveContinuations;
+        unordered_map<string, Module*> modules;
+        vector<string> modulePath;
+        void initModulePath();
+        Module* makeModule(ListNode* form, string& error);
+        Module* findModule(string name, string& error);
+        Object* loadModule(Module* module);
+        uint64_t macroHash();
+        void cacheModule(Module* module, string path);
+        Object* moduleExport(Module* module, Object* symbol);
     public:
+        bool compileAot(string source, string output, string& error);
+        bool loadCompiled(string path, string& error);
         EvalApply(bool noisey = false);
         ~EvalApply();
         Object* eval(List* expression);
+        Object* eval(List* expression, List* env);
         void setTrace(bool trace);
+        void setJit(bool enabled);
+        bool getJit();
+        void setQuicken(bool enabled);
+        void setParallel(bool enabled);
+        bool getParallel();
+        const HeapStats& getHeapStats();
+        const EvalStats& getEvalStats();
+        string getStats(const string& format);
+        void setMemoryLimit(long bytes);
+        string memoryReport();
+        List* getEnvironment();
+        Env* getGlobalEnv();
+        void setEnvironment(List* env);
+        const unordered_map<string, Procedure*>& getMacros();
+        void defineMacro(string name, Procedure* macro);
+        string primitiveName(Procedure* proc);
+        string primitiveName(Object* (EvalApply::*func)(Object**, int));
+        Procedure* makePrimitive(string name);
 };
 
 void EvalApply::setTrace(bool trace) {
     loud = trace;
 }
 
+void EvalApply::setJit(bool enabled) {
+    jitEnabled = enabled;
+}
+
+bool EvalApply::getJit() {
+    return jitEnabled;
+}
+
+void EvalApply::setQuicken(bool enabled) {
+    quickenEnabled = enabled;
+}
+
+void EvalApply::setParallel(bool enabled) {
+    parallelEnabled = enabled;
+}
+
+bool EvalApply::getParallel() {
+    return parallelEnabled;
+}
+
+const HeapStats& EvalApply::getHeapStats() {
+    return heapStats;
+}
+
+const EvalStats& EvalApply::getEvalStats() {
+    return evalStats;
+}
+
+//One value for getStats: its metric family and the family's type, and
+//what goes after the family's name, a suffix and any labels.
+struct StatsSample {
+    string family;
+    string type;
+    string name;
+    long value;
+};
+
+//Every counter in evalStats and heapStats, as JSON or, given "prometheus",
+//in the Prometheus text format, where counters get _total on their names.
+string EvalApply::getStats(const string& format) {
+    vector<StatsSample> samples;
+    auto counter = [&](string family, string labels, long value) {
+        samples.push_back({family, "counter", labels, value});
+    };
+    for (int i = 0; i < numObjTypes; i++)
+        counter("eval_steps", "{type=\"" + typeStr[i] + "\"}", evalStats.evalSteps[i]);
+    counter("applies", "{kind=\"primitive\"}", evalStats.primitiveApplies);
+    counter("applies", "{kind=\"lambda\"}", evalStats.lambdaApplies);
+    counter("applies", "{kind=\"native\"}", evalStats.nativeApplies);
+    counter("applies", "{kind=\"compiled\"}", evalStats.compiledApplies);
+    counter("parallel_calls", "", evalStats.parallelCalls);
+    counter("vmap_kernel_items", "", evalStats.vmapKernelItems);
+    counter("quick_int_ops", "", evalStats.quickOps);
+    for (int i = SF_NONE + 1; i < SF_COUNT; i++)
+        counter("special_forms", "{form=\"" + specialForms[i].name + "\"}", evalStats.specialForms[i]);
+    counter("lookups", "", evalStats.lookups);
+    long cumulative = 0;
+    for (int i = 0; i < lookupBuckets; i++) {
+        cumulative += evalStats.lookupScans[i];
+        string le = i == lookupBuckets - 1 ? "+Inf":to_string((1L << i) - 1);
+        samples.push_back({"lookup_scan_length", "histogram", "_bucket{le=\"" + le + "\"}", cumulative});
+    }
+    samples.push_back({"lookup_scan_length", "histogram", "_sum", evalStats.lookupScanTotal});
+    samples.push_back({"lookup_scan_length", "histogram", "_count", cumulative});
+    counter("list_copies", "", evalStats.listCopies);
+    counter("list_nodes_copied", "", evalStats.copiedNodes);
+    counter("list_nodes_allocated", "", heapStats.totalListNodes);
+    for (int i = 0; i < numObjTypes; i++)
+        counter("objects_allocated", "{type=\"" + typeStr[i] + "\"}", heapStats.totalObjects[i]);
+    counter("heap_bytes_allocated", "", heapStats.totalBytes);
+    samples.push_back({"heap_bytes_live", "gauge", "", heapStats.liveBytes});
+    string report;
+    if (format == "prometheus") {
+        string family;
+        for (auto& sample : samples) {
+            string name = "mgclisp_" + sample.family + (sample.type == "counter" ? "_total":"");
+            if (sample.family != family)
+                report += "# TYPE " + name + " " + sample.type + "\n";
+            family = sample.family;
+            report += name + sample.name + " " + to_string(sample.value) + "\n";
+        }
+        return report;
+    }
+    //labels become part of the key: "eval_steps{type=AS_INT}".
+    report = "{";
+    for (auto& sample : samples) {
+        string key = sample.family + sample.name;
+        key.erase(remove(key.begin(), key.end(), '"'), key.end());
+        report += (report.size() > 1 ? ", ":"") + string("\"") + key + "\": " + to_string(sample.value);
+    }
+    return report + "}";
+}
+
+//bytes the live heap may grow by in any single top level evaluation, 0
+//for no limit.
+void EvalApply::setMemoryLimit(long bytes) {
+    heapStats.limit = bytes;
+}
+
+string EvalApply::memoryReport() {
+    string report = "live objects by type:\n";
+    for (int i = 0; i < numObjTypes; i++) {
+        report += "  " + typeStr[i] + ": " + to_string(heapStats.liveObjects[i]);
+        report += " (" + to_string(heapStats.totalObjects[i]) + " allocated)\n";
+    }
+    report += "list nodes: " + to_string(heapStats.liveListNodes) + " (" + to_string(heapStats.totalListNodes) + " allocated)\n";
+    report += "lists: " + to_string(heapStats.liveLists) + "\n";
+    report += "heap bytes: " + to_string(heapStats.liveBytes) + " live, " + to_string(heapStats.peakBytes) + " peak, ";
+    report += to_string(heapStats.totalBytes) + " allocated\n";
+    report += "last evaluation: " + to_string(heapStats.lastEvalBytes) + " bytes kept\n";
+    report += "limit: " + (heapStats.limit > 0 ? to_string(heapStats.limit) + " bytes per evaluation":string("none"));
+    return report;
+}
+
 void EvalApply::say(string s) {
     if (loud) {
         for (int i = 0; i < d; i++) cout<<" ";
@@ -86,24 +427,44 @@ void EvalApply::leave(string s) {
 void EvalApply::addBinding(Binding* binding) {
     environment->append(makeBindingObject(binding));
 }
-void EvalApply::addPrimitive(string symbol, Object* (EvalApply::*func)(List*)) {
+void EvalApply::addPrimitive(string symbol, Object* (EvalApply::*func)(Object**, int)) {
+    primitives.push_back(make_pair(symbol, func));
     addBinding(makeBinding(makeSymbolObject(symbol), makeFunctionObject(makeFunction(func))));
 }
 
 EvalApply::EvalApply(bool noisey) {
     loud = noisey;
     d = 0;
-    specialForms["define"] = {"define", 2, {NO_EVAL, EVAL}, &EvalApply::specialDefine};
-    specialForms["if"] = {"if", 3, {EVAL, NO_EVAL, NO_EVAL}, &EvalApply::specialIf};
-    specialForms["lambda"] = {"lambda", 2, {NO_EVAL, NO_EVAL}, &EvalApply::specialLambda};
-    specialForms["\\"] = {"\\", 2, {NO_EVAL, NO_EVAL}, &EvalApply::specialLambda};
-    specialForms["'"] = {"'", 2, {NO_EVAL, NO_EVAL}, &EvalApply::specialQuote};
-    specialForms["set"] = {"set", 2, {NO_EVAL, EVAL}, &EvalApply::specialSet};
-    specialForms["do"] = {"do", 0, {}, &EvalApply::specialDo};
-    specialForms["cond"] = {"cond", 0, {}, &EvalApply::specialCond};
-    specialForms["let"] = {"let",2, {NO_EVAL, NO_EVAL}, &EvalApply::specialLet};
-    
+    jitEnabled = true;
+    nativeFloor = INT_MAX;
+    parallelEnabled = false;
+    unfolding = false;
+    pulling = false;
+    quickenEnabled = true;
+    memoryError = makeErrorObject("<Error: memory limit exceeded>");
+    specialForms[SF_DEFINE] = {"define", 2, &EvalApply::specialDefine};
+    specialForms[SF_IF] = {"if", 3, &EvalApply::specialIf};
+    specialForms[SF_LAMBDA] = {"lambda", 2, &EvalApply::specialLambda};
+    specialForms[SF_QUOTE] = {"'", 1, &EvalApply::specialQuote};
+    specialForms[SF_SET] = {"set", 2, &EvalApply::specialSet};
+    specialForms[SF_DO] = {"do", 0, &EvalApply::specialDo};
+    specialForms[SF_COND] = {"cond", 0, &EvalApply::specialCond};
+    specialForms[SF_LET] = {"let", 2, &EvalApply::specialLet};
+    specialForms[SF_DEFMACRO] = {"defmacro", 3, &EvalApply::specialDefmacro};
+    specialForms[SF_DELAY] = {"delay", 1, &EvalApply::specialDelay};
+    specialForms[SF_STREAM_CONS] = {"stream-cons", 2, &EvalApply::specialStreamCons};
+    specialForms[SF_MODULE] = {"module", 2, &EvalApply::specialModule};
+    specialForms[SF_IMPORT] = {"import", 1, &EvalApply::specialImport};
+    specialForms[SF_DEFINE_RECORD] = {"define-record", 1, &EvalApply::specialDefineRecord};
+    macroGeneration = 0;
+    gensymCount = 0;
+
     environment = new List();
+    globalEnv = makeEnv(environment, nullptr);
+    freeFrames = nullptr;
+    pool = nullptr;
+    poolOwner = 0;
+    output = new Port("stdout", STDOUT_FILENO);
     addPrimitive("+", &EvalApply::primitivePlus);
     addPrimitive("-", &EvalApply::primitiveMinus);
     addPrimitive("/", &EvalApply::primitiveDivide);
@@ -116,69 +477,291 @@ EvalApply::EvalApply(bool noisey) {
     addPrimitive("cdr", &EvalApply::primitiveCdr);
     addPrimitive("push", &EvalApply::primitivePush);
     addPrimitive("list", &EvalApply::primitiveList);
+    addPrimitive("gensym", &EvalApply::primitiveGensym);
+    addPrimitive("spawn", &EvalApply::primitiveSpawn);
+    addPrimitive("send", &EvalApply::primitiveSend);
+    addPrimitive("receive", &EvalApply::primitiveReceive);
+    addPrimitive("self", &EvalApply::primitiveSelf);
+    addPrimitive("yield", &EvalApply::primitiveYield);
+    addPrimitive("length", &EvalApply::primitiveLength);
+    addPrimitive("append", &EvalApply::primitiveAppend);
+    addPrimitive("reverse", &EvalApply::primitiveReverse);
+    addPrimitive("nth", &EvalApply::primitiveNth);
+    addPrimitive("assoc", &EvalApply::primitiveAssoc);
+    addPrimitive("member", &EvalApply::primitiveMember);
+    addPrimitive("map", &EvalApply::primitiveMap);
+    addPrimitive("filter", &EvalApply::primitiveFilter);
+    addPrimitive("fold-left", &EvalApply::primitiveFoldLeft);
+    addPrimitive("fold-right", &EvalApply::primitiveFoldRight);
+    addPrimitive("last", &EvalApply::primitiveLast);
+    addPrimitive("sort", &EvalApply::primitiveSort);
+    addPrimitive("force", &EvalApply::primitiveForce);
+    addPrimitive("stream-car", &EvalApply::primitiveStreamCar);
+    addPrimitive("stream-cdr", &EvalApply::primitiveStreamCdr);
+    addPrimitive("stream-range", &EvalApply::primitiveStreamRange);
+    addPrimitive("stream-map", &EvalApply::primitiveStreamMap);
+    addPrimitive("stream-filter", &EvalApply::primitiveStreamFilter);
+    addPrimitive("stream-take", &EvalApply::primitiveStreamTake);
+    addPrimitive("stream-fold", &EvalApply::primitiveStreamFold);
+    addPrimitive("stream-list", &EvalApply::primitiveStreamList);
+    addPrimitive("open-input-file", &EvalApply::primitiveOpenInputFile);
+    addPrimitive("read-line", &EvalApply::primitiveReadLine);
+    addPrimitive("read", &EvalApply::primitiveRead);
+    addPrimitive("close-port", &EvalApply::primitiveClosePort);
+    addPrimitive("with-lines", &EvalApply::primitiveWithLines);
+    addPrimitive("read-file-bytes", &EvalApply::primitiveReadFileBytes);
+    addPrimitive("stream-lines", &EvalApply::primitiveStreamLines);
+    addPrimitive("string-length", &EvalApply::primitiveStringLength);
+    addPrimitive("write", &EvalApply::primitiveWrite);
+    addPrimitive("newline", &EvalApply::primitiveNewline);
+    addPrimitive("flush", &EvalApply::primitiveFlush);
+    addPrimitive("open-output-file", &EvalApply::primitiveOpenOutputFile);
+    addPrimitive("open-output-string", &EvalApply::primitiveOpenOutputString);
+    addPrimitive("get-output-string", &EvalApply::primitiveGetOutputString);
+    addPrimitive("write-to-string", &EvalApply::primitiveWriteToString);
+    addPrimitive("vector", &EvalApply::primitiveVector);
+    addPrimitive("vector-ref", &EvalApply::primitiveVectorRef);
+    addPrimitive("vector-set", &EvalApply::primitiveVectorSet);
+    addPrimitive("vector-push", &EvalApply::primitiveVectorPush);
+    addPrimitive("vector-length", &EvalApply::primitiveVectorLength);
+    addPrimitive("vector-list", &EvalApply::primitiveVectorList);
+    addPrimitive("vmap", &EvalApply::primitiveVmap);
+    addPrimitive("load-compiled", &EvalApply::primitiveLoadCompiled);
+    addPrimitive("hash-map", &EvalApply::primitiveHashMap);
+    addPrimitive("map-get", &EvalApply::primitiveMapGet);
+    addPrimitive("map-put", &EvalApply::primitiveMapPut);
+    addPrimitive("map-remove", &EvalApply::primitiveMapRemove);
+    addPrimitive("map-has?", &EvalApply::primitiveMapHas);
+    addPrimitive("map-count", &EvalApply::primitiveMapCount);
+    addPrimitive("map-keys", &EvalApply::primitiveMapKeys);
+    addPrimitive("map-entries", &EvalApply::primitiveMapEntries);
+    addPrimitive("transient", &EvalApply::primitiveTransient);
+    addPrimitive("persistent", &EvalApply::primitivePersistent);
+    addPrimitive("call/cc", &EvalApply::primitiveCallCC);
+    addPrimitive("call-with-current-continuation", &EvalApply::primitiveCallCC);
+    //the thunk of the promises import binds is named for heap images but
+    //isn't bound, so it can't be called.
+    primitives.push_back(make_pair("autoload", &EvalApply::primitiveAutoload));
+    initModulePath();
 }
 
+//Objects are shared freely, literals and symbols most of all, and nothing
+//records who holds what, so the heap itself is left alone. What only the
+//evaluator holds goes: the thread pool, the output port and the module
+//records, whose lists are freed without the forms in them. The JIT frees
+//its code and the scheduler its stacks as members.
 EvalApply::~EvalApply() {
-    destroyList(environment);
+    for (auto& it : modules) {
+        it.second->body->clear();
+        delete it.second->body;
+        delete it.second;
+    }
+    if (pool != nullptr && poolOwner == getpid())
+        delete pool;
+    delete output;
+}
+
+List* EvalApply::getEnvironment() {
+    return environment;
+}
+
+Env* EvalApply::getGlobalEnv() {
+    return globalEnv;
+}
+
+void EvalApply::setEnvironment(List* env) {
+    environment = env;
+    globalEnv->bindings = env;
 }
 
-Object* EvalApply::envLookUp(List* env, Object* obj) {
-    for (Object* it : *env) {
-        if (compareObject(obj, it->bindingVal->symbol))
-            return it->bindingVal->value;
+const unordered_map<string, Procedure*>& EvalApply::getMacros() {
+    return macros;
+}
+
+void EvalApply::defineMacro(string name, Procedure* macro) {
+    macros[name] = macro;
+    macroGeneration++;
+}
+
+string EvalApply::primitiveName(Procedure* proc) {
+    return primitiveName(proc->func);
+}
+
+string EvalApply::primitiveName(Object* (EvalApply::*func)(Object**, int)) {
+    for (auto& prim : primitives)
+        if (prim.second == func)
+            return prim.first;
+    return "";
+}
+
+Procedure* EvalApply::makePrimitive(string name) {
+    for (auto& prim : primitives)
+        if (prim.first == name)
+            return makeFunction(prim.second);
+    return nullptr;
+}
+
+//Finds the cell holding symbol's value: an argument of a call's frame or
+//the value of a binding. Each frame's arguments come before its defines,
+//and both before anything in the frames around it.
+Object** EvalApply::envFind(Env* env, Object* symbol) {
+    long scanned = 0;
+    for (Env* e = env; e != nullptr; e = e->parent) {
+        if (e->proc != nullptr) {
+            int i = 0;
+            for (Object* param : *e->proc->freeVars) {
+                if (compareObject(symbol, param)) {
+                    countLookup(scanned + i);
+                    return &e->args[i];
+                }
+                i++;
+            }
+            scanned += i;
+        }
+        if (e->bindings != nullptr) {
+            for (Object* it : *e->bindings) {
+                if (it->type == AS_BINDING && compareObject(symbol, it->bindingVal->symbol)) {
+                    countLookup(scanned);
+                    return &it->bindingVal->value;
+                }
+                scanned++;
+            }
+        }
     }
+    countLookup(scanned);
+    return nullptr;
+}
+
+//A name imported from a module that hasn't been loaded yet is bound to a
+//promise to autoload it, which is forced here the first time it's read.
+Object* EvalApply::envLookUp(Env* env, Object* obj) {
+    Object** cell = envFind(env, obj);
+    if (cell != nullptr && (*cell)->type == AS_PROMISE && (*cell)->promiseVal->func == &EvalApply::primitiveAutoload) {
+        Object* value = force(*cell);
+        if (value->type != AS_ERROR)
+            *cell = value;
+        return value;
+    }
+    if (cell != nullptr)
+        return *cell;
     return makeErrorObject("<Error: " + toString(obj) + " Not Found>");
 }
 
-Object* EvalApply::specialDefine(List* args, List* env) {
-    Object* label = args->first()->info;
-    Object* value = args->first()->next->info;
-    env->append(makeBindingObject(makeBinding(label, value)));
-    return label;
+void EvalApply::defineIn(Env* env, Object* symbol, Object* value) {
+    if (env->bindings == nullptr)
+        env->bindings = new List();
+    env->bindings->append(makeBindingObject(makeBinding(symbol, value)));
 }
 
-Object* EvalApply::specialIf(List* args, List* env) {
-    Object* test = args->first()->info;
-    Object* posRes = args->first()->next->info;
-    Object* negRes = args->first()->next->next->info;
-    if (test->type == AS_BOOL) {
-        return test->boolVal ? eval(posRes, env):eval(negRes, env);
+//Frames come off a free list, so a call doesn't allocate one.
+Env* EvalApply::allocFrame(Procedure* proc, Object** args) {
+    if (freeFrames == nullptr) {
+        const int chunk = 64;
+        Env* frames = new Env[chunk];
+        heapAllocated(chunk * sizeof(Env));
+        for (int i = 0; i < chunk; i++) {
+            frames[i].parent = freeFrames;
+            freeFrames = &frames[i];
+        }
     }
-    if (test->type == AS_SYMBOL && *test->strVal == "NIL")
-        return eval(negRes, env);
-    return eval(posRes, env);
+    Env* frame = freeFrames;
+    freeFrames = frame->parent;
+    frame->proc = proc;
+    frame->args = args;
+    frame->bindings = nullptr;
+    frame->parent = proc->env;
+    frame->captured = false;
+    return frame;
+}
+
+void EvalApply::releaseFrame(Env* frame) {
+    if (frame->captured)
+        return;
+    frame->parent = freeFrames;
+    freeFrames = frame;
+}
+
+FrameGuard::~FrameGuard() {
+    evaluator->releaseFrame(frame);
+}
+
+FlagGuard::FlagGuard(bool& flag, bool value) : flag(flag), saved(flag) {
+    flag = value;
 }
 
-Object* EvalApply::specialLambda(List* args, List* env) {
-    Object* argsList = args->first()->info;
-    Object* code = args->first()->next->info;  
+FlagGuard::~FlagGuard() {
+    flag = saved;
+}
+
+//A closure made inside a call keeps its frame, so the arguments move off
+//the stack into memory of their own. Everything further out is already
+//captured: it is the environment of some procedure.
+void EvalApply::captureFrame(Env* frame) {
+    if (frame->captured)
+        return;
+    int count = frame->proc->freeVars->size();
+    Object** args = new Object*[count];
+    heapAllocated(count * sizeof(Object*));
+    for (int i = 0; i < count; i++)
+        args[i] = frame->args[i];
+    frame->args = args;
+    frame->captured = true;
+}
+
+Object* EvalApply::specialDefine(ListNode* args, Env* env) {
+    Object* label = args->info;
+    Object* value = eval(args->next->info, env);
+    if (label->type == AS_SYMBOL)
+        jit.invalidate(*label->strVal);
+    defineIn(env, label, value);
+    return label;
+}
+
+//false and NIL are false, everything else is true.
+bool EvalApply::isTrue(Object* obj) {
+    if (obj->type == AS_BOOL)
+        return obj->boolVal;
+    return !(obj->type == AS_SYMBOL && *obj->strVal == "NIL");
+}
+
+Object* EvalApply::specialIf(ListNode* args, Env* env) {
+    Object* test = eval(args->info, env);
+    Object* posRes = args->next->info;
+    Object* negRes = args->next->next->info;
+    return isTrue(test) ? eval(posRes, env):eval(negRes, env);
+}
+
+Object* EvalApply::specialLambda(ListNode* args, Env* env) {
+    Object* argsList = args->info;
+    Object* code = args->next->info;
     List* argList = argsList->listVal;
+    expandBody(code);
+    captureFrame(env);
     return makeFunctionObject(allocFunction(argList, code, env, LAMBDA));
 }
 
-Object* EvalApply::specialQuote(List* args, List* env) {
-    return args->first()->info;
+Object* EvalApply::specialQuote(ListNode* args, Env*) {
+    return args->info;
 }
 
-Object* EvalApply::specialSet(List* args, List* env) {
-    Object* symbol = args->first()->info;
-    Object* replacement = args->first()->next->info;
-    for (Object* curr : *env) {
-        if (curr->type == AS_BINDING) {
-            if (compareObject(curr->bindingVal->symbol, symbol)) {
-                curr->bindingVal->value = replacement;
-                return replacement;
-            }
-        }
+Object* EvalApply::specialSet(ListNode* args, Env* env) {
+    Object* symbol = args->info;
+    Object* replacement = eval(args->next->info, env);
+    if (symbol->type == AS_SYMBOL)
+        jit.invalidate(*symbol->strVal);
+    Object** cell = envFind(env, symbol);
+    if (cell != nullptr) {
+        *cell = replacement;
+        return replacement;
     }
-    env->append(makeBindingObject(makeBinding(symbol, replacement)));
+    defineIn(env, symbol, replacement);
     return replacement;
 }
 
-Object* EvalApply::specialDo(List* args, List* env) {
-    Object* result;
-    for (Object* info : *args) {
-        result = eval(info, env);
+Object* EvalApply::specialDo(ListNode* args, Env* env) {
+    Object* result = makeListObject(new List());
+    for (ListNode* it = args; it != nullptr; it = it->next) {
+        result = eval(it->info, env);
         if (result->type == AS_ERROR) {
             return result;
         }
@@ -186,14 +769,13 @@ Object* EvalApply::specialDo(List* args, List* env) {
     return result;
 }
 
-Object* EvalApply::specialCond(List* args, List* env) {
+Object* EvalApply::specialCond(ListNode* args, Env* env) {
     Object* result = makeIntObject(0);
-    for (Object* info : *args) {
-        if (getObjectType(info) != AS_LIST) {
+    for (ListNode* it = args; it != nullptr; it = it->next) {
+        if (getObjectType(it->info) != AS_LIST) {
             return makeErrorObject("Error: cond operates on lists only.");
         }
-        List* toEval = info->listVal;
-        result = eval(info, env);
+        result = eval(it->info, env);
         if (result->type == AS_ERROR) {
             return result;
         }
@@ -201,9 +783,11 @@ Object* EvalApply::specialCond(List* args, List* env) {
     return result;
 }
 
-Object* EvalApply::specialLet(List* args, List* env) {
-    List* vars = args->first()->info->listVal;
-    List* body = args->first()->next->info->listVal;
+Object* EvalApply::specialLet(ListNode* args, Env* env) {
+    if (args->info->type != AS_LIST || args->next->info->type != AS_LIST)
+        return makeErrorObject("Let requires its own association list");
+    List* vars = args->info->listVal;
+    List* body = args->next->info->listVal;
     List* var_names = new List();
     List* var_vals = new List();
     for (Object* info : *vars) {
@@ -214,6 +798,7 @@ Object* EvalApply::specialLet(List* args, List* env) {
             return makeErrorObject("Let requires its own association list");
         }
     }
+    captureFrame(env);
     Procedure* tempfunc = allocFunction(var_names, makeListObject(body), env, LAMBDA);
     List* asList = new List();
     asList->append(makeFunctionObject(tempfunc));
@@ -221,216 +806,1747 @@ Object* EvalApply::specialLet(List* args, List* env) {
     return eval(makeListObject(asList), env);
 }
 
-Object* EvalApply::primitivePlus(List* args) {
-    say("primitive plus " + args->asString());
-    return applyMathPrimitive(args, "+");
-}
-Object* EvalApply::primitiveMinus(List* args) {
-    say("primitive minus " + args->asString());
-    return applyMathPrimitive(args, "-");
+Object* EvalApply::specialDefmacro(ListNode* args, Env*) {
+    Object* label = args->info;
+    Object* params = args->next->info;
+    Object* body = args->next->next->info;
+    if (label->type != AS_SYMBOL || params->type != AS_LIST)
+        return makeErrorObject("<Error: defmacro requires a name and a parameter list>");
+    defineMacro(*label->strVal, allocFunction(params->listVal, body, globalEnv, LAMBDA));
+    return label;
 }
-Object* EvalApply::primitiveMultiply(List* args) {
-    say("primitive multiply " + args->asString());
-    return applyMathPrimitive(args, "*");
+
+//(delay expr) is a promise to evaluate expr in this environment, once.
+Object* EvalApply::specialDelay(ListNode* args, Env* env) {
+    captureFrame(env);
+    return makePromiseObject(args->info, env);
 }
-Object* EvalApply::primitiveDivide(List* args) {
-    say("primitive divide" + args->asString());
-    return applyMathPrimitive(args, "/");
+
+//(stream-cons a b) is (a (delay b)).
+Object* EvalApply::specialStreamCons(ListNode* args, Env* env) {
+    Object* head = eval(args->info, env);
+    if (head->type == AS_ERROR)
+        return head;
+    captureFrame(env);
+    return streamCell(head, makePromiseObject(args->next->info, env));
 }
-Object* EvalApply::primitiveLess(List* args) {
-    say("primitive less " + args->asString());
-    Object* first = args->first()->info;
-    Object* second = args->first()->next->info;
-    bool result;
-    if ((first->type == AS_INT || first->type == AS_REAL) && (second->type == AS_INT || second->type == AS_REAL)) {
-        double lhs = first->type == AS_INT ? first->intVal:first->realVal;
-        double rhs = second->type == AS_INT ? second->intVal:second->realVal;
-        result = lhs < rhs;
-    } else {
-        result = toString(first) < toString(second);
-    }
-    return makeBoolObject(result);
-}
-Object* EvalApply::primitiveGreater(List* args) {
-    say("primitive greager " + args->asString());
-    Object* first = args->first()->info;
-    Object* second = args->first()->next->info;
-    bool result;
-    if ((first->type == AS_INT || first->type == AS_REAL) && (second->type == AS_INT || second->type == AS_REAL)) {
-        double lhs = first->type == AS_INT ? first->intVal:first->realVal;
-        double rhs = second->type == AS_INT ? second->intVal:second->realVal;
-        result = rhs < lhs;
-    } else {
-        result = toString(second) < toString(first);
+
+//(define-record name field...) defines make-name, which takes a value for
+//each field, name?, and an accessor name-field for each field. A record's
+//slots are laid out in field order when its type is defined, so reading a
+//field is a type check and an index.
+Object* EvalApply::specialDefineRecord(ListNode* args, Env* env) {
+    Object* name = args->info;
+    if (name->type != AS_SYMBOL)
+        return makeErrorObject("<Error: define-record requires a name and field names>");
+    List* fields = new List();
+    for (ListNode* it = args->next; it != nullptr; it = it->next) {
+        if (it->info->type != AS_SYMBOL)
+            return makeErrorObject("<Error: define-record requires a name and field names>");
+        fields->append(it->info);
     }
-    return makeBoolObject(result);
+    RecordType* type = makeRecordType(name, fields, fields->size());
+    defineRecordProcedure(env, "make-" + *name->strVal, type, RECORD_CONSTRUCTOR, 0);
+    defineRecordProcedure(env, *name->strVal + "?", type, RECORD_PREDICATE, 0);
+    int slot = 0;
+    for (Object* field : *fields)
+        defineRecordProcedure(env, *name->strVal + "-" + *field->strVal, type, RECORD_ACCESSOR, slot++);
+    return name;
+}
+
+void EvalApply::defineRecordProcedure(Env* env, string name, RecordType* type, funcType kind, int slot) {
+    Procedure* proc = allocFunction(nullptr, nullptr, nullptr, kind);
+    proc->record = type;
+    proc->slot = slot;
+    proc->noJit = true;
+    jit.invalidate(name);
+    defineIn(env, makeSymbolObject(name), makeFunctionObject(proc));
+}
+
+Object* EvalApply::primitivePlus(Object** args, int count) {
+    if (loud) say("primitive plus " + spanString(args, count));
+    return applyMathPrimitive(args, count, '+');
+}
+Object* EvalApply::primitiveMinus(Object** args, int count) {
+    if (loud) say("primitive minus " + spanString(args, count));
+    return applyMathPrimitive(args, count, '-');
+}
+Object* EvalApply::primitiveMultiply(Object** args, int count) {
+    if (loud) say("primitive multiply " + spanString(args, count));
+    return applyMathPrimitive(args, count, '*');
 }
-Object* EvalApply::primitiveEquals(List* args) {
-    say("primitive equals" + args->asString());
-    Object* first = args->first()->info;
-    Object* second = args->first()->next->info;
+Object* EvalApply::primitiveDivide(Object** args, int count) {
+    if (loud) say("primitive divide" + spanString(args, count));
+    return applyMathPrimitive(args, count, '/');
+}
+Object* EvalApply::primitiveLess(Object** args, int count) {
+    if (loud) say("primitive less " + spanString(args, count));
+    if (count != 2)
+        return makeErrorObject("<Error: < requires two arguments>");
+    return makeBoolObject(orderedBefore(args[0], args[1]));
+}
+Object* EvalApply::primitiveGreater(Object** args, int count) {
+    if (loud) say("primitive greager " + spanString(args, count));
+    if (count != 2)
+        return makeErrorObject("<Error: > requires two arguments>");
+    return makeBoolObject(orderedBefore(args[1], args[0]));
+}
+Object* EvalApply::primitiveEquals(Object** args, int count) {
+    if (loud) say("primitive equals" + spanString(args, count));
+    if (count != 2)
+        return makeErrorObject("<Error: eq requires two arguments>");
+    Object* first = args[0];
+    Object* second = args[1];
     return makeBoolObject(compareObject(first, second));
 }
-Object* EvalApply::primitivePrint(List* args) {
+Object* EvalApply::primitivePrint(Object** args, int count) {
     List* evaldArgs = new List();
-    for (Object* it : *args) {
-        Object* ce = eval(it, environment);
+    for (int i = 0; i < count; i++) {
+        Object* ce = eval(args[i], globalEnv);
         evaldArgs->append(ce);
     }
     if (evaldArgs->size() == 1 && evaldArgs->first()->info->type == AS_LIST) {
-        cout<<evaldArgs->first()->info->listVal->asString()<<endl;
+        output->print(evaldArgs->first()->info);
     } else {
-        cout<<evaldArgs->asString()<<endl;
+        output->print(makeListObject(evaldArgs));
     }
-    return new Object();
+    output->write("\n", 1);
+    return makeIntObject(0);
 }
-Object* EvalApply::primitiveCar(List* args) {
-    say("primitive car " + toString(args->first()->info));
-    if (getObjectType(args->first()->info) != AS_LIST)
+Object* EvalApply::primitiveCar(Object** args, int count) {
+    if (count != 1)
+        return makeErrorObject("<Error: car requires one argument>");
+    if (loud) say("primitive car " + toString(args[0]));
+    if (getObjectType(args[0]) != AS_LIST)
         return makeErrorObject("Error: car must be supplied a list");
-    return args->first()->info->listVal->first()->info;
+    return args[0]->listVal->first()->info;
 }
 
-Object* EvalApply::primitiveCdr(List* args) {
-    say("primitive cdr " + toString(args->first()->info));
-    if (getObjectType(args->first()->info) != AS_LIST)
+Object* EvalApply::primitiveCdr(Object** args, int count) {
+    if (count != 1)
+        return makeErrorObject("<Error: cdr requires one argument>");
+    if (loud) say("primitive cdr " + toString(args[0]));
+    if (getObjectType(args[0]) != AS_LIST)
         return makeErrorObject("Error: cdr must be supplied a list");
-    return makeListObject(args->first()->info->listVal->rest());
+    return makeListObject(args[0]->listVal->rest());
 }
 
-Object* EvalApply::primitivePush(List* args) {
-    if (args->first()->next->info->type != AS_LIST) {
+Object* EvalApply::primitivePush(Object** args, int count) {
+    if (count != 2)
+        return makeErrorObject("<Error: push requires a value and a list>");
+    if (args[1]->type != AS_LIST) {
         return makeErrorObject("<Error: Can only push to a list!>");
     }
-    Object* toPush = args->first()->info;
-    List* addTo = args->first()->next->info->listVal->copy();
+    Object* toPush = args[0];
+    List* addTo = args[1]->listVal->copy();
     addTo->push(toPush);
     return makeListObject(addTo);
 }
 
-Object* EvalApply::primitiveList(List* args) {
-    return makeListObject(args);
+Object* EvalApply::primitiveList(Object** args, int count) {
+    return makeListObject(listFromSpan(args, count));
+}
+
+Object* EvalApply::primitiveGensym(Object**, int count) {
+    if (count != 0)
+        return makeErrorObject("<Error: gensym takes no arguments>");
+    //'%' can never be lexed as part of a word, so these can't collide with user symbols.
+    return makeSymbolObject("%g" + to_string(++gensymCount));
+}
+
+//(spawn f args...) runs (f args...) as a new task and returns its id.
+Object* EvalApply::primitiveSpawn(Object** args, int count) {
+    if (count == 0 || args[0]->type != AS_FUNCTION)
+        return makeErrorObject("<Error: spawn requires a function>");
+    Procedure* proc = args[0]->procedureVal;
+    List* procArgs = listFromSpan(args + 1, count - 1);
+    int id = scheduler.spawn([this, proc, procArgs]() { return applyList(proc, procArgs); });
+    if (id < 0)
+        return makeErrorObject("<Error: could not allocate a stack for a new task>");
+    return makeIntObject(id);
+}
+
+Object* EvalApply::primitiveSend(Object** args, int count) {
+    if (count != 2 || args[0]->type != AS_INT)
+        return makeErrorObject("<Error: send requires a task id and a message>");
+    Object* message = args[1];
+    if (!scheduler.send(args[0]->intVal, message))
+        return makeErrorObject("<Error: no task " + toString(args[0]) + ">");
+    return message;
+}
+
+Object* EvalApply::primitiveReceive(Object**, int count) {
+    if (count != 0)
+        return makeErrorObject("<Error: receive takes no arguments>");
+    Object* message;
+    if (!scheduler.receive(message))
+        return makeErrorObject("<Error: receive would wait forever, no other task can run>");
+    return message;
+}
+
+Object* EvalApply::primitiveSelf(Object**, int count) {
+    if (count != 0)
+        return makeErrorObject("<Error: self takes no arguments>");
+    return makeIntObject(scheduler.self());
 }
 
-List* EvalApply::makeNewEnvironment(List* vars, List* vals) {
-    List* nenv = new List();
-    ListNode* currVar = vars->first();
-    ListNode* currVal = vals->first();
-    for (int i = 0; i < vars->size(); i++) {
-        nenv->append(makeBindingObject(makeBinding(currVar->info, currVal->info)));
-        currVar = currVar->next;
-        currVal = currVal->next;
+Object* EvalApply::primitiveYield(Object**, int count) {
+    if (count != 0)
+        return makeErrorObject("<Error: yield takes no arguments>");
+    scheduler.yield();
+    return makeBoolObject(true);
+}
+
+/*
+ * The list library. Each of these walks its input once, building its
+ * result as it goes, and calls a function argument with apply directly on
+ * a small array of arguments rather than through an evaluated call form.
+ */
+
+Object* EvalApply::primitiveLength(Object** args, int count) {
+    if (count != 1 || args[0]->type != AS_LIST)
+        return makeErrorObject("<Error: length requires a list>");
+    return makeIntObject(args[0]->listVal->size());
+}
+
+Object* EvalApply::primitiveAppend(Object** args, int count) {
+    List* result = new List();
+    for (int i = 0; i < count; i++) {
+        if (args[i]->type != AS_LIST)
+            return makeErrorObject("<Error: append requires lists>");
+        for (Object* it : *args[i]->listVal)
+            result->append(it);
     }
-    return nenv;
+    return makeListObject(result);
 }
 
-Object* EvalApply::applySpecial(SpecialForm* special, List* args, List* env) {
-    enter();
-    ListNode* currArg = args->first();
-    List* evaluated_args = new List();
-    for (int i = 0; i < args->size(); i++) {
-        Object* result = currArg->info;
-        if (special->numArgs != 0 && special->flags[i] == EVAL) {
-            result = eval(currArg->info, env);
+Object* EvalApply::primitiveReverse(Object** args, int count) {
+    if (count != 1 || args[0]->type != AS_LIST)
+        return makeErrorObject("<Error: reverse requires a list>");
+    List* result = new List();
+    for (Object* it : *args[0]->listVal)
+        result->push(it);
+    return makeListObject(result);
+}
+
+//(nth n list), counting from 0.
+Object* EvalApply::primitiveNth(Object** args, int count) {
+    if (count != 2 || args[0]->type != AS_INT || args[1]->type != AS_LIST)
+        return makeErrorObject("<Error: nth requires an index and a list>");
+    int n = args[0]->intVal;
+    if (n < 0 || n >= args[1]->listVal->size())
+        return makeErrorObject("<Error: nth index " + to_string(n) + " out of range>");
+    return args[1]->listVal->getNthNode(n)->info;
+}
+
+//(assoc key alist) is the first (key value...) entry of alist, or false.
+Object* EvalApply::primitiveAssoc(Object** args, int count) {
+    if (count != 2 || args[1]->type != AS_LIST)
+        return makeErrorObject("<Error: assoc requires a key and a list>");
+    for (Object* it : *args[1]->listVal) {
+        if (it->type == AS_LIST && !it->listVal->empty() && compareObject(args[0], it->listVal->first()->info))
+            return it;
+    }
+    return makeBoolObject(false);
+}
+
+//(member x list) is the rest of list starting at x, or false.
+Object* EvalApply::primitiveMember(Object** args, int count) {
+    if (count != 2 || args[1]->type != AS_LIST)
+        return makeErrorObject("<Error: member requires an item and a list>");
+    for (ListNode* it = args[1]->listVal->first(); it != nullptr; it = it->next) {
+        if (compareObject(args[0], it->info)) {
+            List* result = new List();
+            for (; it != nullptr; it = it->next)
+                result->append(it->info);
+            return makeListObject(result);
+        }
+    }
+    return makeBoolObject(false);
+}
+
+//(map f list...) applies f to the first items of each list, then the
+//second, and so on, stopping at the end of the shortest.
+Object* EvalApply::primitiveMap(Object** args, int count) {
+    if (count < 2 || count > mapMaxLists + 1 || args[0]->type != AS_FUNCTION)
+        return makeErrorObject("<Error: map requires a function and lists>");
+    Procedure* proc = args[0]->procedureVal;
+    ListNode* its[mapMaxLists];
+    Object* argv[mapMaxLists];
+    int numLists = count - 1;
+    for (int i = 0; i < numLists; i++) {
+        if (args[i+1]->type != AS_LIST)
+            return makeErrorObject("<Error: map requires a function and lists>");
+        its[i] = args[i+1]->listVal->first();
+    }
+    List* result = new List();
+    while (true) {
+        for (int i = 0; i < numLists; i++) {
+            if (its[i] == nullptr)
+                return makeListObject(result);
+            argv[i] = its[i]->info;
+            its[i] = its[i]->next;
         }
-        evaluated_args->append(result);
-        currArg = currArg->next;
+        Object* value = apply(proc, argv, numLists);
+        if (value->type == AS_ERROR)
+            return value;
+        result->append(value);
+    }
+}
+
+Object* EvalApply::primitiveFilter(Object** args, int count) {
+    if (count != 2 || args[0]->type != AS_FUNCTION || args[1]->type != AS_LIST)
+        return makeErrorObject("<Error: filter requires a function and a list>");
+    Procedure* proc = args[0]->procedureVal;
+    List* result = new List();
+    for (Object* it : *args[1]->listVal) {
+        Object* argv[1] = {it};
+        Object* keep = apply(proc, argv, 1);
+        if (keep->type == AS_ERROR)
+            return keep;
+        if (isTrue(keep))
+            result->append(it);
+    }
+    return makeListObject(result);
+}
+
+//(fold-left f init list) is (f (f (f init x1) x2) x3).
+Object* EvalApply::primitiveFoldLeft(Object** args, int count) {
+    if (count != 3 || args[0]->type != AS_FUNCTION || args[2]->type != AS_LIST)
+        return makeErrorObject("<Error: fold-left requires a function, an initial value and a list>");
+    Procedure* proc = args[0]->procedureVal;
+    Object* acc = args[1];
+    for (Object* it : *args[2]->listVal) {
+        Object* argv[2] = {acc, it};
+        acc = apply(proc, argv, 2);
+        if (acc->type == AS_ERROR)
+            return acc;
+    }
+    return acc;
+}
+
+//(fold-right f init list) is (f x1 (f x2 (f x3 init))).
+Object* EvalApply::primitiveFoldRight(Object** args, int count) {
+    if (count != 3 || args[0]->type != AS_FUNCTION || args[2]->type != AS_LIST)
+        return makeErrorObject("<Error: fold-right requires a function, an initial value and a list>");
+    Procedure* proc = args[0]->procedureVal;
+    vector<Object*> items;
+    items.reserve(args[2]->listVal->size());
+    for (Object* it : *args[2]->listVal)
+        items.push_back(it);
+    Object* acc = args[1];
+    for (int i = items.size() - 1; i >= 0; i--) {
+        Object* argv[2] = {items[i], acc};
+        acc = apply(proc, argv, 2);
+        if (acc->type == AS_ERROR)
+            return acc;
+    }
+    return acc;
+}
+
+Object* EvalApply::primitiveLast(Object** args, int count) {
+    if (count != 1 || args[0]->type != AS_LIST || args[0]->listVal->empty())
+        return makeErrorObject("<Error: last requires a non empty list>");
+    return args[0]->listVal->getNthNode(args[0]->listVal->size() - 1)->info;
+}
+
+//Made on first use, and again in a forked child, which can't use the
+//threads its parent started.
+ThreadPool& EvalApply::threadPool() {
+    if (pool == nullptr || poolOwner != getpid()) {
+        pool = new ThreadPool();
+        poolOwner = getpid();
+    }
+    return *pool;
+}
+
+//(sort list less?) returns a new list, stably sorted. With < or > as the
+//comparison large lists are sorted in parallel; any other function is
+//called from this thread only, since evaluation isn't thread safe.
+Object* EvalApply::primitiveSort(Object** args, int count) {
+    if (count != 2 || args[0]->type != AS_LIST || args[1]->type != AS_FUNCTION)
+        return makeErrorObject("<Error: sort requires a list and a comparison function>");
+    vector<Object*> items;
+    items.reserve(args[0]->listVal->size());
+    for (Object* it : *args[0]->listVal)
+        items.push_back(it);
+    Procedure* proc = args[1]->procedureVal;
+    if (proc->type == PRIMITIVE && proc->func == &EvalApply::primitiveLess) {
+        parallelStableSort(items, [](Object* a, Object* b) { return orderedBefore(a, b); }, threadPool());
+    } else if (proc->type == PRIMITIVE && proc->func == &EvalApply::primitiveGreater) {
+        parallelStableSort(items, [](Object* a, Object* b) { return orderedBefore(b, a); }, threadPool());
+    } else {
+        Object* error = nullptr;
+        adaptiveStableSort(items, [&](Object* a, Object* b) {
+            if (error != nullptr)
+                return false;
+            Object* argv[2] = {a, b};
+            Object* result = apply(proc, argv, 2);
+            if (result->type == AS_ERROR)
+                error = result;
+            return error == nullptr && isTrue(result);
+        });
+        if (error != nullptr)
+            return error;
     }
+    List* result = new List();
+    for (Object* it : items)
+        result->append(it);
+    return makeListObject(result);
+}
+
+/*
+ * Streams. A stream is () or a cell (head tail) whose tail is a promise of
+ * the rest of the stream, so nothing past the head exists until it's asked
+ * for. The stream primitives make their tails as promises to call
+ * themselves again on the rest of their input, and a pipeline of them
+ * only ever computes one element at a time.
+ *
+ * stream-fold and stream-list look at each cell once, so rather than force
+ * their way along, keeping every cell in the promise before it, they pull
+ * (see pullStream): the stages run without memoizing and the cells they
+ * make are freed as soon as they're read, which keeps a pipeline over any
+ * number of elements to a few cells at a time.
+ */
+
+//The value of a promise, computed on the first force and kept. Anything
+//else is its own value.
+Object* EvalApply::force(Object* obj) {
+    if (obj->type != AS_PROMISE)
+        return obj;
+    Promise* promise = obj->promiseVal;
+    if (promise->value != nullptr)
+        return promise->value;
+    //streams are forced from loops that never reach eval.
+    if (heapStats.exceeded)
+        return memoryError;
+    Object* value;
+    if (promise->code != nullptr)
+        value = eval(promise->code, promise->env);
+    else
+        value = (this->*promise->func)(promise->args, promise->count);
+    //an error isn't kept, so forcing again tries again.
+    if (value->type == AS_ERROR)
+        return value;
+    promise->value = value;
+    promise->code = nullptr;
+    promise->env = nullptr;
+    promise->count = 0;
+    return value;
+}
+
+//Forces obj until it's a stream cell or (), since a tail may be a promise
+//of another promise.
+Object* EvalApply::forceStream(Object* obj) {
+    while (obj->type == AS_PROMISE)
+        obj = force(obj);
+    if (obj->type == AS_ERROR)
+        return obj;
+    if (obj->type != AS_LIST || (!obj->listVal->empty() && obj->listVal->size() != 2))
+        return makeErrorObject("<Error: not a stream: " + toString(obj) + ">");
+    return obj;
+}
+
+//The stream after tail, for a reader that won't look at it again. A
+//stage's promise that hasn't been forced is run without keeping its value,
+//and told to pull its own input the same way. The cell it returns is
+//fresh, reachable only by the caller, which frees it with releaseCell once
+//it has its head and tail, and that tail is owned, freed here after it's
+//been run in turn. Anything else, like a promise from stream-cons or one
+//already forced, is forced as usual and isn't fresh. A held stream is
+//never changed by this, though its stages may run again if it's forced
+//later.
+Object* EvalApply::pullStream(Object* tail, bool& fresh) {
+    fresh = false;
+    if (tail->type != AS_PROMISE || tail->promiseVal->value != nullptr)
+        return forceStream(tail);
+    Promise* promise = tail->promiseVal;
+    auto func = promise->func;
+    bool stage = func == &EvalApply::primitiveStreamMap || func == &EvalApply::primitiveStreamFilter
+              || func == &EvalApply::primitiveStreamTake || func == &EvalApply::primitiveStreamRange
+              || func == &EvalApply::primitiveStreamLines;
+    if (!stage)
+        return forceStream(tail);
+    if (heapStats.exceeded)
+        return memoryError;
+    pulling = true;
+    Object* cell = (this->*func)(promise->args, promise->count);
+    pulling = false;
+    if (promise->owned)
+        destroyObject(tail);
+    if (cell->type == AS_ERROR || cell->listVal->empty())
+        return cell;
+    fresh = true;
+    Object* next = cell->listVal->first()->next->info;
+    if (next->type == AS_PROMISE)
+        next->promiseVal->owned = true;
+    return cell;
+}
+
+//Frees a fresh cell from pullStream, but not its head or tail.
+void EvalApply::releaseCell(Object* cell) {
+    cell->listVal->clear();
+    destroyObject(cell);
+}
+
+Object* EvalApply::streamCell(Object* head, Object* tail) {
+    List* cell = new List();
+    cell->append(head);
+    cell->append(tail);
+    return makeListObject(cell);
+}
+
+Object* EvalApply::primitiveForce(Object** args, int count) {
+    if (count != 1)
+        return makeErrorObject("<Error: force requires one argument>");
+    return force(args[0]);
+}
+
+Object* EvalApply::primitiveStreamCar(Object** args, int count) {
+    if (count != 1)
+        return makeErrorObject("<Error: stream-car requires a stream>");
+    Object* cell = forceStream(args[0]);
+    if (cell->type == AS_ERROR)
+        return cell;
+    if (cell->listVal->empty())
+        return makeErrorObject("<Error: stream-car of an empty stream>");
+    return cell->listVal->first()->info;
+}
+
+Object* EvalApply::primitiveStreamCdr(Object** args, int count) {
+    if (count != 1)
+        return makeErrorObject("<Error: stream-cdr requires a stream>");
+    Object* cell = forceStream(args[0]);
+    if (cell->type == AS_ERROR)
+        return cell;
+    if (cell->listVal->empty())
+        return makeErrorObject("<Error: stream-cdr of an empty stream>");
+    return forceStream(cell->listVal->first()->next->info);
+}
+
+//(stream-range lo hi) is lo, lo+1, ... up to but not including hi.
+Object* EvalApply::primitiveStreamRange(Object** args, int count) {
+    if (count != 2 || args[0]->type != AS_INT || args[1]->type != AS_INT)
+        return makeErrorObject("<Error: stream-range requires two integers>");
+    if (args[0]->intVal >= args[1]->intVal)
+        return makeListObject(new List());
+    Object* rest[2] = {makeIntObject(args[0]->intVal + 1), args[1]};
+    return streamCell(args[0], makePromiseObject(&EvalApply::primitiveStreamRange, rest, 2));
+}
+
+//The stages below pull their input if they're being pulled themselves,
+//which only pullStream asks for, so they take the flag before anything
+//else can run.
+Object* EvalApply::primitiveStreamMap(Object** args, int count) {
+    bool pull = pulling, fresh = false;
+    pulling = false;
+    if (count != 2 || args[0]->type != AS_FUNCTION)
+        return makeErrorObject("<Error: stream-map requires a function and a stream>");
+    Object* cell = pull ? pullStream(args[1], fresh):forceStream(args[1]);
+    if (cell->type == AS_ERROR || cell->listVal->empty())
+        return cell;
+    Object* argv[1] = {cell->listVal->first()->info};
+    Object* rest[2] = {args[0], cell->listVal->first()->next->info};
+    if (fresh)
+        releaseCell(cell);
+    Object* value = apply(args[0]->procedureVal, argv, 1);
+    if (value->type == AS_ERROR)
+        return value;
+    return streamCell(value, makePromiseObject(&EvalApply::primitiveStreamMap, rest, 2));
+}
+
+//Skips ahead to the next element that passes, forcing only as far as that.
+Object* EvalApply::primitiveStreamFilter(Object** args, int count) {
+    bool pull = pulling, fresh = false;
+    pulling = false;
+    if (count != 2 || args[0]->type != AS_FUNCTION)
+        return makeErrorObject("<Error: stream-filter requires a function and a stream>");
+    Object* cell = pull ? pullStream(args[1], fresh):forceStream(args[1]);
+    while (cell->type != AS_ERROR && !cell->listVal->empty()) {
+        Object* argv[1] = {cell->listVal->first()->info};
+        Object* tail = cell->listVal->first()->next->info;
+        if (fresh)
+            releaseCell(cell);
+        Object* keep = apply(args[0]->procedureVal, argv, 1);
+        if (keep->type == AS_ERROR)
+            return keep;
+        if (isTrue(keep)) {
+            Object* rest[2] = {args[0], tail};
+            return streamCell(argv[0], makePromiseObject(&EvalApply::primitiveStreamFilter, rest, 2));
+        }
+        cell = pull ? pullStream(tail, fresh):forceStream(tail);
+    }
+    return cell;
+}
+
+//(stream-take n stream) is the first n elements of stream, as a stream.
+Object* EvalApply::primitiveStreamTake(Object** args, int count) {
+    bool pull = pulling, fresh = false;
+    pulling = false;
+    if (count != 2 || args[0]->type != AS_INT)
+        return makeErrorObject("<Error: stream-take requires a count and a stream>");
+    if (args[0]->intVal <= 0)
+        return makeListObject(new List());
+    Object* cell = pull ? pullStream(args[1], fresh):forceStream(args[1]);
+    if (cell->type == AS_ERROR || cell->listVal->empty())
+        return cell;
+    Object* head = cell->listVal->first()->info;
+    Object* rest[2] = {makeIntObject(args[0]->intVal - 1), cell->listVal->first()->next->info};
+    if (fresh)
+        releaseCell(cell);
+    return streamCell(head, makePromiseObject(&EvalApply::primitiveStreamTake, rest, 2));
+}
+
+//(stream-fold f init stream) is fold-left over a stream.
+Object* EvalApply::primitiveStreamFold(Object** args, int count) {
+    if (count != 3 || args[0]->type != AS_FUNCTION)
+        return makeErrorObject("<Error: stream-fold requires a function, an initial value and a stream>");
+    Procedure* proc = args[0]->procedureVal;
+    Object* acc = args[1];
+    bool fresh = false;
+    Object* cell = forceStream(args[2]);
+    while (cell->type != AS_ERROR && !cell->listVal->empty()) {
+        Object* argv[2] = {acc, cell->listVal->first()->info};
+        Object* tail = cell->listVal->first()->next->info;
+        if (fresh)
+            releaseCell(cell);
+        acc = apply(proc, argv, 2);
+        if (acc->type == AS_ERROR)
+            return acc;
+        cell = pullStream(tail, fresh);
+    }
+    return cell->type == AS_ERROR ? cell:acc;
+}
+
+//The elements of a finite stream as a list.
+Object* EvalApply::primitiveStreamList(Object** args, int count) {
+    if (count != 1)
+        return makeErrorObject("<Error: stream-list requires a stream>");
+    List* result = new List();
+    bool fresh = false;
+    Object* cell = forceStream(args[0]);
+    while (cell->type != AS_ERROR && !cell->listVal->empty()) {
+        result->append(cell->listVal->first()->info);
+        Object* tail = cell->listVal->first()->next->info;
+        if (fresh)
+            releaseCell(cell);
+        cell = pullStream(tail, fresh);
+    }
+    return cell->type == AS_ERROR ? cell:makeListObject(result);
+}
+
+/*
+ * File input. Ports read through a mapping of the file (see port.hpp), and
+ * lines come back as strings that point into it, so reading a line copies
+ * nothing. End of file reads as false.
+ */
+
+Object* EvalApply::primitiveOpenInputFile(Object** args, int count) {
+    if (count != 1 || args[0]->type != AS_STRING)
+        return makeErrorObject("<Error: open-input-file requires a file name>");
+    string error;
+    Port* port = Port::openInput(toString(args[0]), error);
+    if (port == nullptr)
+        return makeErrorObject("<Error: " + error + ">");
+    return makePortObject(port);
+}
+
+Object* EvalApply::primitiveReadLine(Object** args, int count) {
+    if (count != 1 || args[0]->type != AS_PORT)
+        return makeErrorObject("<Error: read-line requires a port>");
+    const char* line;
+    size_t length;
+    if (!args[0]->portVal->readLine(line, length))
+        return makeBoolObject(false);
+    return makeStringObject(line, length, args[0]->portVal->source());
+}
+
+//(read port) is the next datum in port, unevaluated.
+Object* EvalApply::primitiveRead(Object** args, int count) {
+    if (count != 1 || args[0]->type != AS_PORT)
+        return makeErrorObject("<Error: read requires a port>");
+    const char* start;
+    size_t length;
+    if (!args[0]->portVal->nextDatum(start, length))
+        return makeBoolObject(false);
+    Lexer lexer;
+    auto lexemes = lexer.lex(string(start, length));
+    return readDatum(lexemes);
+}
+
+Object* EvalApply::primitiveClosePort(Object** args, int count) {
+    if (count != 1 || args[0]->type != AS_PORT)
+        return makeErrorObject("<Error: close-port requires a port>");
+    args[0]->portVal->close();
+    return makeBoolObject(true);
+}
+
+//(with-lines file f) calls f on each line of file and returns how many
+//there were.
+Object* EvalApply::primitiveWithLines(Object** args, int count) {
+    if (count != 2 || args[0]->type != AS_STRING || args[1]->type != AS_FUNCTION)
+        return makeErrorObject("<Error: with-lines requires a file name and a function>");
+    string error;
+    //f may escape past here, which mustn't keep the file.
+    unique_ptr<Port> port(Port::openInput(toString(args[0]), error));
+    if (port == nullptr)
+        return makeErrorObject("<Error: " + error + ">");
+    Procedure* proc = args[1]->procedureVal;
+    const char* line;
+    size_t length;
+    int lines = 0;
+    while (port->readLine(line, length)) {
+        Object* argv[1] = {makeStringObject(line, length, port->source())};
+        Object* result = apply(proc, argv, 1);
+        if (result->type == AS_ERROR)
+            return result;
+        lines++;
+    }
+    return makeIntObject(lines);
+}
+
+//The whole of a file as one string, a slice of its port's contents.
+Object* EvalApply::primitiveReadFileBytes(Object** args, int count) {
+    if (count != 1 || args[0]->type != AS_STRING)
+        return makeErrorObject("<Error: read-file-bytes requires a file name>");
+    string error;
+    Port* port = Port::openInput(toString(args[0]), error);
+    if (port == nullptr)
+        return makeErrorObject("<Error: " + error + ">");
+    Object* bytes = makeStringObject(port->contents(), port->length(), port->source());
+    delete port;
+    return bytes;
+}
+
+//The rest of port's lines as a stream. The stream keeps its own place,
+//reading each line from the end of the one before, so the port is left at
+//its end and running a tail again reads the same line.
+Object* EvalApply::primitiveStreamLines(Object** args, int count) {
+    if (count < 1 || count > 2 || args[0]->type != AS_PORT || (count == 2 && args[1]->type != AS_STRING))
+        return makeErrorObject("<Error: stream-lines requires a port>");
+    Port* port = args[0]->portVal;
+    size_t at = count == 1 ? port->skipToEnd():port->lineEnd(args[1]->textVal->data, args[1]->textVal->length);
+    const char* line;
+    size_t length;
+    if (!port->readLine(at, line, length))
+        return makeListObject(new List());
+    Object* rest[2] = {args[0], makeStringObject(line, length, port->source())};
+    return streamCell(rest[1], makePromiseObject(&EvalApply::primitiveStreamLines, rest, 2));
+}
+
+Object* EvalApply::primitiveStringLength(Object** args, int count) {
+    if (count != 1 || args[0]->type != AS_STRING)
+        return makeErrorObject("<Error: string-length requires a string>");
+    return makeIntegerObject((long)args[0]->textVal->length);
+}
+
+/*
+ * Output. Ports buffer what's written to them (see port.hpp); standard
+ * output is flushed at the end of every top level evaluation, other files
+ * when their buffer fills, on flush and on close-port.
+ */
+
+//args[index] if it's there, otherwise standard output. Null if it's there
+//but isn't an output port.
+Port* EvalApply::outputPort(Object** args, int count, int index) {
+    if (index >= count)
+        return output;
+    if (args[index]->type != AS_PORT || !args[index]->portVal->isOutput())
+        return nullptr;
+    return args[index]->portVal;
+}
+
+//(write obj port) prints obj to port without a newline.
+Object* EvalApply::primitiveWrite(Object** args, int count) {
+    Port* port = outputPort(args, count, 1);
+    if (count < 1 || port == nullptr)
+        return makeErrorObject("<Error: write requires an object and optionally an output port>");
+    port->print(args[0]);
+    return args[0];
+}
+
+Object* EvalApply::primitiveNewline(Object** args, int count) {
+    Port* port = outputPort(args, count, 0);
+    if (port == nullptr)
+        return makeErrorObject("<Error: newline requires an output port>");
+    port->write("\n", 1);
+    return makeBoolObject(true);
+}
+
+Object* EvalApply::primitiveFlush(Object** args, int count) {
+    Port* port = outputPort(args, count, 0);
+    if (port == nullptr)
+        return makeErrorObject("<Error: flush requires an output port>");
+    if (!port->flush())
+        return makeErrorObject("<Error: could not write to " + port->getName() + ">");
+    return makeBoolObject(true);
+}
+
+Object* EvalApply::primitiveOpenOutputFile(Object** args, int count) {
+    if (count != 1 || args[0]->type != AS_STRING)
+        return makeErrorObject("<Error: open-output-file requires a file name>");
+    string error;
+    Port* port = Port::openOutput(toString(args[0]), error);
+    if (port == nullptr)
+        return makeErrorObject("<Error: " + error + ">");
+    return makePortObject(port);
+}
+
+Object* EvalApply::primitiveOpenOutputString(Object**, int count) {
+    if (count != 0)
+        return makeErrorObject("<Error: open-output-string takes no arguments>");
+    return makePortObject(new Port("string", -1));
+}
+
+Object* EvalApply::primitiveGetOutputString(Object** args, int count) {
+    if (count != 1 || args[0]->type != AS_PORT || !args[0]->portVal->isOutput())
+        return makeErrorObject("<Error: get-output-string requires a string port>");
+    return makeStringObject(args[0]->portVal->written());
+}
+
+//(write-to-string obj) is what write would print for obj, as a string.
+Object* EvalApply::primitiveWriteToString(Object** args, int count) {
+    if (count != 1)
+        return makeErrorObject("<Error: write-to-string requires one argument>");
+    Port port("string", -1);
+    port.print(args[0]);
+    return makeStringObject(port.written());
+}
+
+/*
+ * Persistent vectors and maps (see persistent.hpp). Updates return a new
+ * version and leave the old one as it was, except on a transient, which
+ * they change in place and return.
+ */
+
+Object* EvalApply::primitiveVector(Object** args, int count) {
+    PersistentVector* vec = (new PersistentVector())->asTransient();
+    for (int i = 0; i < count; i++)
+        vec = vec->conj(args[i]);
+    return makeVectorObject(vec->asPersistent());
+}
+
+Object* EvalApply::primitiveVectorRef(Object** args, int count) {
+    if (count != 2 || args[0]->type != AS_VECTOR || args[1]->type != AS_INT)
+        return makeErrorObject("<Error: vector-ref requires a vector and an index>");
+    int i = args[1]->intVal;
+    if (i < 0 || i >= args[0]->vectorVal->size())
+        return makeErrorObject("<Error: vector index " + to_string(i) + " out of range>");
+    return args[0]->vectorVal->nth(i);
+}
+
+//(vector-set v i x) is v with x at i. i may be the length of v, which appends.
+Object* EvalApply::primitiveVectorSet(Object** args, int count) {
+    if (count != 3 || args[0]->type != AS_VECTOR || args[1]->type != AS_INT)
+        return makeErrorObject("<Error: vector-set requires a vector, an index and a value>");
+    int i = args[1]->intVal;
+    if (i < 0 || i > args[0]->vectorVal->size())
+        return makeErrorObject("<Error: vector index " + to_string(i) + " out of range>");
+    PersistentVector* vec = args[0]->vectorVal->assoc(i, args[2]);
+    return vec == args[0]->vectorVal ? args[0]:makeVectorObject(vec);
+}
+
+Object* EvalApply::primitiveVectorPush(Object** args, int count) {
+    if (count != 2 || args[0]->type != AS_VECTOR)
+        return makeErrorObject("<Error: vector-push requires a vector and a value>");
+    PersistentVector* vec = args[0]->vectorVal->conj(args[1]);
+    return vec == args[0]->vectorVal ? args[0]:makeVectorObject(vec);
+}
+
+Object* EvalApply::primitiveVectorLength(Object** args, int count) {
+    if (count != 1 || args[0]->type != AS_VECTOR)
+        return makeErrorObject("<Error: vector-length requires a vector>");
+    return makeIntObject(args[0]->vectorVal->size());
+}
+
+Object* EvalApply::primitiveVectorList(Object** args, int count) {
+    if (count != 1 || args[0]->type != AS_VECTOR)
+        return makeErrorObject("<Error: vector-list requires a vector>");
+    List* result = new List();
+    args[0]->vectorVal->forEach([result](Object* it) { result->append(it); });
+    return makeListObject(result);
+}
+
+//(vmap f vec...) is a vector of f applied to the items of each vector in
+//turn, up to the end of the shortest. When f is simple enough for a batch
+//kernel (see vmap.hpp) it's compiled once for the call and run over blocks
+//of items, and only the items the kernel can't do are applied one by one.
+Object* EvalApply::primitiveVmap(Object** args, int count) {
+    if (count < 2 || count > mapMaxLists + 1 || args[0]->type != AS_FUNCTION)
+        return makeErrorObject("<Error: vmap requires a function and vectors>");
+    Procedure* proc = args[0]->procedureVal;
+    int numVecs = count - 1;
+    vector<vector<Object*>> items(numVecs);
+    vector<Object**> columns;
+    size_t length = SIZE_MAX;
+    for (int i = 0; i < numVecs; i++) {
+        if (args[i+1]->type != AS_VECTOR)
+            return makeErrorObject("<Error: vmap requires a function and vectors>");
+        vector<Object*>& column = items[i];
+        column.reserve(args[i+1]->vectorVal->size());
+        args[i+1]->vectorVal->forEach([&column](Object* it) { column.push_back(it); });
+        columns.push_back(column.data());
+        length = min(length, column.size());
+    }
+    vector<Object*> results(length, nullptr);
+    VmapKernel* kernel = VmapKernel::compile(proc, [this, proc](Object* symbol) { return vmapResolve(symbol, proc->env); });
+    if (kernel != nullptr && kernel->getArity() == numVecs) {
+        kernel->run(columns, length, results.data());
+        evalStats.vmapKernelItems += length;
+    }
+    delete kernel;
+    PersistentVector* vec = (new PersistentVector())->asTransient();
+    Object* argv[mapMaxLists];
+    for (size_t i = 0; i < length; i++) {
+        Object* value = results[i];
+        if (value == nullptr) {
+            for (int j = 0; j < numVecs; j++)
+                argv[j] = items[j][i];
+            value = apply(proc, argv, numVecs);
+            if (value->type == AS_ERROR)
+                return value;
+        }
+        vec = vec->conj(value);
+    }
+    return makeVectorObject(vec->asPersistent());
+}
+
+//(hash-map k1 v1 k2 v2 ...)
+Object* EvalApply::primitiveHashMap(Object** args, int count) {
+    if (count % 2 != 0)
+        return makeErrorObject("<Error: hash-map requires keys and values in pairs>");
+    PersistentMap* map = (new PersistentMap())->asTransient();
+    for (int i = 0; i < count; i += 2)
+        map = map->assoc(args[i], args[i+1]);
+    return makeMapObject(map->asPersistent());
+}
+
+//(map-get m k default) is the value of k in m, or default, or false.
+Object* EvalApply::primitiveMapGet(Object** args, int count) {
+    if ((count != 2 && count != 3) || args[0]->type != AS_MAP)
+        return makeErrorObject("<Error: map-get requires a map, a key and optionally a default>");
+    Object* value = args[0]->mapVal->get(args[1]);
+    if (value != nullptr)
+        return value;
+    return count == 3 ? args[2]:makeBoolObject(false);
+}
+
+Object* EvalApply::primitiveMapPut(Object** args, int count) {
+    if (count != 3 || args[0]->type != AS_MAP)
+        return makeErrorObject("<Error: map-put requires a map, a key and a value>");
+    PersistentMap* map = args[0]->mapVal->assoc(args[1], args[2]);
+    return map == args[0]->mapVal ? args[0]:makeMapObject(map);
+}
+
+Object* EvalApply::primitiveMapRemove(Object** args, int count) {
+    if (count != 2 || args[0]->type != AS_MAP)
+        return makeErrorObject("<Error: map-remove requires a map and a key>");
+    PersistentMap* map = args[0]->mapVal->without(args[1]);
+    return map == args[0]->mapVal ? args[0]:makeMapObject(map);
+}
+
+Object* EvalApply::primitiveMapHas(Object** args, int count) {
+    if (count != 2 || args[0]->type != AS_MAP)
+        return makeErrorObject("<Error: map-has? requires a map and a key>");
+    return makeBoolObject(args[0]->mapVal->get(args[1]) != nullptr);
+}
+
+Object* EvalApply::primitiveMapCount(Object** args, int count) {
+    if (count != 1 || args[0]->type != AS_MAP)
+        return makeErrorObject("<Error: map-count requires a map>");
+    return makeIntObject(args[0]->mapVal->size());
+}
+
+Object* EvalApply::primitiveMapKeys(Object** args, int count) {
+    if (count != 1 || args[0]->type != AS_MAP)
+        return makeErrorObject("<Error: map-keys requires a map>");
+    List* result = new List();
+    args[0]->mapVal->forEach([result](Object* key, Object*) { result->append(key); });
+    return makeListObject(result);
+}
+
+//Each entry as a (key value) list, in no particular order.
+Object* EvalApply::primitiveMapEntries(Object** args, int count) {
+    if (count != 1 || args[0]->type != AS_MAP)
+        return makeErrorObject("<Error: map-entries requires a map>");
+    List* result = new List();
+    args[0]->mapVal->forEach([result](Object* key, Object* value) {
+        List* entry = new List();
+        entry->append(key);
+        entry->append(value);
+        result->append(makeListObject(entry));
+    });
+    return makeListObject(result);
+}
+
+Object* EvalApply::primitiveTransient(Object** args, int count) {
+    if (count == 1 && args[0]->type == AS_VECTOR)
+        return makeVectorObject(args[0]->vectorVal->asTransient());
+    if (count == 1 && args[0]->type == AS_MAP)
+        return makeMapObject(args[0]->mapVal->asTransient());
+    return makeErrorObject("<Error: transient requires a vector or a map>");
+}
+
+Object* EvalApply::primitivePersistent(Object** args, int count) {
+    if (count == 1 && args[0]->type == AS_VECTOR)
+        return makeVectorObject(args[0]->vectorVal->asPersistent());
+    if (count == 1 && args[0]->type == AS_MAP)
+        return makeMapObject(args[0]->mapVal->asPersistent());
+    return makeErrorObject("<Error: persistent requires a vector or a map>");
+}
+
+//(call/cc f) calls f with a continuation k. Calling (k value) anywhere
+//inside f returns value from call/cc at once. Continuations only escape:
+//once call/cc has returned, k is dead, and it can't be called from
+//another task.
+Object* EvalApply::primitiveCallCC(Object** args, int count) {
+    if (count != 1 || args[0]->type != AS_FUNCTION)
+        return makeErrorObject("<Error: call/cc requires a function>");
+    Procedure* continuation = allocFunction(nullptr, nullptr, nullptr, CONTINUATION);
+    Object* k = makeFunctionObject(continuation);
+    ArgStack& stack = scheduler.argStack();
+    //everything a call can leave changed if it doesn't return normally;
+    //frames are given back by the calls themselves as they unwind.
+    Object** top = stack.top;
+    int depth = d;
+    int floor = nativeFloor;
+    bool unfolded = unfolding;
+    liveContinuations[continuation] = scheduler.self();
+    Object* result;
+    try {
+        result = apply(args[0]->procedureVal, &k, 1);
+    } catch (Escape& escape) {
+        if (escape.target != continuation) {
+            liveContinuations.erase(continuation);
+            throw;
+        }
+        result = escape.value;
+        stack.top = top;
+        d = depth;
+        nativeFloor = floor;
+        unfolding = unfolded;
+        pulling = false;
+    }
+    liveContinuations.erase(continuation);
+    return result;
+}
+
+Object* EvalApply::escapeTo(Procedure* continuation, Object** args, int count) {
+    auto it = liveContinuations.find(continuation);
+    if (it == liveContinuations.end())
+        return makeErrorObject("<Error: continuation called after its call/cc returned>");
+    if (it->second != scheduler.self())
+        return makeErrorObject("<Error: continuation called from another task>");
+    throw Escape{continuation, count > 0 ? args[0]:makeListObject(new List())};
+}
+
+//Special forms read their operands straight out of the source form and
+//evaluate only the ones they need, so no argument list is built.
+Object* EvalApply::applySpecial(SpecialForm* special, List* form, Env* env) {
+    if (form->size() - 1 < special->numArgs)
+        return makeErrorObject("<Error: " + special->name + " requires " + to_string(special->numArgs) + " arguments>");
     auto func = special->func;
-    leave();
-    return (this->*func)(evaluated_args, env);
+    return (this->*func)(form->first()->next, env);
 }
 
-Object* EvalApply::applyMathPrimitive(List* args, string op) {
-    Object* first = args->first()->info;
-    double result = first->type == AS_INT ? first->intVal:first->realVal;
-    for (Object* curr : *args->rest()) {
-        if (curr->type == AS_INT || curr->type == AS_REAL) {
-            double t = curr->type == AS_INT ? curr->intVal:curr->realVal;
-            if (op == "+") result += t;
-            if (op == "-") result -= t;
-            if (op == "*") result *= t;
-            if (op == "/") result /= t;
+Object* EvalApply::copyTree(Object* form) {
+    if (form->type != AS_LIST)
+        return form;
+    List* nl = new List();
+    for (Object* it : *form->listVal)
+        nl->append(copyTree(it));
+    return makeListObject(nl);
+}
+
+//Expands every macro call in form, in place, so the rewritten code is what
+//gets evaluated from then on. Quoted data and macro definitions are left alone.
+Object* EvalApply::expand(Object* form) {
+    if (form->type == AS_LIST && form->listVal->isShared())
+        return form;
+    while (form->type == AS_LIST && !form->listVal->empty()) {
+        Object* head = form->listVal->first()->info;
+        if (head->type != AS_SYMBOL)
+            break;
+        if (head->special == SF_QUOTE || head->special == SF_DEFMACRO)
+            return form;
+        if (head->special == SF_LAMBDA) {
+            if (form->listVal->size() == 3)
+                expandBody(form->listVal->first()->next->next->info);
+            return form;
+        }
+        if (head->special == SF_LET) {
+            if (!expandLet(form))
+                break;
+            continue;
+        }
+        string symbol = *head->strVal;
+        auto macro = macros.find(symbol);
+        if (macro == macros.end())
+            break;
+        say("Expanding macro " + symbol);
+        List* operands = form->listVal->rest();
+        if (operands->size() != macro->second->freeVars->size())
+            return makeErrorObject("<Error: wrong number of arguments to macro " + symbol + ">");
+        Object* expansion = copyTree(applyList(macro->second, operands));
+        *form = *expansion;
+    }
+    if (form->type == AS_LIST) {
+        for (Object*& it : *form->listVal)
+            it = expand(it);
+    }
+    return form;
+}
+
+//(let ((x a) (y b)) body) is rewritten once to ((lambda (x y) body) a b)
+//instead of having specialLet build the same lambda on every evaluation.
+bool EvalApply::expandLet(Object* form) {
+    List* let = form->listVal;
+    if (let->size() != 3 || let->first()->next->info->type != AS_LIST)
+        return false;
+    List* names = new List();
+    List* call = new List();
+    for (Object* info : *let->first()->next->info->listVal) {
+        if (info->type != AS_LIST || info->listVal->size() != 2 || info->listVal->first()->info->type != AS_SYMBOL)
+            return false;
+        names->append(info->listVal->first()->info);
+        call->append(info->listVal->first()->next->info);
+    }
+    List* lambda = new List();
+    lambda->append(makeSymbolObject("lambda"));
+    lambda->append(makeListObject(names));
+    lambda->append(let->first()->next->next->info);
+    call->push(makeListObject(lambda));
+    form->listVal = call;
+    return true;
+}
+
+//Lambda bodies are expanded when the closure is created, but only once per
+//body: the result is cached until a new macro is defined.
+void EvalApply::expandBody(Object* code) {
+    if (code->type != AS_LIST || code->listVal->isShared() || code->listVal->getExpanded() == macroGeneration)
+        return;
+    expand(code);
+    //expanding a let replaces the list, so the mark goes on what's left.
+    if (code->type == AS_LIST)
+        code->listVal->setExpanded(macroGeneration);
+}
+
+Object* EvalApply::applyMathPrimitive(Object** args, int count, char op) {
+    bool exact = op != '/';
+    for (int i = 0; i < count; i++)
+        exact = exact && isExactInteger(args[i]);
+    if (exact)
+        return applyIntegerMath(args, count, op);
+    double result = numberValue(args[0]);
+    for (int i = 1; i < count; i++) {
+        Object* curr = args[i];
+        if (isNumber(curr)) {
+            double t = numberValue(curr);
+            if (op == '+') result += t;
+            if (op == '-') result -= t;
+            if (op == '*') result *= t;
+            if (op == '/') result /= t;
         }
     }
     return makeRealObject(result);
 }
 
-Object* EvalApply::evalList(List* list, List* env) {
-    if (getObjectType(list->first()->info) == AS_SYMBOL) {
-        string symbol = *list->first()->info->strVal;
-        if (specialForms.find(symbol) != specialForms.end()) {
-            List* arguments = list->rest();
-            leave("Evaluated as Special Form: " + symbol);
-            return applySpecial(&specialForms[symbol], arguments, env);
+//Integers stay exact: the sum runs in a long until it overflows and
+//carries on as a bignum from there.
+Object* EvalApply::applyIntegerMath(Object** args, int count, char op) {
+    long acc = 0;
+    bool big = args[0]->type == AS_BIGNUM;
+    BigInt bigAcc;
+    if (big)
+        bigAcc = *args[0]->bigVal;
+    else
+        acc = args[0]->intVal;
+    for (int i = 1; i < count; i++) {
+        Object* curr = args[i];
+        if (!big && curr->type == AS_INT) {
+            long t = acc;
+            bool overflow = false;
+            if (op == '+') overflow = __builtin_add_overflow(acc, (long)curr->intVal, &t);
+            if (op == '-') overflow = __builtin_sub_overflow(acc, (long)curr->intVal, &t);
+            if (op == '*') overflow = __builtin_mul_overflow(acc, (long)curr->intVal, &t);
+            if (!overflow) {
+                acc = t;
+                continue;
+            }
+        }
+        if (!big) {
+            big = true;
+            bigAcc = BigInt(acc);
+        }
+        if (op == '+') bigAcc = bigAcc.add(bigValue(curr));
+        if (op == '-') bigAcc = bigAcc.sub(bigValue(curr));
+        if (op == '*') bigAcc = bigAcc.mul(bigValue(curr));
+    }
+    return big ? makeIntegerObject(bigAcc):makeIntegerObject(acc);
+}
+
+//The head and operands of a call are pushed on the current task's
+//argument stack, and the callee reads its arguments from there.
+Object* EvalApply::evalList(List* list, Env* env) {
+    Object* head = list->first()->info;
+    if (head->type == AS_SYMBOL && head->special != SF_NONE) {
+        SpecialForm* special = &specialForms[head->special];
+        evalStats.specialForms[head->special]++;
+        if (loud) say("Evaluated as Special Form: " + special->name);
+        leave();
+        return applySpecial(special, list, env);
+    }
+    if (parallelEnabled && !loud) {
+        Object* result = evalParallel(list, env);
+        if (result != nullptr) {
+            leave();
+            return result;
         }
     }
-    List* evaluatedArguments = new List();
-    say("Evaluating Arguments");
+    //tracing always takes the generic path so it shows every step.
+    QuickForm* quick = list->getQuick();
+    if (quickenEnabled && quick != nullptr && quick->kind != QK_UNSEEN && !loud) {
+        leave();
+        return evalQuick(list, quick, env);
+    }
+    ArgStack& stack = scheduler.argStack();
+    int count = list->size();
+    if (stack.top + count > stack.limit) {
+        leave();
+        return makeErrorObject("<Error: argument stack overflow>");
+    }
+    Object** values = stack.top;
+    if (loud) say("Evaluating Arguments");
     for (Object* curr : *list) {
-        evaluatedArguments->append(eval(curr, env));
+        Object* value = eval(curr, env);
+        *stack.top++ = value;
+    }
+    if (quickenEnabled)
+        quicken(list, values, count, env);
+    Object* result;
+    if (getObjectType(values[0]) == AS_FUNCTION)  {
+        if (loud) say("Evaluated as function expression");
+        leave();
+        result = apply(values[0]->procedureVal, values + 1, count - 1);
+    } else {
+        if (loud) say("Evaluated As List");
+        leave();
+        result = makeListObject(listFromSpan(values, count));
+    }
+    stack.top = values;
+    return result;
+}
+
+//A compiled top level lambda that operand calls, if it has been slow
+//enough to be worth running in parallel.
+Procedure* EvalApply::parallelCallee(Object* operand, Env* env) {
+    if (operand->type != AS_LIST || operand->listVal->size() == 0)
+        return nullptr;
+    List* call = operand->listVal;
+    Object* head = call->first()->info;
+    if (head->type != AS_SYMBOL || head->special != SF_NONE)
+        return nullptr;
+    Object** cell = envFind(env, head);
+    if (cell == nullptr || (*cell)->type != AS_FUNCTION)
+        return nullptr;
+    Procedure* proc = (*cell)->procedureVal;
+    if (!jitEnabled || proc->type != LAMBDA || proc->native == nullptr)
+        return nullptr;
+    JitCode* native = proc->native;
+    if (native->arity != call->size() - 1 || native->nanos < parallelMinNanos)
+        return nullptr;
+    return proc;
+}
+
+/*
+ * With parallel evaluation on, a call with two or more operands that call
+ * slow compiled lambdas runs those on the thread pool at once. Compiled
+ * code only does integer arithmetic on its arguments and calls more
+ * compiled code, so it has no side effects, and running it early, out of
+ * order or on another thread can't be told apart from running it in turn.
+ * Everything else is evaluated here in order as usual. Returns nullptr if
+ * the call isn't worth it, for evalList to carry on as normal.
+ */
+Object* EvalApply::evalParallel(List* list, Env* env) {
+    //most calls have fewer than two calls among their operands, and
+    //that's cheaper to see than looking the callees up.
+    int calls = 0;
+    for (Object* operand : *list)
+        if (operand->type == AS_LIST && operand->listVal->size() > 0)
+            calls++;
+    if (calls < 2)
+        return nullptr;
+    int candidates = 0;
+    for (Object* operand : *list)
+        if (parallelCallee(operand, env) != nullptr)
+            candidates++;
+    if (candidates < 2 || threadPool().size() < 2 || scheduler.stackLow(jitStackBytes))
+        return nullptr;
+    ArgStack& stack = scheduler.argStack();
+    int count = list->size();
+    if (stack.top + count > stack.limit)
+        return nullptr;
+    Object** values = stack.top;
+    stack.top += count;
+    vector<ParallelCall> parallel;
+    int i = 0;
+    for (Object* operand : *list) {
+        Procedure* proc = parallelCallee(operand, env);
+        if (proc == nullptr) {
+            values[i++] = eval(operand, env);
+            continue;
+        }
+        List* call = operand->listVal;
+        ParallelCall pc = {i, proc, proc->native, stack.top, call->size() - 1, {}, 0, false, false, 0};
+        if (stack.top + pc.count > stack.limit) {
+            stack.top = values;
+            return makeErrorObject("<Error: argument stack overflow>");
+        }
+        bool ints = true;
+        for (ListNode* it = call->first()->next; it != nullptr; it = it->next) {
+            Object* value = eval(it->info, env);
+            *stack.top++ = value;
+            ints = ints && value->type == AS_INT;
+        }
+        if (ints) {
+            for (int k = 0; k < pc.count; k++)
+                pc.argv[k] = pc.args[k]->intVal;
+            values[i] = nullptr;
+            parallel.push_back(pc);
+        } else {
+            values[i] = apply(proc, pc.args, pc.count);
+        }
+        i++;
+    }
+    auto run = [](ParallelCall* pc) {
+        auto start = chrono::steady_clock::now();
+        pc->ran = Jit::call(pc->native, pc->argv, pc->value, pc->tooDeep);
+        pc->nanos = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+    };
+    if (parallel.size() >= 2) {
+        vector<function<void()>> jobs;
+        for (ParallelCall& pc : parallel)
+            jobs.push_back([&run, &pc]() { run(&pc); });
+        threadPool().run(jobs);
+        evalStats.parallelCalls += parallel.size();
+    } else {
+        for (ParallelCall& pc : parallel)
+            run(&pc);
+    }
+    for (ParallelCall& pc : parallel) {
+        pc.native->nanos = (pc.native->nanos * 3 + pc.nanos) / 4;
+        if (pc.ran)
+            values[pc.index] = pc.native->result == JIT_INT ? makeIntObject(pc.value):makeBoolObject(pc.value);
+        else
+            values[pc.index] = apply(pc.proc, pc.args, pc.count);
+    }
+    Object* result = finishCall(values, count);
+    stack.top = values;
+    return result;
+}
+
+//Specializes a call site on what its first run saw: two ints going to
+//an arithmetic or comparison primitive become an integer op, any other
+//procedure a direct call. Lists that aren't calls are left alone.
+void EvalApply::quicken(List* list, Object** evaluated, int count, Env* env) {
+    Object* callee = evaluated[0];
+    if (callee->type != AS_FUNCTION || list->isShared())
+        return;
+    QuickForm* quick = list->getQuick();
+    if (quick == nullptr) {
+        quick = makeQuickForm(list->size());
+        list->setQuick(quick);
+    }
+    int i = 0;
+    for (Object* operand : *list)
+        resolveSlot(quick->slots[i++], operand, env);
+    Procedure* proc = callee->procedureVal;
+    quick->callee = proc;
+    if (quick->misses >= quickMissLimit) {
+        quick->kind = QK_APPLY;
+        return;
+    }
+    quick->kind = QK_CALL;
+    if (proc->type != PRIMITIVE || count != 3)
+        return;
+    if (evaluated[1]->type != AS_INT || evaluated[2]->type != AS_INT)
+        return;
+    if (proc->func == &EvalApply::primitivePlus) quick->kind = QK_INT_ADD;
+    if (proc->func == &EvalApply::primitiveMinus) quick->kind = QK_INT_SUB;
+    if (proc->func == &EvalApply::primitiveMultiply) quick->kind = QK_INT_MUL;
+    if (proc->func == &EvalApply::primitiveLess) quick->kind = QK_INT_LT;
+    if (proc->func == &EvalApply::primitiveGreater) quick->kind = QK_INT_GT;
+    if (proc->func == &EvalApply::primitiveEquals) quick->kind = QK_INT_EQ;
+}
+
+//Does the same walk as envFind, noting where the symbol turned up.
+void EvalApply::resolveSlot(QuickSlot& slot, Object* operand, Env* env) {
+    slot = {SLOT_NONE, 0, 0, nullptr, nullptr};
+    if (operand->type != AS_SYMBOL)
+        return;
+    int hops = 0;
+    for (Env* e = env; e != nullptr; e = e->parent, hops++) {
+        int i = 0;
+        if (e->proc != nullptr) {
+            for (Object* param : *e->proc->freeVars) {
+                if (compareObject(operand, param)) {
+                    slot = {SLOT_PARAM, hops, i, e->proc->freeVars, nullptr};
+                    return;
+                }
+                i++;
+            }
+        }
+        if (e->bindings == nullptr)
+            continue;
+        i = 0;
+        for (Object* it : *e->bindings) {
+            if (it->type == AS_BINDING && compareObject(operand, it->bindingVal->symbol)) {
+                if (e->proc != nullptr)
+                    slot = {SLOT_LOCAL, hops, i, it->bindingVal->symbol, nullptr};
+                else
+                    slot = {SLOT_GLOBAL, hops, i, e->bindings, it->bindingVal};
+                return;
+            }
+            i++;
+        }
+    }
+}
+
+//A resolved symbol is read straight from where it was found last time.
+//Frames nest the same way every time a given piece of code runs, so the
+//guards only check what can change: that the frame found has the same
+//parameter list, that a local define's slot holds the same definition,
+//that the global environment is the same one, and that no frame passed
+//on the way has since defined the name itself.
+Object* EvalApply::quickOperand(QuickSlot& slot, Object* operand, Env* env) {
+    if (slot.kind == SLOT_NONE)
+        return eval(operand, env);
+    Env* e = env;
+    for (int h = 0; h < slot.hops && e != nullptr; h++) {
+        if (e->bindings != nullptr && definesSymbol(e->bindings, operand)) {
+            e = nullptr;
+            break;
+        }
+        e = e->parent;
+    }
+    if (e != nullptr) {
+        if (slot.kind == SLOT_PARAM && e->proc != nullptr && e->proc->freeVars == slot.guard)
+            return e->args[slot.index];
+        if (slot.kind == SLOT_GLOBAL && e->bindings == slot.guard)
+            return slot.binding->value;
+        if (slot.kind == SLOT_LOCAL && e->bindings != nullptr && slot.index < e->bindings->size()) {
+            Object* it = e->bindings->getNthNode(slot.index)->info;
+            if (it->type == AS_BINDING && it->bindingVal->symbol == slot.guard)
+                return it->bindingVal->value;
+        }
+    }
+    resolveSlot(slot, operand, env);
+    return eval(operand, env);
+}
+
+bool EvalApply::definesSymbol(List* bindings, Object* symbol) {
+    for (Object* it : *bindings)
+        if (it->type == AS_BINDING && compareObject(symbol, it->bindingVal->symbol))
+            return true;
+    return false;
+}
+
+Object* EvalApply::evalQuick(List* list, QuickForm* quick, Env* env) {
+    ListNode* it = list->first();
+    Object* callee = quickOperand(quick->slots[0], it->info, env);
+    bool calleeHit = callee->type == AS_FUNCTION && (quick->kind == QK_APPLY || callee->procedureVal == quick->callee);
+    if (quick->kind >= QK_INT_ADD && quick->kind <= QK_INT_EQ) {
+        Object* lhs = quickOperand(quick->slots[1], it->next->info, env);
+        Object* rhs = quickOperand(quick->slots[2], it->next->next->info, env);
+        if (calleeHit && lhs->type == AS_INT && rhs->type == AS_INT) {
+            long a = lhs->intVal, b = rhs->intVal;
+            evalStats.quickOps++;
+            switch (quick->kind) {
+                case QK_INT_ADD: return makeIntegerObject(a + b);
+                case QK_INT_SUB: return makeIntegerObject(a - b);
+                case QK_INT_MUL: return makeIntegerObject(a * b);
+                case QK_INT_LT: return makeBoolObject(a < b);
+                case QK_INT_GT: return makeBoolObject(a > b);
+                default: return makeBoolObject(a == b);
+            }
+        }
+        Object* values[3] = {callee, lhs, rhs};
+        quick->kind = QK_UNSEEN;
+        quick->misses++;
+        return finishCall(values, 3);
     }
-    if (getObjectType(evaluatedArguments->first()->info) == AS_FUNCTION)  {
-        Procedure* procedure = evaluatedArguments->first()->info->procedureVal;
-        List* arguments = evaluatedArguments->rest();
-        leave("Evaluated as function expression");
-        return apply(procedure, arguments, env);
+    ArgStack& stack = scheduler.argStack();
+    int count = list->size();
+    if (stack.top + count > stack.limit)
+        return makeErrorObject("<Error: argument stack overflow>");
+    Object** values = stack.top;
+    *stack.top++ = callee;
+    int i = 1;
+    for (it = it->next; it != nullptr; it = it->next) {
+        Object* value = quickOperand(quick->slots[i++], it->info, env);
+        *stack.top++ = value;
     }
-    leave("Evaluated As List");
-    return makeListObject(evaluatedArguments);
+    Object* result;
+    if (calleeHit) {
+        result = apply(callee->procedureVal, values + 1, count - 1);
+    } else {
+        quick->kind = QK_UNSEEN;
+        quick->misses++;
+        result = finishCall(values, count);
+    }
+    stack.top = values;
+    return result;
 }
 
-Object* EvalApply::apply(Procedure* procedure, List* args, List* env) {
-    enter("apply");
+//Completes a call whose guard failed, with the operands already evaluated.
+Object* EvalApply::finishCall(Object** values, int count) {
+    if (values[0]->type == AS_FUNCTION)
+        return apply(values[0]->procedureVal, values + 1, count - 1);
+    return makeListObject(listFromSpan(values, count));
+}
+
+//Primitives that loop, like map and sort, come back through here, so the
+//memory limit stops them too.
+Object* EvalApply::apply(Procedure* procedure, Object** args, int count) {
+    if (heapStats.exceeded)
+        return memoryError;
+    enter();
+    if (loud) say("apply");
     if (procedure->type == PRIMITIVE) {
         auto func = procedure->func;
-        leave("Applying primitive.");
-        return (this->*func)(args);
+        evalStats.primitiveApplies++;
+        if (loud) say("Applying primitive.");
+        leave();
+        return (this->*func)(args, count);
     }
     if (procedure->type == LAMBDA) {
-        List* nenv = makeNewEnvironment(procedure->freeVars, args);
-        nenv->addMissing(procedure->env);
-        nenv->addMissing(env);
-        Object* result = eval(procedure->code, nenv);
+        Object* result;
+        evalStats.lambdaApplies++;
+        //a slow native call is interpreted one level down, so the calls
+        //in its body get the chance to run in parallel.
+        bool unfold = parallelEnabled && jitEnabled && !unfolding && procedure->native != nullptr && procedure->native->nanos >= parallelMinNanos;
+        if (unfold) {
+            FlagGuard unfolded(unfolding, true);
+            FrameGuard frame = {this, allocFrame(procedure, args)};
+            result = eval(procedure->code, frame.frame);
+            leave();
+            return result;
+        }
+        if (jitEnabled && applyNative(procedure, args, count, result)) {
+            evalStats.nativeApplies++;
+            if (loud) say("Applied native code.");
+            leave();
+            return result;
+        }
+        if (count < procedure->freeVars->size()) {
+            leave();
+            return makeErrorObject("<Error: procedure expects " + to_string(procedure->freeVars->size()) + " arguments>");
+        }
+        FrameGuard frame = {this, allocFrame(procedure, args)};
+        result = eval(procedure->code, frame.frame);
         leave();
         return result;
     }
+    if (procedure->type == COMPILED) {
+        leave();
+        return applyCompiled(procedure, args, count);
+    }
+    if (procedure->type == CONTINUATION) {
+        leave();
+        return escapeTo(procedure, args, count);
+    }
+    if (procedure->record != nullptr) {
+        leave();
+        return applyRecord(procedure, args, count);
+    }
     leave();
     return makeErrorObject("An error in apply occured");
 }
 
-Object* EvalApply::eval(Object* obj, List* env) {
-    enter("eval");
+//Names are only put together for errors, off the path of a good call.
+Object* EvalApply::applyRecord(Procedure* procedure, Object** args, int count) {
+    RecordType* type = procedure->record;
+    switch (procedure->type) {
+        case RECORD_CONSTRUCTOR:
+            if (count != type->size)
+                return makeErrorObject("<Error: make-" + *type->name->strVal + " requires " + to_string(type->size) + " arguments>");
+            return makeRecordObject(type, args);
+        case RECORD_PREDICATE:
+            if (count != 1)
+                return makeErrorObject("<Error: " + *type->name->strVal + "? requires one argument>");
+            return makeBoolObject(args[0]->type == AS_RECORD && args[0]->recordVal->type == type);
+        default:
+            break;
+    }
+    if (count != 1 || args[0]->type != AS_RECORD || args[0]->recordVal->type != type) {
+        ListNode* field = type->fields->first();
+        for (int i = 0; i < procedure->slot; i++)
+            field = field->next;
+        return makeErrorObject("<Error: " + *type->name->strVal + "-" + *field->info->strVal + " requires a record of type " + *type->name->strVal + ">");
+    }
+    return args[0]->recordVal->slots[procedure->slot];
+}
+
+//For callers holding their arguments in a list: copies them onto the
+//argument stack first.
+Object* EvalApply::applyList(Procedure* procedure, List* args) {
+    ArgStack& stack = scheduler.argStack();
+    int count = args->size();
+    if (stack.top + count > stack.limit)
+        return makeErrorObject("<Error: argument stack overflow>");
+    Object** values = stack.top;
+    for (Object* it : *args)
+        *stack.top++ = it;
+    Object* result = apply(procedure, values, count);
+    stack.top = values;
+    return result;
+}
+
+bool EvalApply::applyNative(Procedure* procedure, Object** args, int count, Object*& result) {
+    if (procedure->native == nullptr) {
+        if (procedure->noJit || procedure->env != globalEnv || ++procedure->calls < jitThreshold)
+            return false;
+        if (jit.compile(procedure, [this](Object* symbol) { return jitResolve(symbol); }) == nullptr)
+            return false;
+        if (loud) say("Compiled lambda to native code.");
+    }
+    //once native code has recursed too deep and bailed, every call under
+    //the one that bailed would too, so they stay interpreted.
+    if (d > nativeFloor)
+        return false;
+    nativeFloor = INT_MAX;
+    bool ran = false;
+    auto start = parallelEnabled ? chrono::steady_clock::now():chrono::steady_clock::time_point();
+    //native code recurses on the C stack with no checks of its own.
+    if (scheduler.stackLow(jitStackBytes))
+        scheduler.onNewStack([&]() { ran = jit.run(procedure->native, args, count, result); return (Object*)nullptr; });
+    else
+        ran = jit.run(procedure->native, args, count, result);
+    if (parallelEnabled && procedure->native != nullptr) {
+        long nanos = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+        procedure->native->nanos = (procedure->native->nanos * 3 + nanos) / 4;
+    }
+    if (!ran && jit.ranTooDeep())
+        nativeFloor = d;
+    //a bail reruns the whole call, so code that keeps bailing is dropped
+    //for good rather than paying for every call twice.
+    if (!ran && procedure->native != nullptr && procedure->native->bails >= jitMaxBails) {
+        procedure->noJit = true;
+        jit.invalidate(procedure);
+    }
+    return ran;
+}
+
+//Only globals are resolved, and only to the primitives the JIT has
+//templates for or to other top level lambdas.
+JitSymbol EvalApply::jitResolve(Object* symbol) {
+    JitSymbol sym = {JIT_UNKNOWN, nullptr, *symbol->strVal};
+    Object* value = envLookUp(globalEnv, symbol);
+    if (value->type != AS_FUNCTION)
+        return sym;
+    Procedure* proc = value->procedureVal;
+    if (proc->type == PRIMITIVE) {
+        if (proc->func == &EvalApply::primitivePlus) sym.op = JIT_ADD;
+        if (proc->func == &EvalApply::primitiveMinus) sym.op = JIT_SUB;
+        if (proc->func == &EvalApply::primitiveMultiply) sym.op = JIT_MUL;
+        if (proc->func == &EvalApply::primitiveLess) sym.op = JIT_LT;
+        if (proc->func == &EvalApply::primitiveGreater) sym.op = JIT_GT;
+        if (proc->func == &EvalApply::primitiveEquals) sym.op = JIT_EQ;
+    } else if (proc->type == LAMBDA && proc->env == globalEnv) {
+        sym.op = JIT_CALL;
+        sym.proc = proc;
+    }
+    return sym;
+}
+
+//Operators are looked up where the lambda was made, so a kernel sees the
+//same primitives the interpreter would.
+VmapOp EvalApply::vmapResolve(Object* symbol, Env* env) {
+    Object* value = envLookUp(env, symbol);
+    if (value->type != AS_FUNCTION || value->procedureVal->type != PRIMITIVE)
+        return VMAP_UNKNOWN;
+    auto func = value->procedureVal->func;
+    if (func == &EvalApply::primitivePlus) return VMAP_ADD;
+    if (func == &EvalApply::primitiveMinus) return VMAP_SUB;
+    if (func == &EvalApply::primitiveMultiply) return VMAP_MUL;
+    if (func == &EvalApply::primitiveDivide) return VMAP_DIV;
+    if (func == &EvalApply::primitiveLess) return VMAP_LT;
+    if (func == &EvalApply::primitiveGreater) return VMAP_GT;
+    if (func == &EvalApply::primitiveEquals) return VMAP_EQ;
+    return VMAP_UNKNOWN;
+}
+
+Object* EvalApply::eval(Object* obj, Env* env) {
+    if (heapStats.exceeded)
+        return memoryError;
+    if (scheduler.stackLow()) {
+        Object* result = scheduler.onNewStack([this, obj, env]() { return eval(obj, env); });
+        return result != nullptr ? result:makeErrorObject("<Error: out of memory for the stack>");
+    }
+    scheduler.tick();
+    evalStats.evalSteps[getObjectType(obj)]++;
+    enter();
+    if (loud) say("eval");
     switch (getObjectType(obj)) {
         case AS_INT:
-            leave("Evaluated " + toString(obj) + " as int");
+            if (loud) say("Evaluated " + toString(obj) + " as int");
+            leave();
             return obj;
         case AS_REAL:
-            leave("Evaluated " + toString(obj) + " as real");
+            if (loud) say("Evaluated " + toString(obj) + " as real");
+            leave();
+            return obj;
+        case AS_BIGNUM:
+            if (loud) say("Evaluated " + toString(obj) + " as bignum");
+            leave();
             return obj;
         case AS_BOOL:
-            leave("Evaluated " + toString(obj) + " as Bool");
+            if (loud) say("Evaluated " + toString(obj) + " as Bool");
+            leave();
             return obj;
         case AS_FUNCTION:
-            leave("Evaluated " + toString(obj) + " as function");
+            if (loud) say("Evaluated " + toString(obj) + " as function");
+            leave();
+            return obj;
+        case AS_PROMISE:
+            if (loud) say("Evaluated " + toString(obj) + " as promise");
+            leave();
+            return obj;
+        case AS_STRING:
+            if (loud) say("Evaluated " + toString(obj) + " as string");
+            leave();
+            return obj;
+        case AS_PORT:
+            if (loud) say("Evaluated " + toString(obj) + " as port");
+            leave();
+            return obj;
+        case AS_VECTOR:
+        case AS_MAP:
+        case AS_RECORD:
+            if (loud) say("Evaluated " + toString(obj) + " as " + typeStr[obj->type]);
+            leave();
             return obj;
         case AS_ERROR:
-            leave("Evaluated " + toString(obj) + " as Error");
+            if (loud) say("Evaluated " + toString(obj) + " as Error");
+            leave();
             return obj;
         case AS_SYMBOL: {
             Object* ret =  envLookUp(env, obj);
-            leave("Evaluated " + toString(ret) + " From Symbol " + toString(obj));
+            if (loud) say("Evaluated " + toString(ret) + " From Symbol " + toString(obj));
+            leave();
             return ret;
         }
         case AS_LIST: 
             if (obj->listVal->empty()) {
-                leave("evaluated as ()");
+                if (loud) say("evaluated as ()");
+                leave();
                 return obj;
             }
             return evalList(obj->listVal, env);
         default:
             break;
     }
+    leave();
     return makeErrorObject("Error during eval");
 }
 
@@ -452,8 +2568,24 @@ Object* EvalApply::eval(Object* obj, List* env) {
 */
 
 Object* EvalApply::eval(List* expr) {
-    Object* exprObj = makeListObject(expr);
-    Object* result = eval(exprObj, environment);
+    return eval(expr, environment);
+}
+
+//Evaluates expr at top level in env, a list of bindings. The global
+//environment gets its own frame; any other list is wrapped in a new one.
+Object* EvalApply::eval(List* expr, List* env) {
+    heapStats.evalBase = heapStats.liveBytes;
+    heapStats.exceeded = false;
+    Object* exprObj = expand(makeListObject(expr));
+    Object* result = eval(exprObj, env == environment ? globalEnv:makeEnv(env, nullptr));
+    scheduler.runUntilIdle();
+    output->flush();
+    heapStats.lastEvalBytes = heapStats.liveBytes - heapStats.evalBase;
+    if (heapStats.exceeded) {
+        heapStats.exceeded = false;
+        d = 0;
+        return makeErrorObject("<Error: evaluation exceeded the memory limit of " + to_string(heapStats.limit) + " bytes>");
+    }
     return result;
 }
 
@@ -0,0 +1,764 @@
+#ifndef image_hpp
+#define image_hpp
+#include <iostream>
+#include <vector>
+#include <deque>
+#include <cstring>
+#include <cstdint>
+#include <unordered_map>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "objects.hpp"
+#include "list.hpp"
+#include "evalapply.hpp"
+using namespace std;
+
+/*
+ * A heap image is a flat dump of everything reachable from the global
+ * environment. Pointers are written as indexes into the record tables, so
+ * loading is an mmap of the file followed by one pass to allocate the
+ * objects and one pass to patch the indexes back into pointers.
+ *
+ *  header | objects | lists | procedures | envs | promises | macros | record types | elements | strings
+ *
+ * The same format holds a list of forms on their own, with no global
+ * environment, which is how the module cache keeps code it has read.
+ */
+
+const char imageMagic[8] = {'M', 'G', 'C', 'I', 'M', 'G', '0', '7'};
+const uint32_t imageNone = 0xffffffff;
+
+struct ImageHeader {
+    char magic[8];
+    uint32_t numObjects;
+    uint32_t numLists;
+    uint32_t numProcedures;
+    uint32_t numEnvs;
+    uint32_t numPromises;
+    uint32_t numMacros;
+    uint32_t numRecordTypes;
+    uint32_t numElements;
+    uint32_t rootList;
+    uint32_t rootEnv;
+    uint32_t types;
+    uint32_t unused;
+    uint64_t stringBytes;
+};
+
+//Objects are written with their objType as a number, so an image also
+//records which numbering it was written with, in case a new type is added
+//without the magic changing.
+uint32_t imageTypes() {
+    uint32_t hash = 2166136261u;
+    for (const string& name : typeStr) {
+        for (unsigned char c : name + ",") {
+            hash ^= c;
+            hash *= 16777619u;
+        }
+    }
+    return hash;
+}
+
+//ref and value depend on type: a string is (length, offset), a list,
+//function or promise is (index, unused), a vector or map is (count, first
+//element) with a map's keys and values alternating, a record is (record
+//type, first slot), a binding is (symbol, value) and numbers and bools
+//live in value.
+struct ImageObject {
+    uint32_t type;
+    uint32_t ref;
+    int64_t value;
+};
+
+struct ImageList {
+    uint32_t first;
+    uint32_t count;
+};
+
+struct ImageProcedure {
+    uint32_t type;
+    uint32_t env;
+    uint32_t freeVars;
+    uint32_t code;
+    uint32_t name;
+    uint32_t nameLength;
+    uint32_t record;
+    uint32_t slot;
+};
+
+//A captured call frame: its procedure, its arguments (a run of elements)
+//and any defines. The global environment is the frame with no procedure.
+struct ImageEnv {
+    uint32_t proc;
+    uint32_t firstArg;
+    uint32_t numArgs;
+    uint32_t bindings;
+    uint32_t parent;
+};
+
+//An unforced promise keeps its code and env, or the name of the primitive
+//that makes it and that primitive's arguments (a run of elements). A
+//forced one only keeps its value.
+struct ImagePromise {
+    uint32_t code;
+    uint32_t env;
+    uint32_t name;
+    uint32_t nameLength;
+    uint32_t firstArg;
+    uint32_t numArgs;
+    uint32_t value;
+};
+
+//Its name is an object and its fields a list.
+struct ImageRecordType {
+    uint32_t name;
+    uint32_t fields;
+};
+
+struct ImageMacro {
+    uint32_t name;
+    uint32_t nameLength;
+    uint32_t procedure;
+};
+
+class HeapImage {
+    private:
+        EvalApply& evaluator;
+        string error;
+        vector<ImageObject> objects;
+        vector<ImageList> lists;
+        vector<ImageProcedure> procedures;
+        vector<ImageEnv> envs;
+        vector<ImagePromise> promises;
+        vector<ImageMacro> macros;
+        vector<ImageRecordType> recordTypes;
+        vector<uint32_t> elements;
+        string strings;
+        unordered_map<Object*, uint32_t> objectIds;
+        unordered_map<List*, uint32_t> listIds;
+        unordered_map<Procedure*, uint32_t> procedureIds;
+        unordered_map<Env*, uint32_t> envIds;
+        unordered_map<Promise*, uint32_t> promiseIds;
+        unordered_map<RecordType*, uint32_t> recordTypeIds;
+        deque<Object*> pendingObjects;
+        deque<List*> pendingLists;
+        deque<Procedure*> pendingProcedures;
+        deque<Env*> pendingEnvs;
+        deque<Promise*> pendingPromises;
+        uint32_t idOf(Object* obj);
+        uint32_t idOf(List* list);
+        uint32_t idOf(Procedure* proc);
+        uint32_t idOf(Env* env);
+        uint32_t idOf(Promise* promise);
+        uint32_t idOf(RecordType* type);
+        uint32_t addString(const string& str);
+        void writeObject(Object* obj);
+        void writeList(List* list);
+        void writeProcedure(Procedure* proc);
+        void writeEnv(Env* env);
+        void writePromise(Promise* promise);
+        bool fail(string message);
+        bool writeImage(string filename, uint32_t root, uint32_t rootEnv);
+        bool readImage(string filename, bool forms, List*& root);
+        bool readImageData(const char* base, size_t size, string name, bool forms, List*& root);
+        bool checkImage(const ImageHeader* header);
+    public:
+        HeapImage(EvalApply& eval);
+        bool save(string filename);
+        bool load(string filename);
+        bool saveForms(string filename, List* forms);
+        bool loadForms(string filename, List*& forms);
+        bool loadForms(const char* data, size_t size, List*& forms);
+        string lastError();
+};
+
+HeapImage::HeapImage(EvalApply& eval) : evaluator(eval) {
+
+}
+
+string HeapImage::lastError() {
+    return error;
+}
+
+bool HeapImage::fail(string message) {
+    error = message;
+    return false;
+}
+
+uint32_t HeapImage::idOf(Object* obj) {
+    if (obj == nullptr)
+        return imageNone;
+    auto it = objectIds.find(obj);
+    if (it != objectIds.end())
+        return it->second;
+    uint32_t id = objects.size();
+    objects.push_back({0, 0, 0});
+    objectIds[obj] = id;
+    pendingObjects.push_back(obj);
+    return id;
+}
+
+uint32_t HeapImage::idOf(List* list) {
+    if (list == nullptr)
+        return imageNone;
+    auto it = listIds.find(list);
+    if (it != listIds.end())
+        return it->second;
+    uint32_t id = lists.size();
+    lists.push_back({0, 0});
+    listIds[list] = id;
+    pendingLists.push_back(list);
+    return id;
+}
+
+uint32_t HeapImage::idOf(Procedure* proc) {
+    auto it = procedureIds.find(proc);
+    if (it != procedureIds.end())
+        return it->second;
+    uint32_t id = procedures.size();
+    procedures.push_back({0, imageNone, imageNone, imageNone, 0, 0, imageNone, 0});
+    procedureIds[proc] = id;
+    pendingProcedures.push_back(proc);
+    return id;
+}
+
+uint32_t HeapImage::idOf(Env* env) {
+    if (env == nullptr)
+        return imageNone;
+    auto it = envIds.find(env);
+    if (it != envIds.end())
+        return it->second;
+    uint32_t id = envs.size();
+    envs.push_back({imageNone, 0, 0, imageNone, imageNone});
+    envIds[env] = id;
+    pendingEnvs.push_back(env);
+    return id;
+}
+
+uint32_t HeapImage::idOf(Promise* promise) {
+    auto it = promiseIds.find(promise);
+    if (it != promiseIds.end())
+        return it->second;
+    uint32_t id = promises.size();
+    promises.push_back({imageNone, imageNone, 0, 0, 0, 0, imageNone});
+    promiseIds[promise] = id;
+    pendingPromises.push_back(promise);
+    return id;
+}
+
+//A record type has no references back to anything that refers to it, so
+//it's written as soon as it's seen.
+uint32_t HeapImage::idOf(RecordType* type) {
+    auto it = recordTypeIds.find(type);
+    if (it != recordTypeIds.end())
+        return it->second;
+    uint32_t id = recordTypes.size();
+    recordTypes.push_back({idOf(type->name), idOf(type->fields)});
+    recordTypeIds[type] = id;
+    return id;
+}
+
+uint32_t HeapImage::addString(const string& str) {
+    uint32_t offset = strings.size();
+    strings.append(str);
+    return offset;
+}
+
+void HeapImage::writeObject(Object* obj) {
+    ImageObject rec = {(uint32_t)obj->type, 0, 0};
+    switch (obj->type) {
+        case AS_INT: rec.value = obj->intVal; break;
+        case AS_REAL: memcpy(&rec.value, &obj->realVal, sizeof(double)); break;
+        case AS_BOOL: rec.value = obj->boolVal; break;
+        case AS_SYMBOL:
+        case AS_ERROR:
+            rec.ref = obj->strVal->size();
+            rec.value = addString(*obj->strVal);
+            break;
+        case AS_STRING:
+            rec.ref = obj->textVal->length;
+            rec.value = addString(toString(obj));
+            break;
+        case AS_PORT: {
+            //a port comes back closed, since its file may be gone.
+            string name = obj->portVal->getName();
+            rec.ref = name.size();
+            rec.value = addString(name);
+            break;
+        }
+        case AS_BIGNUM: {
+            string digits = obj->bigVal->toString();
+            rec.ref = digits.size();
+            rec.value = addString(digits);
+            break;
+        }
+        case AS_VECTOR: {
+            rec.ref = obj->vectorVal->size();
+            rec.value = elements.size();
+            vector<Object*> items;
+            obj->vectorVal->forEach([&](Object* it) { items.push_back(it); });
+            for (Object* it : items)
+                elements.push_back(idOf(it));
+            break;
+        }
+        case AS_MAP: {
+            rec.ref = obj->mapVal->size();
+            rec.value = elements.size();
+            vector<Object*> items;
+            obj->mapVal->forEach([&](Object* key, Object* value) {
+                items.push_back(key);
+                items.push_back(value);
+            });
+            for (Object* it : items)
+                elements.push_back(idOf(it));
+            break;
+        }
+        case AS_RECORD: {
+            rec.ref = idOf(obj->recordVal->type);
+            rec.value = elements.size();
+            for (int i = 0; i < obj->recordVal->type->size; i++)
+                elements.push_back(0);
+            uint32_t pos = rec.value;
+            for (int i = 0; i < obj->recordVal->type->size; i++)
+                elements[pos++] = idOf(obj->recordVal->slots[i]);
+            break;
+        }
+        case AS_LIST: rec.ref = idOf(obj->listVal); break;
+        case AS_FUNCTION: rec.ref = idOf(obj->procedureVal); break;
+        case AS_PROMISE: rec.ref = idOf(obj->promiseVal); break;
+        case AS_BINDING:
+            rec.ref = idOf(obj->bindingVal->symbol);
+            rec.value = idOf(obj->bindingVal->value);
+            break;
+        default:
+            break;
+    }
+    objects[objectIds[obj]] = rec;
+}
+
+void HeapImage::writeList(List* list) {
+    ImageList rec = {(uint32_t)elements.size(), (uint32_t)list->size()};
+    for (int i = 0; i < list->size(); i++)
+        elements.push_back(0);
+    uint32_t pos = rec.first;
+    for (Object* it : *list)
+        elements[pos++] = idOf(it);
+    lists[listIds[list]] = rec;
+}
+
+void HeapImage::writeProcedure(Procedure* proc) {
+    ImageProcedure rec = {(uint32_t)proc->type, imageNone, imageNone, imageNone, 0, 0, imageNone, 0};
+    //compiled code isn't saved, only the lambda it was compiled from, which
+    //is interpreted once loaded back.
+    if (proc->type == COMPILED)
+        rec.type = LAMBDA;
+    if (proc->record != nullptr) {
+        rec.record = idOf(proc->record);
+        rec.slot = proc->slot;
+    } else if (proc->type == PRIMITIVE) {
+        string name = evaluator.primitiveName(proc);
+        rec.name = addString(name);
+        rec.nameLength = name.size();
+    } else {
+        rec.env = idOf(proc->env);
+        rec.freeVars = idOf(proc->freeVars);
+        rec.code = idOf(proc->code);
+    }
+    procedures[procedureIds[proc]] = rec;
+}
+
+void HeapImage::writeEnv(Env* env) {
+    ImageEnv rec = {imageNone, (uint32_t)elements.size(), 0, idOf(env->bindings), idOf(env->parent)};
+    if (env->proc != nullptr) {
+        rec.proc = idOf(env->proc);
+        rec.numArgs = env->proc->freeVars->size();
+        for (uint32_t i = 0; i < rec.numArgs; i++)
+            elements.push_back(idOf(env->args[i]));
+    }
+    envs[envIds[env]] = rec;
+}
+
+void HeapImage::writePromise(Promise* promise) {
+    ImagePromise rec = {idOf(promise->code), idOf(promise->env), 0, 0, (uint32_t)elements.size(), 0, idOf(promise->value)};
+    if (promise->func != nullptr && promise->value == nullptr) {
+        string name = evaluator.primitiveName(promise->func);
+        rec.name = addString(name);
+        rec.nameLength = name.size();
+        rec.numArgs = promise->count;
+        for (int i = 0; i < promise->count; i++)
+            elements.push_back(idOf(promise->args[i]));
+    }
+    promises[promiseIds[promise]] = rec;
+}
+
+bool HeapImage::save(string filename) {
+    uint32_t root = idOf(evaluator.getEnvironment());
+    uint32_t rootEnv = idOf(evaluator.getGlobalEnv());
+    for (auto& macro : evaluator.getMacros()) {
+        macros.push_back({addString(macro.first), (uint32_t)macro.first.size(), idOf(macro.second)});
+    }
+    return writeImage(filename, root, rootEnv);
+}
+
+bool HeapImage::saveForms(string filename, List* forms) {
+    return writeImage(filename, idOf(forms), imageNone);
+}
+
+bool HeapImage::writeImage(string filename, uint32_t root, uint32_t rootEnv) {
+    while (!pendingObjects.empty() || !pendingLists.empty() || !pendingProcedures.empty() || !pendingEnvs.empty()
+           || !pendingPromises.empty()) {
+        if (!pendingObjects.empty()) {
+            writeObject(pendingObjects.front());
+            pendingObjects.pop_front();
+        } else if (!pendingLists.empty()) {
+            writeList(pendingLists.front());
+            pendingLists.pop_front();
+        } else if (!pendingProcedures.empty()) {
+            writeProcedure(pendingProcedures.front());
+            pendingProcedures.pop_front();
+        } else if (!pendingEnvs.empty()) {
+            writeEnv(pendingEnvs.front());
+            pendingEnvs.pop_front();
+        } else {
+            writePromise(pendingPromises.front());
+            pendingPromises.pop_front();
+        }
+    }
+    ImageHeader header;
+    memcpy(header.magic, imageMagic, sizeof(imageMagic));
+    header.numObjects = objects.size();
+    header.numLists = lists.size();
+    header.numProcedures = procedures.size();
+    header.numEnvs = envs.size();
+    header.numPromises = promises.size();
+    header.numMacros = macros.size();
+    header.numRecordTypes = recordTypes.size();
+    header.numElements = elements.size();
+    header.rootList = root;
+    header.rootEnv = rootEnv;
+    header.types = imageTypes();
+    header.unused = 0;
+    header.stringBytes = strings.size();
+    FILE* fp = fopen(filename.c_str(), "wb");
+    if (fp == nullptr)
+        return fail("could not open " + filename + " for writing");
+    fwrite(&header, sizeof(header), 1, fp);
+    fwrite(objects.data(), sizeof(ImageObject), objects.size(), fp);
+    fwrite(lists.data(), sizeof(ImageList), lists.size(), fp);
+    fwrite(procedures.data(), sizeof(ImageProcedure), procedures.size(), fp);
+    fwrite(envs.data(), sizeof(ImageEnv), envs.size(), fp);
+    fwrite(promises.data(), sizeof(ImagePromise), promises.size(), fp);
+    fwrite(macros.data(), sizeof(ImageMacro), macros.size(), fp);
+    fwrite(recordTypes.data(), sizeof(ImageRecordType), recordTypes.size(), fp);
+    fwrite(elements.data(), sizeof(uint32_t), elements.size(), fp);
+    fwrite(strings.data(), 1, strings.size(), fp);
+    bool ok = !ferror(fp);
+    fclose(fp);
+    return ok ? true:fail("error writing " + filename);
+}
+
+bool HeapImage::load(string filename) {
+    List* root;
+    if (!readImage(filename, false, root))
+        return false;
+    //primitives added since the image was written are still available.
+    root->addMissing(evaluator.getEnvironment());
+    evaluator.setEnvironment(root);
+    return true;
+}
+
+bool HeapImage::loadForms(string filename, List*& forms) {
+    return readImage(filename, true, forms);
+}
+
+//Forms from an image already in memory, like one built into compiled code.
+bool HeapImage::loadForms(const char* data, size_t size, List*& forms) {
+    return readImageData(data, size, "forms image", true, forms);
+}
+
+bool HeapImage::readImage(string filename, bool forms, List*& root) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return fail("could not open " + filename);
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(ImageHeader)) {
+        close(fd);
+        return fail(filename + " is not a heap image");
+    }
+    size_t size = st.st_size;
+    void* base = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return fail("could not map " + filename);
+    bool ok = readImageData((const char*)base, size, filename, forms, root);
+    munmap(base, size);
+    return ok;
+}
+
+//Rebuilds what an image holds and hands back its root list. A heap image
+//also brings its macros with it.
+bool HeapImage::readImageData(const char* base, size_t size, string name, bool forms, List*& root) {
+    if (size < sizeof(ImageHeader))
+        return fail(name + " is not a heap image");
+    const ImageHeader* header = (const ImageHeader*)base;
+    size_t expected = sizeof(ImageHeader) + header->numObjects*sizeof(ImageObject)
+                    + header->numLists*sizeof(ImageList) + header->numProcedures*sizeof(ImageProcedure)
+                    + header->numEnvs*sizeof(ImageEnv) + header->numPromises*sizeof(ImagePromise)
+                    + header->numMacros*sizeof(ImageMacro) + header->numRecordTypes*sizeof(ImageRecordType)
+                    + header->numElements*sizeof(uint32_t)
+                    + header->stringBytes;
+    if (memcmp(header->magic, imageMagic, sizeof(imageMagic)) != 0 || header->types != imageTypes() || expected != size
+        || (header->rootEnv == imageNone) != forms)
+        return fail(name + " is not a heap image");
+    if (!checkImage(header))
+        return fail(name + " is corrupt");
+    const ImageObject* objRecs = (const ImageObject*)(header + 1);
+    const ImageList* listRecs = (const ImageList*)(objRecs + header->numObjects);
+    const ImageProcedure* procRecs = (const ImageProcedure*)(listRecs + header->numLists);
+    const ImageEnv* envRecs = (const ImageEnv*)(procRecs + header->numProcedures);
+    const ImagePromise* promiseRecs = (const ImagePromise*)(envRecs + header->numEnvs);
+    const ImageMacro* macroRecs = (const ImageMacro*)(promiseRecs + header->numPromises);
+    const ImageRecordType* typeRecs = (const ImageRecordType*)(macroRecs + header->numMacros);
+    const uint32_t* elems = (const uint32_t*)(typeRecs + header->numRecordTypes);
+    const char* strs = (const char*)(elems + header->numElements);
+
+    vector<Object*> objs(header->numObjects);
+    vector<List*> lsts(header->numLists);
+    vector<Procedure*> procs(header->numProcedures);
+    vector<Env*> envList(header->numEnvs);
+    vector<Object*> promiseObjs(header->numPromises);
+    vector<RecordType*> types(header->numRecordTypes);
+    auto objAt = [&](uint32_t id) { return id == imageNone ? nullptr:objs[id]; };
+    auto listAt = [&](uint32_t id) { return id == imageNone ? nullptr:lsts[id]; };
+    auto envAt = [&](uint32_t id) { return id == imageNone ? nullptr:envList[id]; };
+    //symbols and small ints are shared with what's already loaded.
+    for (uint32_t i = 0; i < header->numObjects; i++) {
+        const ImageObject& rec = objRecs[i];
+        if (rec.type == AS_SYMBOL)
+            objs[i] = makeSymbolObject(string(strs + rec.value, rec.ref));
+        else if (rec.type == AS_INT)
+            objs[i] = makeIntObject(rec.value);
+        else
+            objs[i] = allocObject((objType)rec.type);
+    }
+    for (uint32_t i = 0; i < header->numLists; i++)
+        lsts[i] = new List();
+    for (uint32_t i = 0; i < header->numProcedures; i++) {
+        const ImageProcedure& rec = procRecs[i];
+        if (rec.type == PRIMITIVE && rec.record == imageNone) {
+            procs[i] = evaluator.makePrimitive(string(strs + rec.name, rec.nameLength));
+            if (procs[i] == nullptr)
+                return fail("image refers to unknown primitive " + string(strs + rec.name, rec.nameLength));
+        } else {
+            procs[i] = allocFunction(nullptr, nullptr, nullptr, (funcType)rec.type);
+        }
+    }
+    for (uint32_t i = 0; i < header->numPromises; i++)
+        promiseObjs[i] = makePromiseObject(nullptr, nullptr);
+    for (uint32_t i = 0; i < header->numRecordTypes; i++)
+        types[i] = makeRecordType(nullptr, nullptr, 0);
+    //the image's global environment becomes this one.
+    for (uint32_t i = 0; i < header->numEnvs; i++)
+        envList[i] = i == header->rootEnv ? evaluator.getGlobalEnv():makeEnv(nullptr, nullptr);
+
+    //Everything exists now, so indexes can be turned back into pointers.
+    for (uint32_t i = 0; i < header->numObjects; i++) {
+        const ImageObject& rec = objRecs[i];
+        Object* obj = objs[i];
+        switch (obj->type) {
+            case AS_REAL: memcpy(&obj->realVal, &rec.value, sizeof(double)); break;
+            case AS_BOOL: obj->boolVal = rec.value; break;
+            case AS_ERROR:
+                obj->strVal = new string(strs + rec.value, rec.ref);
+                heapAllocated(sizeof(string) + rec.ref);
+                break;
+            case AS_STRING: {
+                char* data = new char[rec.ref];
+                memcpy(data, strs + rec.value, rec.ref);
+                obj->textVal = new Text{data, rec.ref, true, nullptr};
+                heapAllocated(sizeof(Text) + rec.ref);
+                break;
+            }
+            case AS_PORT:
+                obj->portVal = new Port(string(strs + rec.value, rec.ref), nullptr);
+                obj->portVal->close();
+                break;
+            case AS_BIGNUM:
+                obj->bigVal = new BigInt();
+                BigInt::fromString(string(strs + rec.value, rec.ref), *obj->bigVal);
+                heapAllocated(sizeof(BigInt) + obj->bigVal->limbs.size() * sizeof(uint32_t));
+                break;
+            case AS_LIST: obj->listVal = lsts[rec.ref]; break;
+            case AS_FUNCTION: obj->procedureVal = procs[rec.ref]; break;
+            case AS_PROMISE: obj->promiseVal = promiseObjs[rec.ref]->promiseVal; break;
+            case AS_BINDING: obj->bindingVal = makeBinding(objAt(rec.ref), objAt(rec.value)); break;
+            default:
+                break;
+        }
+    }
+    for (uint32_t i = 0; i < header->numLists; i++) {
+        for (uint32_t k = 0; k < listRecs[i].count; k++)
+            lsts[i]->append(objs[elems[listRecs[i].first + k]]);
+    }
+    for (uint32_t i = 0; i < header->numRecordTypes; i++) {
+        types[i]->name = objs[typeRecs[i].name];
+        types[i]->fields = lsts[typeRecs[i].fields];
+        types[i]->size = types[i]->fields->size();
+    }
+    //maps hash their keys, so they are rebuilt only once every key is whole.
+    for (uint32_t i = 0; i < header->numObjects; i++) {
+        const ImageObject& rec = objRecs[i];
+        if (objs[i]->type == AS_VECTOR) {
+            PersistentVector* vec = (new PersistentVector())->asTransient();
+            for (uint32_t k = 0; k < rec.ref; k++)
+                vec = vec->conj(objs[elems[rec.value + k]]);
+            objs[i]->vectorVal = vec->asPersistent();
+        } else if (objs[i]->type == AS_MAP) {
+            PersistentMap* map = (new PersistentMap())->asTransient();
+            for (uint32_t k = 0; k < rec.ref; k++)
+                map = map->assoc(objs[elems[rec.value + 2*k]], objs[elems[rec.value + 2*k + 1]]);
+            objs[i]->mapVal = map->asPersistent();
+        } else if (objs[i]->type == AS_RECORD) {
+            vector<Object*> slots(types[rec.ref]->size);
+            for (uint32_t k = 0; k < slots.size(); k++)
+                slots[k] = objs[elems[rec.value + k]];
+            objs[i]->recordVal = makeRecord(types[rec.ref], slots.data());
+        }
+    }
+    for (uint32_t i = 0; i < header->numProcedures; i++) {
+        const ImageProcedure& rec = procRecs[i];
+        if (rec.record != imageNone) {
+            procs[i]->record = types[rec.record];
+            procs[i]->slot = rec.slot;
+            procs[i]->noJit = true;
+        } else if (rec.type != PRIMITIVE) {
+            procs[i]->env = envAt(rec.env);
+            procs[i]->freeVars = listAt(rec.freeVars);
+            procs[i]->code = objAt(rec.code);
+        }
+    }
+    for (uint32_t i = 0; i < header->numEnvs; i++) {
+        const ImageEnv& rec = envRecs[i];
+        if (i == header->rootEnv)
+            continue;
+        Env* env = envList[i];
+        env->bindings = listAt(rec.bindings);
+        env->parent = envAt(rec.parent);
+        if (rec.proc != imageNone) {
+            env->proc = procs[rec.proc];
+            env->args = new Object*[rec.numArgs];
+            heapAllocated(rec.numArgs * sizeof(Object*));
+            for (uint32_t k = 0; k < rec.numArgs; k++)
+                env->args[k] = objs[elems[rec.firstArg + k]];
+        }
+    }
+    for (uint32_t i = 0; i < header->numPromises; i++) {
+        const ImagePromise& rec = promiseRecs[i];
+        Promise* promise = promiseObjs[i]->promiseVal;
+        promise->code = objAt(rec.code);
+        promise->env = envAt(rec.env);
+        promise->value = objAt(rec.value);
+        if (rec.nameLength > 0) {
+            Procedure* prim = evaluator.makePrimitive(string(strs + rec.name, rec.nameLength));
+            if (prim == nullptr)
+                return fail("image refers to unknown primitive " + string(strs + rec.name, rec.nameLength));
+            promise->func = prim->func;
+            promise->count = rec.numArgs;
+            for (uint32_t k = 0; k < rec.numArgs; k++)
+                promise->args[k] = objs[elems[rec.firstArg + k]];
+        }
+    }
+    root = lsts[header->rootList];
+    for (uint32_t i = 0; i < header->numMacros; i++) {
+        const ImageMacro& rec = macroRecs[i];
+        evaluator.defineMacro(string(strs + rec.name, rec.nameLength), procs[rec.procedure]);
+    }
+    return true;
+}
+
+//Every index and offset in an image is checked against the header before
+//any of it is used, so a damaged file is refused instead of read past.
+bool HeapImage::checkImage(const ImageHeader* header) {
+    const ImageObject* objRecs = (const ImageObject*)(header + 1);
+    const ImageList* listRecs = (const ImageList*)(objRecs + header->numObjects);
+    const ImageProcedure* procRecs = (const ImageProcedure*)(listRecs + header->numLists);
+    const ImageEnv* envRecs = (const ImageEnv*)(procRecs + header->numProcedures);
+    const ImagePromise* promiseRecs = (const ImagePromise*)(envRecs + header->numEnvs);
+    const ImageMacro* macroRecs = (const ImageMacro*)(promiseRecs + header->numPromises);
+    const ImageRecordType* typeRecs = (const ImageRecordType*)(macroRecs + header->numMacros);
+    const uint32_t* elems = (const uint32_t*)(typeRecs + header->numRecordTypes);
+    auto isId = [](uint32_t id, uint32_t count) { return id < count; };
+    auto isRef = [](uint32_t id, uint32_t count) { return id == imageNone || id < count; };
+    auto isRun = [](uint64_t first, uint64_t count, uint64_t size) { return first <= size && count <= size - first; };
+    for (uint32_t i = 0; i < header->numElements; i++)
+        if (!isId(elems[i], header->numObjects))
+            return false;
+    for (uint32_t i = 0; i < header->numLists; i++)
+        if (!isRun(listRecs[i].first, listRecs[i].count, header->numElements))
+            return false;
+    for (uint32_t i = 0; i < header->numRecordTypes; i++)
+        if (!isId(typeRecs[i].name, header->numObjects) || !isId(typeRecs[i].fields, header->numLists))
+            return false;
+    for (uint32_t i = 0; i < header->numObjects; i++) {
+        const ImageObject& rec = objRecs[i];
+        if (rec.type >= (uint32_t)numObjTypes)
+            return false;
+        bool ok = true;
+        switch (rec.type) {
+            case AS_SYMBOL:
+            case AS_ERROR:
+            case AS_STRING:
+            case AS_PORT:
+            case AS_BIGNUM:
+                ok = rec.value >= 0 && isRun(rec.value, rec.ref, header->stringBytes);
+                break;
+            case AS_VECTOR: ok = rec.value >= 0 && isRun(rec.value, rec.ref, header->numElements); break;
+            case AS_MAP: ok = rec.value >= 0 && isRun(rec.value, 2 * (uint64_t)rec.ref, header->numElements); break;
+            case AS_RECORD:
+                ok = isId(rec.ref, header->numRecordTypes) && rec.value >= 0
+                    && isRun(rec.value, listRecs[typeRecs[rec.ref].fields].count, header->numElements);
+                break;
+            case AS_LIST: ok = isId(rec.ref, header->numLists); break;
+            case AS_FUNCTION: ok = isId(rec.ref, header->numProcedures); break;
+            case AS_PROMISE: ok = isId(rec.ref, header->numPromises); break;
+            case AS_BINDING: ok = isRef(rec.ref, header->numObjects) && rec.value >= 0 && isRef(rec.value, header->numObjects); break;
+            default: break;
+        }
+        if (!ok)
+            return false;
+    }
+    for (uint32_t i = 0; i < header->numProcedures; i++) {
+        const ImageProcedure& rec = procRecs[i];
+        if (rec.type > RECORD_ACCESSOR || !isRef(rec.record, header->numRecordTypes))
+            return false;
+        if (rec.type == PRIMITIVE && rec.record == imageNone && !isRun(rec.name, rec.nameLength, header->stringBytes))
+            return false;
+        if (!isRef(rec.env, header->numEnvs) || !isRef(rec.freeVars, header->numLists) || !isRef(rec.code, header->numObjects))
+            return false;
+    }
+    for (uint32_t i = 0; i < header->numEnvs; i++) {
+        const ImageEnv& rec = envRecs[i];
+        if (!isRef(rec.proc, header->numProcedures) || !isRef(rec.bindings, header->numLists) || !isRef(rec.parent, header->numEnvs))
+            return false;
+        if (rec.proc != imageNone && !isRun(rec.firstArg, rec.numArgs, header->numElements))
+            return false;
+    }
+    for (uint32_t i = 0; i < header->numPromises; i++) {
+        const ImagePromise& rec = promiseRecs[i];
+        if (!isRef(rec.code, header->numObjects) || !isRef(rec.env, header->numEnvs) || !isRef(rec.value, header->numObjects))
+            return false;
+        if (rec.nameLength > 0 && (!isRun(rec.name, rec.nameLength, header->stringBytes) || rec.numArgs > (uint32_t)promiseMaxArgs
+            || !isRun(rec.firstArg, rec.numArgs, header->numElements)))
+            return false;
+    }
+    for (uint32_t i = 0; i < header->numMacros; i++) {
+        const ImageMacro& rec = macroRecs[i];
+        if (!isRun(rec.name, rec.nameLength, header->stringBytes) || !isId(rec.procedure, header->numProcedures))
+            return false;
+    }
+    return isId(header->rootList, header->numLists) && isRef(header->rootEnv, header->numEnvs);
+}
+
+#endif
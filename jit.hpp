@@ -0,0 +1,550 @@
+#ifndef jit_hpp
+#define jit_hpp
+#include <iostream>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "objects.hpp"
+#include "list.hpp"
+using namespace std;
+
+/*
+ * A template JIT for hot lambdas. A body made only of integer parameters,
+ * integer and bool constants, if, + - * < > eq and calls to other such
+ * lambdas is lowered to a small typed tree, and each node is emitted as a
+ * fixed x86-64 byte template with its immediates patched in.
+ *
+ * Compiled code is pure, so whenever it can't produce the same answer as
+ * the interpreter (an argument isn't an int, a result leaves int range,
+ * a callee was invalidated) it sets ctx->bailed and the whole call is
+ * simply re-run by the interpreter.
+ */
+
+enum JitOp {
+    JIT_CONST, JIT_PARAM, JIT_ADD, JIT_SUB, JIT_MUL, JIT_LT, JIT_GT, JIT_EQ, JIT_IF, JIT_CALL, JIT_UNKNOWN
+};
+
+enum JitType { JIT_INT, JIT_BOOL };
+
+struct JitCode;
+
+struct JitNode {
+    JitOp op;
+    JitType type;
+    long value;
+    JitCode* callee;
+    vector<JitNode*> kids;
+    JitNode(JitOp o, JitType t, long v = 0) : op(o), type(t), value(v), callee(nullptr) { }
+};
+
+//A JitCode outlives the machine code it points to: callers call through
+//its entry field, so invalidating it only has to repoint entry at the bail stub.
+struct JitCode {
+    void* entry;
+    void* memory;
+    size_t size;
+    int arity;
+    JitType result;
+    bool assumedInt;
+    //how long a call from the interpreter has been taking, in nanoseconds.
+    long nanos;
+    //calls from the interpreter that bailed and had to be run again.
+    int bails;
+    vector<Procedure*> callers;
+};
+
+struct JitContext {
+    long bailed;
+    long depth;
+};
+
+//What a global symbol in call position turned out to be.
+struct JitSymbol {
+    JitOp op;
+    Procedure* proc;
+    string name;
+};
+
+typedef long (*JitEntry)(const long* args, JitContext* ctx);
+typedef function<JitSymbol(Object*)> JitResolver;
+
+const int jitMaxArgs = 16;
+const int jitMaxDepth = 50000;
+//bails a lambda's native code gets before it's left to the interpreter.
+const int jitMaxBails = 4;
+//C stack native code can use at jitMaxDepth, with room to spare.
+const size_t jitStackBytes = jitMaxDepth * 128;
+
+class Jit {
+    private:
+        void* bailStub;
+        vector<uint8_t> code;
+        vector<size_t> bailJumps;
+        int depth;
+        bool tooDeep;
+        JitResolver resolve;
+        unordered_map<string, vector<Procedure*>> dependents;
+        vector<string> deps;
+        vector<Procedure*> callees;
+        vector<JitCode*> codes;
+        JitNode* lower(Object* form, List* params);
+        JitNode* lowerCall(JitSymbol sym, ListNode* args, int numArgs, List* params);
+        int paramIndex(Object* symbol, List* params);
+        void emit(initializer_list<uint8_t> bytes);
+        void emit32(int32_t value);
+        void emit64(int64_t value);
+        size_t emitJump(initializer_list<uint8_t> opcode);
+        void patchJump(size_t at, size_t target);
+        void emitBail(initializer_list<uint8_t> opcode);
+        void emitNode(JitNode* node);
+        void emitArith(JitNode* node);
+        void emitCall(JitNode* node);
+        void* install();
+        void fail(Procedure* proc);
+    public:
+        Jit();
+        ~Jit();
+        JitCode* compile(Procedure* proc, JitResolver resolver);
+        bool run(JitCode* native, Object** args, int count, Object*& result);
+        bool ranTooDeep();
+        static bool call(JitCode* native, const long* argv, long& value, bool& tooDeep);
+        void invalidate(string name);
+        void invalidate(Procedure* proc);
+};
+
+Jit::Jit() {
+    tooDeep = false;
+    //mov qword [rsi], 1; xor eax, eax; ret
+    uint8_t stub[] = {0x48, 0xc7, 0x06, 0x01, 0x00, 0x00, 0x00, 0x31, 0xc0, 0xc3};
+    bailStub = mmap(nullptr, getpagesize(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    memcpy(bailStub, stub, sizeof(stub));
+    mprotect(bailStub, getpagesize(), PROT_READ | PROT_EXEC);
+}
+
+//Every JitCode ever made is kept here, since callers may still hold one
+//after it's been invalidated.
+Jit::~Jit() {
+    for (JitCode* native : codes) {
+        if (native->memory != nullptr)
+            munmap(native->memory, native->size);
+        delete native;
+    }
+    munmap(bailStub, getpagesize());
+}
+
+int Jit::paramIndex(Object* symbol, List* params) {
+    int i = 0;
+    for (Object* it : *params) {
+        if (compareObject(it, symbol))
+            return i;
+        i++;
+    }
+    return -1;
+}
+
+JitNode* Jit::lower(Object* form, List* params) {
+    switch (form->type) {
+        case AS_INT:
+            return new JitNode(JIT_CONST, JIT_INT, form->intVal);
+        case AS_BOOL:
+            return new JitNode(JIT_CONST, JIT_BOOL, form->boolVal);
+        case AS_SYMBOL: {
+            int index = paramIndex(form, params);
+            return index == -1 ? nullptr:new JitNode(JIT_PARAM, JIT_INT, index);
+        }
+        case AS_LIST:
+            break;
+        default:
+            return nullptr;
+    }
+    List* list = form->listVal;
+    if (list->empty() || list->first()->info->type != AS_SYMBOL)
+        return nullptr;
+    Object* head = list->first()->info;
+    ListNode* args = list->first()->next;
+    if (head->special == SF_IF) {
+        if (list->size() != 4)
+            return nullptr;
+        JitNode* test = lower(args->info, params);
+        JitNode* pos = lower(args->next->info, params);
+        JitNode* neg = lower(args->next->next->info, params);
+        if (test == nullptr || pos == nullptr || neg == nullptr || pos->type != neg->type)
+            return nullptr;
+        //anything but a bool counts as true to the interpreter.
+        if (test->type != JIT_BOOL)
+            return pos;
+        JitNode* node = new JitNode(JIT_IF, pos->type);
+        node->kids = {test, pos, neg};
+        return node;
+    }
+    if (head->special != SF_NONE || paramIndex(head, params) != -1)
+        return nullptr;
+    JitSymbol sym = resolve(head);
+    if (sym.op == JIT_UNKNOWN)
+        return nullptr;
+    deps.push_back(sym.name);
+    return lowerCall(sym, args, list->size() - 1, params);
+}
+
+JitNode* Jit::lowerCall(JitSymbol sym, ListNode* args, int numArgs, List* params) {
+    vector<JitNode*> kids;
+    for (ListNode* it = args; it != nullptr; it = it->next) {
+        JitNode* kid = lower(it->info, params);
+        if (kid == nullptr)
+            return nullptr;
+        kids.push_back(kid);
+    }
+    switch (sym.op) {
+        case JIT_ADD:
+        case JIT_SUB:
+        case JIT_MUL: {
+            //n-ary arithmetic folds left, and a single operand is returned as is.
+            if (kids.empty())
+                return nullptr;
+            for (JitNode* kid : kids)
+                if (kid->type != JIT_INT)
+                    return nullptr;
+            JitNode* acc = kids[0];
+            for (size_t i = 1; i < kids.size(); i++) {
+                JitNode* node = new JitNode(sym.op, JIT_INT);
+                node->kids = {acc, kids[i]};
+                acc = node;
+            }
+            return acc;
+        }
+        case JIT_LT:
+        case JIT_GT:
+        case JIT_EQ: {
+            if (kids.size() != 2 || kids[0]->type != kids[1]->type)
+                return nullptr;
+            if (sym.op != JIT_EQ && kids[0]->type != JIT_INT)
+                return nullptr;
+            JitNode* node = new JitNode(sym.op, JIT_BOOL);
+            node->kids = kids;
+            return node;
+        }
+        case JIT_CALL: {
+            Procedure* callee = sym.proc;
+            if (callee->freeVars->size() != numArgs || numArgs > jitMaxArgs)
+                return nullptr;
+            for (JitNode* kid : kids)
+                if (kid->type != JIT_INT)
+                    return nullptr;
+            if (callee->native == nullptr) {
+                if (callee->noJit || compile(callee, resolve) == nullptr)
+                    return nullptr;
+            }
+            JitCode* target = callee->native;
+            //a callee still being compiled has no known result type yet.
+            if (target->memory == nullptr)
+                target->assumedInt = true;
+            JitNode* node = new JitNode(JIT_CALL, target->memory == nullptr ? JIT_INT:target->result);
+            node->callee = target;
+            node->kids = kids;
+            callees.push_back(callee);
+            return node;
+        }
+        default:
+            break;
+    }
+    return nullptr;
+}
+
+void Jit::emit(initializer_list<uint8_t> bytes) {
+    code.insert(code.end(), bytes);
+}
+
+void Jit::emit32(int32_t value) {
+    uint8_t bytes[4];
+    memcpy(bytes, &value, 4);
+    code.insert(code.end(), bytes, bytes + 4);
+}
+
+void Jit::emit64(int64_t value) {
+    uint8_t bytes[8];
+    memcpy(bytes, &value, 8);
+    code.insert(code.end(), bytes, bytes + 8);
+}
+
+size_t Jit::emitJump(initializer_list<uint8_t> opcode) {
+    emit(opcode);
+    emit32(0);
+    return code.size() - 4;
+}
+
+void Jit::patchJump(size_t at, size_t target) {
+    int32_t rel = target - (at + 4);
+    memcpy(&code[at], &rel, 4);
+}
+
+void Jit::emitBail(initializer_list<uint8_t> opcode) {
+    bailJumps.push_back(emitJump(opcode));
+}
+
+void Jit::emitArith(JitNode* node) {
+    emitNode(node->kids[0]);
+    emit({0x50});                               //push rax
+    depth++;
+    emitNode(node->kids[1]);
+    emit({0x48, 0x89, 0xc1});                   //mov rcx, rax
+    emit({0x58});                               //pop rax
+    depth--;
+    switch (node->op) {
+        case JIT_ADD: emit({0x48, 0x01, 0xc8}); break;          //add rax, rcx
+        case JIT_SUB: emit({0x48, 0x29, 0xc8}); break;          //sub rax, rcx
+        case JIT_MUL: emit({0x48, 0x0f, 0xaf, 0xc1}); break;    //imul rax, rcx
+        case JIT_LT:
+        case JIT_GT:
+        case JIT_EQ:
+            emit({0x48, 0x39, 0xc8});                           //cmp rax, rcx
+            if (node->op == JIT_LT) emit({0x0f, 0x9c, 0xc0});   //setl al
+            if (node->op == JIT_GT) emit({0x0f, 0x9f, 0xc0});   //setg al
+            if (node->op == JIT_EQ) emit({0x0f, 0x94, 0xc0});   //sete al
+            emit({0x0f, 0xb6, 0xc0});                           //movzx eax, al
+            return;
+        default:
+            break;
+    }
+    //results have to fit in an int, or the interpreter takes over.
+    emit({0x48, 0x63, 0xc8});                   //movsxd rcx, eax
+    emit({0x48, 0x39, 0xc1});                   //cmp rcx, rax
+    emitBail({0x0f, 0x85});                     //jne bail
+}
+
+void Jit::emitCall(JitNode* node) {
+    int n = node->kids.size();
+    //arguments go in a block at the top of the stack, which has to stay
+    //16 byte aligned at the call.
+    int slots = n + ((depth + n) % 2);
+    if (slots > 0) {
+        emit({0x48, 0x81, 0xec});               //sub rsp, imm32
+        emit32(slots * 8);
+    }
+    depth += slots;
+    for (int i = 0; i < n; i++) {
+        emitNode(node->kids[i]);
+        emit({0x48, 0x89, 0x84, 0x24});         //mov [rsp + disp32], rax
+        emit32(i * 8);
+    }
+    emit({0x48, 0x89, 0xe7});                   //mov rdi, rsp
+    emit({0x4c, 0x89, 0xe6});                   //mov rsi, r12
+    emit({0x48, 0xb8});                         //mov rax, imm64
+    emit64((int64_t)&node->callee->entry);
+    emit({0xff, 0x10});                         //call [rax]
+    if (slots > 0) {
+        emit({0x48, 0x81, 0xc4});               //add rsp, imm32
+        emit32(slots * 8);
+    }
+    depth -= slots;
+    emit({0x49, 0x83, 0x3c, 0x24, 0x00});       //cmp qword [r12], 0
+    emitBail({0x0f, 0x85});                     //jne bail
+}
+
+void Jit::emitNode(JitNode* node) {
+    switch (node->op) {
+        case JIT_CONST:
+            emit({0x48, 0xb8});                 //mov rax, imm64
+            emit64(node->value);
+            break;
+        case JIT_PARAM:
+            emit({0x48, 0x8b, 0x83});           //mov rax, [rbx + disp32]
+            emit32(node->value * 8);
+            break;
+        case JIT_IF: {
+            emitNode(node->kids[0]);
+            emit({0x48, 0x85, 0xc0});           //test rax, rax
+            size_t toElse = emitJump({0x0f, 0x84});     //je else
+            emitNode(node->kids[1]);
+            size_t toEnd = emitJump({0xe9});            //jmp end
+            patchJump(toElse, code.size());
+            emitNode(node->kids[2]);
+            patchJump(toEnd, code.size());
+            break;
+        }
+        case JIT_CALL:
+            emitCall(node);
+            break;
+        default:
+            emitArith(node);
+            break;
+    }
+}
+
+void* Jit::install() {
+    size_t page = getpagesize();
+    size_t size = (code.size() + page - 1) / page * page;
+    void* mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        return nullptr;
+    memcpy(mem, code.data(), code.size());
+    if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(mem, size);
+        return nullptr;
+    }
+    return mem;
+}
+
+void Jit::fail(Procedure* proc) {
+    proc->noJit = true;
+    invalidate(proc);
+}
+
+JitCode* Jit::compile(Procedure* proc, JitResolver resolver) {
+    if (proc->type != LAMBDA || proc->freeVars->size() > jitMaxArgs)
+        return nullptr;
+    for (Object* it : *proc->freeVars)
+        if (it->type != AS_SYMBOL)
+            return nullptr;
+    //the cell goes in first so recursive calls can refer to it.
+    JitCode* native = new JitCode;
+    native->entry = bailStub;
+    native->memory = nullptr;
+    native->size = 0;
+    native->arity = proc->freeVars->size();
+    native->result = JIT_INT;
+    native->assumedInt = false;
+    native->nanos = 0;
+    native->bails = 0;
+    codes.push_back(native);
+    proc->native = native;
+
+    resolve = resolver;
+    vector<string> outerDeps;
+    vector<Procedure*> outerCallees;
+    outerDeps.swap(deps);
+    outerCallees.swap(callees);
+    JitNode* body = lower(proc->code, proc->freeVars);
+    vector<string> myDeps;
+    vector<Procedure*> myCallees;
+    myDeps.swap(deps);
+    myCallees.swap(callees);
+    deps.swap(outerDeps);
+    callees.swap(outerCallees);
+    if (body == nullptr || (native->assumedInt && body->type != JIT_INT)) {
+        fail(proc);
+        return nullptr;
+    }
+
+    vector<uint8_t> outerCode;
+    vector<size_t> outerBails;
+    outerCode.swap(code);
+    outerBails.swap(bailJumps);
+    int outerDepth = depth;
+    depth = 0;
+    emit({0x55});                               //push rbp
+    emit({0x48, 0x89, 0xe5});                   //mov rbp, rsp
+    emit({0x53});                               //push rbx
+    emit({0x41, 0x54});                         //push r12
+    emit({0x48, 0x89, 0xfb});                   //mov rbx, rdi
+    emit({0x49, 0x89, 0xf4});                   //mov r12, rsi
+    emit({0x49, 0xff, 0x44, 0x24, 0x08});       //inc qword [r12+8]
+    emit({0x49, 0x81, 0x7c, 0x24, 0x08});       //cmp qword [r12+8], imm32
+    emit32(jitMaxDepth);
+    emitBail({0x0f, 0x8f});                     //jg bail
+    emitNode(body);
+    emit({0x49, 0xff, 0x4c, 0x24, 0x08});       //dec qword [r12+8]
+    emit({0x41, 0x5c});                         //pop r12
+    emit({0x5b});                               //pop rbx
+    emit({0x5d});                               //pop rbp
+    emit({0xc3});                               //ret
+    for (size_t at : bailJumps)
+        patchJump(at, code.size());
+    emit({0x49, 0xc7, 0x04, 0x24});             //mov qword [r12], 1
+    emit32(1);
+    emit({0x48, 0x8d, 0x65, 0xf0});             //lea rsp, [rbp-16]
+    emit({0x41, 0x5c});                         //pop r12
+    emit({0x5b});                               //pop rbx
+    emit({0x5d});                               //pop rbp
+    emit({0xc3});                               //ret
+    void* mem = install();
+    size_t size = code.size();
+    code.swap(outerCode);
+    bailJumps.swap(outerBails);
+    depth = outerDepth;
+    if (mem == nullptr || proc->native != native) {
+        if (mem != nullptr)
+            munmap(mem, size);
+        fail(proc);
+        return nullptr;
+    }
+    native->memory = mem;
+    native->size = size;
+    native->result = body->type;
+    native->entry = mem;
+    for (string& name : myDeps)
+        dependents[name].push_back(proc);
+    for (Procedure* callee : myCallees)
+        if (callee->native != nullptr)
+            callee->native->callers.push_back(proc);
+    return native;
+}
+
+bool Jit::run(JitCode* native, Object** args, int count, Object*& result) {
+    long argv[jitMaxArgs];
+    tooDeep = false;
+    if (count != native->arity)
+        return false;
+    for (int i = 0; i < count; i++) {
+        if (args[i]->type != AS_INT)
+            return false;
+        argv[i] = args[i]->intVal;
+    }
+    long value;
+    if (!call(native, argv, value, tooDeep)) {
+        if (!tooDeep)
+            native->bails++;
+        return false;
+    }
+    result = native->result == JIT_INT ? makeIntObject(value):makeBoolObject(value);
+    return true;
+}
+
+//Runs native code on arguments already unboxed. It touches nothing but
+//its own context, so any thread can do this. False if it bailed.
+bool Jit::call(JitCode* native, const long* argv, long& value, bool& tooDeep) {
+    JitContext ctx = {0, 0};
+    value = ((JitEntry)native->entry)(argv, &ctx);
+    tooDeep = ctx.depth > jitMaxDepth;
+    return !ctx.bailed;
+}
+
+//Whether the last run bailed because it recursed past jitMaxDepth.
+bool Jit::ranTooDeep() {
+    return tooDeep;
+}
+
+//Called whenever a global is defined or set: anything compiled against
+//the old value goes back to the interpreter until it gets hot again.
+void Jit::invalidate(string name) {
+    auto it = dependents.find(name);
+    if (it == dependents.end())
+        return;
+    vector<Procedure*> procs;
+    procs.swap(it->second);
+    dependents.erase(it);
+    for (Procedure* proc : procs)
+        invalidate(proc);
+}
+
+void Jit::invalidate(Procedure* proc) {
+    JitCode* native = proc->native;
+    if (native == nullptr)
+        return;
+    proc->native = nullptr;
+    proc->calls = 0;
+    native->entry = bailStub;
+    if (native->memory != nullptr) {
+        munmap(native->memory, native->size);
+        native->memory = nullptr;
+    }
+    vector<Procedure*> callers;
+    callers.swap(native->callers);
+    for (Procedure* caller : callers)
+        invalidate(caller);
+}
+
+#endif
@@ -21,10 +21,10 @@ struct Stack : public stack<T> {
 
 
 enum Token {
-    LPAREN, RPAREN, SYMBOL, NUMBER, REALNUM, ERROR
+    LPAREN, RPAREN, SYMBOL, NUMBER, REALNUM, STRING, ERROR
 };
 
-vector<string> tokenStr = { "LPAREN", "RPAREN", "SYMBOL", "NUMBER", "REALNUM", "ERROR" };
+vector<string> tokenStr = { "LPAREN", "RPAREN", "SYMBOL", "NUMBER", "REALNUM", "STRING", "ERROR" };
 
 struct Lexeme {
     Token token;
@@ -40,6 +40,7 @@ class Lexer {
         bool is_skip(char c);
         Lexeme extractNumber();
         Lexeme extractWord();
+        Lexeme extractString();
         Lexeme checkSpecials();
     public:
         Lexer();
@@ -62,6 +63,15 @@ vector<Lexeme> Lexer::lex(string input) {
             tokens.push_back(extractNumber());
         } else if (isalpha(buffer.getChar())) {
             tokens.push_back(extractWord());
+        } else if (buffer.getChar() == '"') {
+            Lexeme lexeme = extractString();
+            if (lexeme.token == ERROR) {
+                cout<<"Error: "<<lexeme.strVal<<endl;
+                tokens.clear();
+                tokens.push_back(lexeme);
+                return tokens;
+            }
+            tokens.push_back(lexeme);
         } else {
             tokens.push_back(checkSpecials());
             if (tokens.back().token != NUMBER && tokens.back().token != REALNUM)
@@ -102,13 +112,36 @@ Lexeme Lexer::extractNumber() {
 
 Lexeme Lexer::extractWord() {
     string word;
-    while (!is_skip(buffer.getChar()) && (isalpha(buffer.getChar()) || isdigit(buffer.getChar()) || buffer.getChar() == '-' || buffer.getChar() == '?')) {
+    while (!is_skip(buffer.getChar()) && (isalpha(buffer.getChar()) || isdigit(buffer.getChar()) || buffer.getChar() == '-' || buffer.getChar() == '?' || buffer.getChar() == '/')) {
         word.push_back(buffer.getChar());
         buffer.advance();
     }
     return Lexeme(SYMBOL, word);
 }
 
+//"..." with \" and \\ for a quote or backslash and \n and \t for newline and tab.
+Lexeme Lexer::extractString() {
+    string str;
+    buffer.advance();
+    while (!buffer.isEOF() && buffer.getChar() != '"') {
+        char c = buffer.getChar();
+        if (c == '\\') {
+            buffer.advance();
+            if (buffer.isEOF())
+                break;
+            c = buffer.getChar();
+            if (c == 'n') c = '\n';
+            else if (c == 't') c = '\t';
+        }
+        str.push_back(c);
+        buffer.advance();
+    }
+    if (buffer.isEOF())
+        return Lexeme(ERROR, "Unterminated string");
+    buffer.advance();
+    return Lexeme(STRING, str);
+}
+
 Lexeme Lexer::checkSpecials() {
     switch (buffer.getChar()) {
         case '(': 
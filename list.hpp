@@ -5,6 +5,11 @@
 bool compareObject(Object* lhs, Object* rhs);
 
 string toString(Object*);
+string vectorString(PersistentVector* vec);
+string mapString(PersistentMap* map);
+string recordString(Record* record);
+bool vectorEquals(PersistentVector* lhs, PersistentVector* rhs);
+bool mapEquals(PersistentMap* lhs, PersistentMap* rhs);
 
 struct ListNode {
     Object* info;
@@ -12,6 +17,19 @@ struct ListNode {
     ListNode(Object* obj = nullptr, ListNode* n = nullptr) : info(obj), next(n) { }
 };
 
+ListNode* allocListNode(Object* obj) {
+    heapStats.liveListNodes++;
+    heapStats.totalListNodes++;
+    heapAllocated(sizeof(ListNode));
+    return new ListNode(obj);
+}
+
+void freeListNode(ListNode* node) {
+    heapStats.liveListNodes--;
+    heapFreed(sizeof(ListNode));
+    delete node;
+}
+
 class ListIterator {
     private:
         ListNode* current;
@@ -46,6 +64,9 @@ class List {
         link head;
         link tail;
         int count;
+        QuickForm* quick;
+        int expanded;
+        bool shared;
     public:
         List();
         List(const List& list);
@@ -70,30 +91,50 @@ class List {
         string asString();
         List* rest();
         List& operator=(const List& list);
+        QuickForm* getQuick();
+        void setQuick(QuickForm* form);
+        int getExpanded();
+        void setExpanded(int generation);
+        bool isShared();
+        void markShared();
 };
 
 List::List() {
+    heapStats.liveLists++;
+    heapAllocated(sizeof(List));
     head = nullptr;
     tail = nullptr;
     count = 0;
+    quick = nullptr;
+    expanded = -1;
+    shared = false;
 }
 
 List::List(const List& list) {
+    heapStats.liveLists++;
+    heapAllocated(sizeof(List));
     head = nullptr;
     tail = nullptr;
     count = 0;
+    quick = nullptr;
+    expanded = -1;
+    shared = false;
     for (link it = list.head; it != nullptr; it = it->next)
         append(it->info);
+    evalStats.listCopies++;
+    evalStats.copiedNodes += count;
 }
 
 List::~List() {
     while (head != nullptr) {
         link x = head;
         head = head->next;
-        string s = toString(x->info);
         destroyObject(x->info);
-        delete x;
+        freeListNode(x);
     }
+    destroyQuickForm(quick);
+    heapStats.liveLists--;
+    heapFreed(sizeof(List));
 }
 
 bool List::empty() {
@@ -105,7 +146,7 @@ int List::size() {
 }
 
 void List::append(Object* obj) {
-    link t = new node(obj);
+    link t = allocListNode(obj);
     if (empty()) {
         head = t;
     } else {
@@ -116,7 +157,7 @@ void List::append(Object* obj) {
 }
 
 void List::push(Object* obj) {
-    ListNode* t = new ListNode(obj);
+    ListNode* t = allocListNode(obj);
     if (empty()) {
         tail = t;
     } else {
@@ -150,9 +191,11 @@ ListNode* List::getNthNode(int N) {
 }
 
 void List::addMissing(List* list) {
+    evalStats.listCopies++;
     for (Object* it : *list) {
         if (find(it) == -1) {
             append(it);
+            evalStats.copiedNodes++;
         }
     }
 }
@@ -171,7 +214,7 @@ void List::deleteNth(int N) {
         prev->next = it->next;
         if (k == count-1)
             tail = prev;
-        delete it;
+        freeListNode(it);
         count--;
     }
 }
@@ -181,7 +224,7 @@ Object* List::pop_front() {
     link t = head;
     head = head->next;
     count--;
-    delete t;
+    freeListNode(t);
     return ret;
 }
 
@@ -199,6 +242,8 @@ List* List::copy() {
     List* nl = new List();
     for (link it = head; it != nullptr; it = it->next)
         nl->append(it->info);
+    evalStats.listCopies++;
+    evalStats.copiedNodes += nl->count;
     return nl;
 }
 
@@ -208,6 +253,8 @@ List* List::copyOmitNth(int N) {
     for (link it = head; it != nullptr; it = it->next, i++)
         if (i != N)
             nl->append(it->info);
+    evalStats.listCopies++;
+    evalStats.copiedNodes += nl->count;
     return nl;
 }
 
@@ -221,11 +268,42 @@ List& List::operator=(const List& list) {
     head = nullptr;
     tail = nullptr;
     count = 0;
+    setQuick(nullptr);
+    expanded = -1;
     for (link it = list.head; it != nullptr; it = it->next)
         append(it->info);
     return *this;
 }
 
+//The specialized form of this list when it is a call site, see quickKind.
+QuickForm* List::getQuick() {
+    return quick;
+}
+
+void List::setQuick(QuickForm* form) {
+    if (quick != form)
+        destroyQuickForm(quick);
+    quick = form;
+}
+
+//The macro generation this list was last expanded under, -1 if never.
+int List::getExpanded() {
+    return expanded;
+}
+
+void List::setExpanded(int generation) {
+    expanded = generation;
+}
+
+//Whether this is a shared quoted constant, which nothing may rewrite.
+bool List::isShared() {
+    return shared;
+}
+
+void List::markShared() {
+    shared = true;
+}
+
 ListIterator List::begin() {
     return ListIterator(head);
 }
@@ -243,8 +321,15 @@ string toString(Object* obj) {
     switch (obj->type) {
         case AS_INT: return to_string(obj->intVal);
         case AS_REAL: return to_string(obj->realVal);
+        case AS_BIGNUM: return obj->bigVal->toString();
         case AS_LIST: return obj->listVal->asString();
         case AS_FUNCTION: return "(func)";
+        case AS_PROMISE: return "(promise)";
+        case AS_PORT: return "(port)";
+        case AS_VECTOR: return vectorString(obj->vectorVal);
+        case AS_MAP: return mapString(obj->mapVal);
+        case AS_RECORD: return recordString(obj->recordVal);
+        case AS_STRING: return string(obj->textVal->data, obj->textVal->length);
         case AS_ERROR:
         case AS_SYMBOL: return *(obj->strVal);
         case AS_BOOL: return obj->boolVal ? "true":"false";
@@ -255,14 +340,48 @@ string toString(Object* obj) {
     return "NIL";
 }
 
+//Prints a run of call arguments the way the list holding them would print.
+string spanString(Object** args, int count) {
+    string str = "( ";
+    for (int i = 0; i < count; i++)
+        str.append(toString(args[i]) + " ");
+    str.append(")");
+    return str;
+}
+
+List* listFromSpan(Object** args, int count) {
+    List* list = new List();
+    for (int i = 0; i < count; i++)
+        list->append(args[i]);
+    return list;
+}
+
 bool compareObject(Object* lhs, Object* rhs) {
+    if (lhs == rhs)
+        return true;
     if (lhs->type != rhs->type)
         return false;
     switch (lhs->type) {
         case AS_INT: return lhs->intVal == rhs->intVal;
         case AS_REAL: return lhs->realVal == rhs->realVal;
+        case AS_BIGNUM: return lhs->bigVal->compare(*rhs->bigVal) == 0;
         case AS_FUNCTION: return false;
-        case AS_SYMBOL: return *lhs->strVal == *rhs->strVal;
+        case AS_PROMISE: return lhs == rhs;
+        case AS_PORT: return lhs->portVal == rhs->portVal;
+        case AS_VECTOR: return vectorEquals(lhs->vectorVal, rhs->vectorVal);
+        case AS_MAP: return mapEquals(lhs->mapVal, rhs->mapVal);
+        case AS_RECORD:
+            if (lhs->recordVal->type != rhs->recordVal->type)
+                return false;
+            for (int i = 0; i < lhs->recordVal->type->size; i++)
+                if (!compareObject(lhs->recordVal->slots[i], rhs->recordVal->slots[i]))
+                    return false;
+            return true;
+        case AS_STRING:
+            return lhs->textVal->length == rhs->textVal->length
+                && memcmp(lhs->textVal->data, rhs->textVal->data, lhs->textVal->length) == 0;
+        //a symbol's name is only ever made once.
+        case AS_SYMBOL: return lhs->strVal == rhs->strVal;
         case AS_BOOL: return lhs->boolVal == rhs->boolVal;
         case AS_LIST:
             {
@@ -288,18 +407,44 @@ bool compareObject(Object* lhs, Object* rhs) {
      return false;
 }
 
+//The order < and > use: numbers by value, anything else by printed form.
+//Allocates nothing the heap accounting sees, so it can run off the main thread.
+bool orderedBefore(Object* lhs, Object* rhs) {
+    if (isNumber(lhs) && isNumber(rhs))
+        return compareNumbers(lhs, rhs) < 0;
+    if (lhs->type == AS_SYMBOL && rhs->type == AS_SYMBOL)
+        return *lhs->strVal < *rhs->strVal;
+    return toString(lhs) < toString(rhs);
+}
+
+//Fields are printed with their values, in slot order.
+string recordString(Record* record) {
+    string str = "#<" + toString(record->type->name);
+    int i = 0;
+    for (Object* field : *record->type->fields)
+        str += " " + toString(field) + " " + toString(record->slots[i++]);
+    return str + ">";
+}
+
 void destroyList(List* list) {
     if (list != nullptr) {
         delete list;
     }
 }
 
-Procedure* makeFunction(Object* (EvalApply::*function)(List*)) {
+Procedure* makeFunction(Object* (EvalApply::*function)(Object**, int)) {
     Procedure* p = new Procedure;
+    heapAllocated(sizeof(Procedure));
     p->func = function;
     p->freeVars = new List();
     p->env = nullptr;
     p->type = PRIMITIVE;
+    p->calls = 0;
+    p->native = nullptr;
+    p->noJit = true;
+    p->record = nullptr;
+    p->slot = 0;
+    p->compiled = nullptr;
     return p; 
 }
 
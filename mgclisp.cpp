@@ -1,11 +1,49 @@
-#include "repl.hpp"
+#include "server.hpp"
 
-int main() {
+int main(int argc, char* argv[]) {
     // (define fib (lambda (x) (if (< x 2) 1 (+ (fib (- x 1)) (fib (- x 2))))))
     // (define fact (lambda (x) (if (eq x 0) 1 (* x (fact (- x 1))))))
     // (define print-list (\ (x) (if (eq x ()) () (do (print (car x)) (print-list (cdr x))))))
     // (define count (\ (x) (if (eq x ()) 0 (+ 1 (count (cdr x))))))
     REPL repl;
+    string socketPath;
+    int workers = 0;
+    int timeout = 30;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--image" && i+1 < argc) {
+            if (!repl.loadImage(argv[++i]))
+                return 1;
+        } else if (arg == "--load" && i+1 < argc) {
+            if (!repl.loadFile(argv[++i]))
+                return 1;
+        } else if (arg == "--load-compiled" && i+1 < argc) {
+            if (!repl.loadCompiled(argv[++i]))
+                return 1;
+        } else if (arg == "--aot" && i+3 < argc && string(argv[i+2]) == "-o") {
+            return repl.compileAot(argv[i+1], argv[i+3]) ? 0:1;
+        } else if (arg == "--serve" && i+1 < argc) {
+            socketPath = argv[++i];
+        } else if (arg == "--workers" && i+1 < argc) {
+            workers = atoi(argv[++i]);
+        } else if (arg == "--timeout" && i+1 < argc) {
+            timeout = atoi(argv[++i]);
+        } else if (arg == "--mem-limit" && i+1 < argc) {
+            repl.setMemoryLimit(atol(argv[++i]));
+        } else if (arg == "--no-jit") {
+            repl.setJit(false);
+        } else if (arg == "--parallel") {
+            repl.setParallel(true);
+        } else {
+            cout<<"usage: "<<argv[0]<<" [--image file] [--load file] [--load-compiled file.so] [--mem-limit bytes] [--no-jit] [--parallel] [--serve socket [--workers n] [--timeout seconds]]"<<endl;
+            cout<<"       "<<argv[0]<<" --aot in.lisp -o out.so"<<endl;
+            return 1;
+        }
+    }
+    if (!socketPath.empty()) {
+        Server server(repl, socketPath, workers, timeout);
+        return server.run();
+    }
     repl.start();
     return 0;
 }
\ No newline at end of file
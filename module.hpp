@@ -0,0 +1,309 @@
+#ifndef module_hpp
+#define module_hpp
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include <sys/stat.h>
+#include <dirent.h>
+#include "objects.hpp"
+#include "lex.hpp"
+#include "list.hpp"
+#include "reader.hpp"
+#include "evalapply.hpp"
+#include "image.hpp"
+using namespace std;
+
+/*
+ * Modules. (module name (exports...) body...) evaluates body in a frame of
+ * its own, under the global environment, and (import name) binds each of
+ * name's exports where it's evaluated. A module that isn't defined yet is
+ * looked for as name.lisp in each directory of $MGCLISP_PATH and then the
+ * current one. Importing one only reads it: its exports are bound to
+ * promises to load it, and the first of them to be used evaluates its
+ * body.
+ *
+ * Read and expanded module forms are cached as form images under
+ * .mgclisp-cache next to the source, named by a hash of the source, so
+ * a module that hasn't changed since it was last loaded skips the lexer
+ * and the reader. The forms as read are cached apart from the body as
+ * expanded, whose name also hashes the macros it was expanded with, so
+ * it's only used when the same macros are defined. Writing either removes
+ * the module's other images, so the cache holds one of each per module.
+ *
+ * These are EvalApply's module members; they live here because the cache
+ * needs HeapImage, which is built on EvalApply.
+ */
+
+const string moduleCacheDir = ".mgclisp-cache";
+
+uint64_t sourceHash(const string& source) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : source) {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+string hashName(uint64_t hash) {
+    char name[17];
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long)hash);
+    return name;
+}
+
+//Whether file is one of the images cached for the module called name:
+//name-<hash>.img or name-<hash>-<hash>.img.
+bool isModuleImage(const string& file, const string& name) {
+    size_t length = name.size() + 1;
+    if (file.compare(0, length, name + "-") != 0)
+        return false;
+    string rest = file.substr(length);
+    if (rest.size() != 20 && rest.size() != 37)
+        return false;
+    if (rest.compare(rest.size() - 4, 4, ".img") != 0 || (rest.size() == 37 && rest[16] != '-'))
+        return false;
+    for (size_t i = 0; i < rest.size() - 4; i++)
+        if (i != 16 && !isxdigit((unsigned char)rest[i]))
+            return false;
+    return true;
+}
+
+void EvalApply::initModulePath() {
+    const char* path = getenv("MGCLISP_PATH");
+    if (path != nullptr) {
+        stringstream dirs(path);
+        string dir;
+        while (getline(dirs, dir, ':'))
+            if (!dir.empty())
+                modulePath.push_back(dir);
+    }
+    modulePath.push_back(".");
+}
+
+//A module from the operands of a module form: its name, its export list
+//and its body.
+Module* EvalApply::makeModule(ListNode* form, string& error) {
+    if (form == nullptr || form->info->type != AS_SYMBOL || form->next == nullptr || form->next->info->type != AS_LIST) {
+        error = "module requires a name and a list of exports";
+        return nullptr;
+    }
+    for (Object* it : *form->next->info->listVal) {
+        if (it->type != AS_SYMBOL) {
+            error = "module exports must be symbols";
+            return nullptr;
+        }
+    }
+    Module* module = new Module;
+    module->name = *form->info->strVal;
+    module->exports = form->next->info->listVal;
+    module->body = new List();
+    for (ListNode* it = form->next->next; it != nullptr; it = it->next)
+        module->body->append(it->info);
+    module->env = makeEnv(new List(), globalEnv);
+    module->loaded = false;
+    module->loading = false;
+    module->expanded = false;
+    return module;
+}
+
+//The module called name, read from its source or the cache if it isn't
+//known yet. Its body isn't evaluated.
+Module* EvalApply::findModule(string name, string& error) {
+    auto known = modules.find(name);
+    if (known != modules.end())
+        return known->second;
+    string dir, source;
+    for (string& candidate : modulePath) {
+        ifstream file(candidate + "/" + name + ".lisp");
+        if (file) {
+            stringstream contents;
+            contents<<file.rdbuf();
+            source = contents.str();
+            dir = candidate;
+            break;
+        }
+    }
+    if (dir.empty()) {
+        error = "no module " + name;
+        return nullptr;
+    }
+    string cachePath = dir + "/" + moduleCacheDir + "/" + name + "-" + hashName(sourceHash(source));
+    //a cached module is (expanded? module-form).
+    List* cached = nullptr;
+    HeapImage image(*this);
+    Object* form = nullptr;
+    if (image.loadForms(cachePath + ".img", cached) && cached->size() == 2 && !isTrue(cached->first()->info)) {
+        form = shareLiterals(cached->first()->next->info);
+    } else {
+        cached = nullptr;
+        Lexer lexer;
+        auto tokens = lexer.lex(source);
+        int index = 0;
+        while (index < (int)tokens.size() && tokens[index].token != LPAREN && tokens[index].token != ERROR)
+            index++;
+        if (index < (int)tokens.size() && tokens[index].token == LPAREN)
+            form = makeListObject(parseToList(tokens, index));
+    }
+    if (form == nullptr || form->type != AS_LIST || form->listVal->empty()
+        || form->listVal->first()->info->special != SF_MODULE) {
+        error = dir + "/" + name + ".lisp does not start with a module form";
+        return nullptr;
+    }
+    Module* module = makeModule(form->listVal->first()->next, error);
+    if (module == nullptr)
+        return nullptr;
+    if (module->name != name) {
+        error = dir + "/" + name + ".lisp defines module " + module->name;
+        return nullptr;
+    }
+    module->path = dir + "/" + name + ".lisp";
+    module->cachePath = cachePath;
+    modules[name] = module;
+    if (cached == nullptr)
+        cacheModule(module, cachePath + ".img");
+    return module;
+}
+
+//Evaluates a module's body once, expanded as cached for the macros there
+//are now or else expanded in place as it goes, so afterwards the body is
+//what that cache should keep.
+Object* EvalApply::loadModule(Module* module) {
+    if (module->loaded)
+        return makeSymbolObject(module->name);
+    if (module->loading)
+        return makeErrorObject("<Error: module " + module->name + " is used while it is still loading>");
+    module->loading = true;
+    string expandedPath = module->cachePath.empty() ? "":module->cachePath + "-" + hashName(macroHash()) + ".img";
+    List* cached = nullptr;
+    HeapImage image(*this);
+    if (!expandedPath.empty() && image.loadForms(expandedPath, cached) && cached->size() == 2 && isTrue(cached->first()->info)) {
+        Object* form = shareLiterals(cached->first()->next->info);
+        if (form->type == AS_LIST && form->listVal->size() >= 3) {
+            module->body = new List();
+            for (ListNode* it = form->listVal->first()->next->next->next; it != nullptr; it = it->next)
+                module->body->append(it->info);
+            module->expanded = true;
+        }
+    }
+    for (Object*& form : *module->body) {
+        if (!module->expanded)
+            form = expand(form);
+        Object* result = eval(form, module->env);
+        if (result->type == AS_ERROR) {
+            module->loading = false;
+            return makeErrorObject("<Error: loading module " + module->name + ": " + toString(result) + ">");
+        }
+    }
+    module->loading = false;
+    module->loaded = true;
+    if (!module->expanded && !expandedPath.empty()) {
+        module->expanded = true;
+        cacheModule(module, expandedPath);
+    }
+    return makeSymbolObject(module->name);
+}
+
+//The macros defined now, each by its name, parameters and body, in any
+//order.
+uint64_t EvalApply::macroHash() {
+    uint64_t hash = 0;
+    for (auto& macro : macros)
+        hash += sourceHash(macro.first + " " + macro.second->freeVars->asString() + " " + toString(macro.second->code));
+    return hash;
+}
+
+//Writes the module form from what the module holds now to path. Failing
+//to write the cache only costs the next run a read.
+void EvalApply::cacheModule(Module* module, string path) {
+    if (module->cachePath.empty())
+        return;
+    string dir = module->cachePath.substr(0, module->cachePath.rfind('/'));
+    mkdir(dir.c_str(), 0755);
+    List* form = new List();
+    form->append(makeSymbolObject("module"));
+    form->append(makeSymbolObject(module->name));
+    form->append(makeListObject(module->exports));
+    for (Object* it : *module->body)
+        form->append(it);
+    List* cached = new List();
+    cached->append(makeBoolObject(module->expanded));
+    cached->append(makeListObject(form));
+    HeapImage image(*this);
+    if (!image.saveForms(path, cached))
+        return;
+    string sourceImage = module->cachePath.substr(dir.size() + 1) + ".img";
+    string written = path.substr(dir.size() + 1);
+    DIR* entries = opendir(dir.c_str());
+    if (entries == nullptr)
+        return;
+    while (dirent* entry = readdir(entries)) {
+        string file = entry->d_name;
+        if (file != written && file != sourceImage && isModuleImage(file, module->name))
+            remove((dir + "/" + file).c_str());
+    }
+    closedir(entries);
+}
+
+Object* EvalApply::moduleExport(Module* module, Object* symbol) {
+    if (!definesSymbol(module->env->bindings, symbol))
+        return makeErrorObject("<Error: module " + module->name + " does not define " + toString(symbol) + ">");
+    return *envFind(module->env, symbol);
+}
+
+//(module name (exports...) body...) defines a module and loads it now.
+Object* EvalApply::specialModule(ListNode* args, Env*) {
+    string error;
+    Module* module = makeModule(args, error);
+    if (module == nullptr)
+        return makeErrorObject("<Error: " + error + ">");
+    modules[module->name] = module;
+    return loadModule(module);
+}
+
+//(import name) binds name's exports here: to their values if it's loaded,
+//otherwise to promises that load it when first used.
+Object* EvalApply::specialImport(ListNode* args, Env* env) {
+    if (args->info->type != AS_SYMBOL)
+        return makeErrorObject("<Error: import requires a module name>");
+    string error;
+    Module* module = findModule(*args->info->strVal, error);
+    if (module == nullptr)
+        return makeErrorObject("<Error: " + error + ">");
+    for (Object* symbol : *module->exports) {
+        Object* value;
+        if (module->loaded) {
+            value = moduleExport(module, symbol);
+            if (value->type == AS_ERROR)
+                return value;
+        } else {
+            Object* autoloadArgs[2] = {args->info, symbol};
+            value = makePromiseObject(&EvalApply::primitiveAutoload, autoloadArgs, 2);
+        }
+        jit.invalidate(*symbol->strVal);
+        if (env->bindings != nullptr && definesSymbol(env->bindings, symbol))
+            *envFind(env, symbol) = value;
+        else
+            defineIn(env, symbol, value);
+    }
+    return args->info;
+}
+
+//(autoload module symbol) loads module if it hasn't been and returns the
+//value it exports as symbol.
+Object* EvalApply::primitiveAutoload(Object** args, int count) {
+    if (count != 2 || args[0]->type != AS_SYMBOL || args[1]->type != AS_SYMBOL)
+        return makeErrorObject("<Error: autoload requires a module name and a symbol>");
+    string error;
+    Module* module = findModule(*args[0]->strVal, error);
+    if (module == nullptr)
+        return makeErrorObject("<Error: " + error + ">");
+    Object* loaded = loadModule(module);
+    if (loaded->type == AS_ERROR)
+        return loaded;
+    return moduleExport(module, args[1]);
+}
+
+#endif
@@ -2,9 +2,14 @@
 #define lisp_objects_hpp
 #include <iostream>
 #include <cmath>
+#include <climits>
+#include <cstring>
+#include <unordered_map>
+#include "bignum.hpp"
 using namespace std;
 
 
+//Heap images store these numbers, see imageTypes.
 enum objType {
     AS_INT,
     AS_REAL,
@@ -13,22 +18,136 @@ enum objType {
     AS_BINDING,
     AS_FUNCTION,
     AS_LIST,
+    AS_BIGNUM,
+    AS_PROMISE,
+    AS_STRING,
+    AS_PORT,
+    AS_VECTOR,
+    AS_MAP,
+    AS_RECORD,
     AS_ERROR
 };
 
-inline vector<string> typeStr = { "AS_INT", "AS_REAL", "AS_SYMBOL", "AS_BOOL", "AS_BINNDING", "AS_FUNCTION", "AS_LIST", "AS_ERROR"};
+inline vector<string> typeStr = { "AS_INT", "AS_REAL", "AS_SYMBOL", "AS_BOOL", "AS_BINNDING", "AS_FUNCTION", "AS_LIST", "AS_BIGNUM", "AS_PROMISE", "AS_STRING", "AS_PORT", "AS_VECTOR", "AS_MAP", "AS_RECORD", "AS_ERROR"};
 
-enum funcType { PRIMITIVE, LAMBDA };
-const int EVAL = 0;
-const int NO_EVAL = 1;
+const int numObjTypes = AS_ERROR + 1;
+
+//Every allocation the interpreter makes is counted here, and every free
+//taken back off liveBytes. evalBase is liveBytes when a top level
+//evaluation starts, and the heap growing more than limit past it is how a
+//runaway script gets stopped before it takes the host down, while a long
+//one that frees what it's done with runs on.
+struct HeapStats {
+    long liveObjects[numObjTypes];
+    long totalObjects[numObjTypes];
+    long liveListNodes;
+    long totalListNodes;
+    long liveLists;
+    long liveBytes;
+    long peakBytes;
+    long totalBytes;
+    long evalBase;
+    long lastEvalBytes;
+    long limit;
+    bool exceeded;
+};
+
+inline HeapStats heapStats = {};
+
+void heapAllocated(long bytes) {
+    heapStats.liveBytes += bytes;
+    heapStats.totalBytes += bytes;
+    if (heapStats.liveBytes > heapStats.peakBytes)
+        heapStats.peakBytes = heapStats.liveBytes;
+    if (heapStats.limit > 0 && heapStats.liveBytes - heapStats.evalBase > heapStats.limit)
+        heapStats.exceeded = true;
+}
+
+void heapFreed(long bytes) {
+    heapStats.liveBytes -= bytes;
+}
+
+//lookup scan lengths are counted in buckets of 0, 1, 2-3, 4-7, ... and
+//everything past the last.
+const int lookupBuckets = 10;
+
+
+//Symbols naming a special form are tagged when they are created, so
+//evaluation can dispatch on the tag instead of looking the name up.
+enum specialTag {
+    SF_NONE,
+    SF_DEFINE,
+    SF_IF,
+    SF_LAMBDA,
+    SF_QUOTE,
+    SF_SET,
+    SF_DO,
+    SF_COND,
+    SF_LET,
+    SF_DEFMACRO,
+    SF_DELAY,
+    SF_STREAM_CONS,
+    SF_MODULE,
+    SF_IMPORT,
+    SF_DEFINE_RECORD,
+    SF_COUNT
+};
+
+//What the evaluator has been doing, for .stats. Each counter is a plain
+//increment on the path it counts, and nothing is done with them until
+//someone asks.
+struct EvalStats {
+    long evalSteps[numObjTypes];
+    long primitiveApplies;
+    long lambdaApplies;
+    long nativeApplies;
+    long compiledApplies;
+    long parallelCalls;
+    long vmapKernelItems;
+    long quickOps;
+    long specialForms[SF_COUNT];
+    long lookups;
+    long lookupScans[lookupBuckets];
+    long lookupScanTotal;
+    long listCopies;
+    long copiedNodes;
+};
+
+inline EvalStats evalStats = {};
+
+void countLookup(long scanned) {
+    evalStats.lookups++;
+    evalStats.lookupScanTotal += scanned;
+    int bucket = 0;
+    while (scanned > 0 && bucket < lookupBuckets - 1) {
+        scanned >>= 1;
+        bucket++;
+    }
+    evalStats.lookupScans[bucket]++;
+}
+
+//A CONTINUATION is the escape procedure call/cc hands out. The RECORD_
+//kinds are what define-record makes for a record type; an accessor reads
+//one slot. A COMPILED procedure is a lambda compiled ahead of time and
+//loaded from a shared object.
+enum funcType { PRIMITIVE, LAMBDA, CONTINUATION, RECORD_CONSTRUCTOR, RECORD_PREDICATE, RECORD_ACCESSOR, COMPILED };
 
 class EvalApply;
 class List;
 struct Binding;
+struct Env;
 struct Procedure;
+struct Promise;
+struct Text;
+class Port;
+class PersistentVector;
+class PersistentMap;
+struct JitCode;
+struct Record;
 
 struct Object {
     objType type;
+    unsigned char special;
     union {
         int    intVal;
         double realVal;
@@ -37,38 +156,194 @@ struct Object {
         List* listVal;
         Binding* bindingVal;
         Procedure* procedureVal;
+        BigInt* bigVal;
+        Promise* promiseVal;
+        Text* textVal;
+        Port* portVal;
+        PersistentVector* vectorVal;
+        PersistentMap* mapVal;
+        Record* recordVal;
     };
 };
 
+//The bytes of a file an input port read, mapped or copied, shared by the
+//port and every string sliced from them and let go of with the last one.
+struct FileData {
+    const char* data;
+    size_t size;
+    bool mapped;
+    int refs;
+};
+
+//A string's bytes, either its own or a slice of a file's.
+struct Text {
+    const char* data;
+    size_t length;
+    bool owned;
+    FileData* file;
+};
+
 struct Binding {
     Object* symbol;
     Object* value;
     Binding(Object* s = nullptr, Object* v = nullptr) : symbol(s), value(v) { }
 };
 
+//A record type's fields are its slot order, fixed when it's defined.
+struct RecordType {
+    Object* name;
+    List* fields;
+    int size;
+};
+
+struct Record {
+    RecordType* type;
+    Object** slots;
+};
+
 struct Procedure {
     funcType type;
-    List* env;
+    Env* env;
     List* freeVars;
-    Object* (EvalApply::*func)(List*);
+    Object* (EvalApply::*func)(Object**, int);
     Object* code;
+    int calls;
+    JitCode* native;
+    bool noJit;
+    RecordType* record;
+    int slot;
+    Object* (*compiled)(Object** args, int count);
 };
 
+//An environment is a chain of frames. A call's frame names its arguments
+//with proc's parameter list and reads them in place, off the argument
+//stack the caller pushed them on; defines made during the call go in
+//bindings. A frame is copied off the stack only when a closure captures
+//it. The global environment is a frame with no proc, just bindings.
+struct Env {
+    Procedure* proc;
+    Object** args;
+    List* bindings;
+    Env* parent;
+    bool captured;
+};
+
+//A value computed the first time it's forced and remembered after that.
+//Either code to evaluate in env, from delay, or a primitive to apply to
+//args, which is how the stream primitives make the rest of a stream.
+const int promiseMaxArgs = 3;
+
+struct Promise {
+    Object* code;
+    Env* env;
+    Object* (EvalApply::*func)(Object**, int);
+    Object* args[promiseMaxArgs];
+    int count;
+    Object* value;
+    bool owned; //only a stream consumer can reach it, see pullStream.
+};
+
+struct ListNode;
+
 struct SpecialForm {
     string name;
     int numArgs;
-    char flags[3];
-    Object* (EvalApply::*func)(List*, List*);
+    Object* (EvalApply::*func)(ListNode*, Env*);
+};
+
+//Call sites rewrite themselves after they first run. A site starts out
+//unseen, becomes an integer op or a direct call to the procedure it saw,
+//and drops back to a plain call when one of its guards fails too often.
+enum quickKind {
+    QK_UNSEEN,
+    QK_INT_ADD,
+    QK_INT_SUB,
+    QK_INT_MUL,
+    QK_INT_LT,
+    QK_INT_GT,
+    QK_INT_EQ,
+    QK_CALL,
+    QK_APPLY
+};
+
+//Where a symbol was found the last time: how many frames up, and then
+//which argument, which local define, or which global binding it was.
+enum slotKind { SLOT_NONE, SLOT_PARAM, SLOT_LOCAL, SLOT_GLOBAL };
+
+struct QuickSlot {
+    slotKind kind;
+    int hops;
+    int index;
+    void* guard;
+    Binding* binding;
+};
+
+struct QuickForm {
+    quickKind kind;
+    Procedure* callee;
+    int misses;
+    int size;
+    QuickSlot* slots;
 };
 
 objType getObjectType(Object* obj) {
     return obj->type;
 }
 
+specialTag specialTagFor(const string& name) {
+    if (name == "define") return SF_DEFINE;
+    if (name == "if") return SF_IF;
+    if (name == "lambda" || name == "\\") return SF_LAMBDA;
+    if (name == "'") return SF_QUOTE;
+    if (name == "set") return SF_SET;
+    if (name == "do") return SF_DO;
+    if (name == "cond") return SF_COND;
+    if (name == "let") return SF_LET;
+    if (name == "defmacro") return SF_DEFMACRO;
+    if (name == "delay") return SF_DELAY;
+    if (name == "stream-cons") return SF_STREAM_CONS;
+    if (name == "module") return SF_MODULE;
+    if (name == "import") return SF_IMPORT;
+    if (name == "define-record") return SF_DEFINE_RECORD;
+    return SF_NONE;
+}
+
+Object* allocObject(objType type) {
+    Object* obj = new Object;
+    heapStats.liveObjects[type]++;
+    heapStats.totalObjects[type]++;
+    heapAllocated(sizeof(Object));
+    obj->type = type;
+    obj->special = SF_NONE;
+    return obj;
+}
+
 Binding* makeBinding(Object* symbol, Object* value) {
+    heapAllocated(sizeof(Binding));
     return new Binding(symbol, value);
 }
 
+QuickForm* makeQuickForm(int size) {
+    QuickForm* quick = new QuickForm;
+    heapAllocated(sizeof(QuickForm) + size * sizeof(QuickSlot));
+    quick->kind = QK_UNSEEN;
+    quick->callee = nullptr;
+    quick->misses = 0;
+    quick->size = size;
+    quick->slots = new QuickSlot[size];
+    for (int i = 0; i < size; i++)
+        quick->slots[i] = {SLOT_NONE, 0, 0, nullptr, nullptr};
+    return quick;
+}
+
+void destroyQuickForm(QuickForm* quick) {
+    if (quick != nullptr) {
+        heapFreed(sizeof(QuickForm) + quick->size * sizeof(QuickSlot));
+        delete [] quick->slots;
+        delete quick;
+    }
+}
+
 void destroyObject(Object* obj);
 
 void destoryBinding(Binding* binding) {
@@ -78,79 +353,251 @@ void destoryBinding(Binding* binding) {
     }
 }
 
-Procedure* allocFunction(List* vars, Object* code, List* penv, funcType type) {
+Env* makeEnv(List* bindings, Env* parent) {
+    Env* env = new Env;
+    heapAllocated(sizeof(Env));
+    env->proc = nullptr;
+    env->args = nullptr;
+    env->bindings = bindings;
+    env->parent = parent;
+    env->captured = true;
+    return env;
+}
+
+Procedure* allocFunction(List* vars, Object* code, Env* penv, funcType type) {
     Procedure* p = new Procedure;
+    heapAllocated(sizeof(Procedure));
     p->code = code;
     p->env = penv;
     p->type = type;
     p->freeVars = vars;
+    p->calls = 0;
+    p->native = nullptr;
+    p->noJit = false;
+    p->record = nullptr;
+    p->slot = 0;
+    p->compiled = nullptr;
     return p;
 }
 
+//Objects are never changed once made, so the common ones can be shared:
+//small ints and the booleans are made once each, and every symbol with a
+//given name is the same object, which makes comparing symbols a pointer
+//comparison.
+const int sharedIntMin = -128;
+const int sharedIntMax = 1023;
+inline Object* sharedInts[sharedIntMax - sharedIntMin + 1];
+inline Object* sharedBools[2];
+inline unordered_map<string, Object*> symbolTable;
+
 Object* makeIntObject(int value) {
-    Object* obj = new Object;
-    obj->type = AS_INT;
+    bool shared = value >= sharedIntMin && value <= sharedIntMax;
+    if (shared && sharedInts[value - sharedIntMin] != nullptr)
+        return sharedInts[value - sharedIntMin];
+    Object* obj = allocObject(AS_INT);
     obj->intVal = value;
+    if (shared)
+        sharedInts[value - sharedIntMin] = obj;
+    return obj;
+}
+
+Object* makeBignumObject(const BigInt& value) {
+    Object* obj = allocObject(AS_BIGNUM);
+    obj->bigVal = new BigInt(value);
+    heapAllocated(sizeof(BigInt) + value.limbs.size() * sizeof(uint32_t));
+    return obj;
+}
+
+//Exact integers are ints whenever they fit and bignums only when they don't.
+Object* makeIntegerObject(const BigInt& value) {
+    if (value.fitsInt())
+        return makeIntObject(value.toInt());
+    return makeBignumObject(value);
+}
+
+Object* makeIntegerObject(long value) {
+    if (value >= INT_MIN && value <= INT_MAX)
+        return makeIntObject(value);
+    return makeBignumObject(BigInt(value));
+}
+
+//An integer literal too big for an int is read as a bignum.
+Object* makeIntegerObject(const string& digits) {
+    BigInt value;
+    if (!BigInt::fromString(digits, value))
+        return makeIntObject(atoi(digits.c_str()));
+    return makeIntegerObject(value);
+}
+
+Object* makePromiseObject(Object* code, Env* env) {
+    Object* obj = allocObject(AS_PROMISE);
+    obj->promiseVal = new Promise;
+    heapAllocated(sizeof(Promise));
+    obj->promiseVal->code = code;
+    obj->promiseVal->env = env;
+    obj->promiseVal->func = nullptr;
+    obj->promiseVal->count = 0;
+    obj->promiseVal->value = nullptr;
+    obj->promiseVal->owned = false;
+    return obj;
+}
+
+Object* makePromiseObject(Object* (EvalApply::*func)(Object**, int), Object** args, int count) {
+    Object* obj = makePromiseObject(nullptr, nullptr);
+    obj->promiseVal->func = func;
+    obj->promiseVal->count = count;
+    for (int i = 0; i < count; i++)
+        obj->promiseVal->args[i] = args[i];
     return obj;
 }
 
 Object* makeRealObject(double val) {
-    Object* obj = new Object;
-    if (fmod(val, 1) == 0) {
-        obj->type = AS_INT;
-        obj->intVal = val;
-    } else {
-        obj->type = AS_REAL;
-        obj->realVal = val;
-    }
+    if (fmod(val, 1) == 0 && val >= INT_MIN && val <= INT_MAX)
+        return makeIntObject(val);
+    Object* obj = allocObject(AS_REAL);
+    obj->realVal = val;
     return obj;
 }
 
 Object* makeBoolObject(bool value) {
-    Object* obj = new Object;
-    obj->type = AS_BOOL;
+    if (sharedBools[value] != nullptr)
+        return sharedBools[value];
+    Object* obj = allocObject(AS_BOOL);
     obj->boolVal = value;
+    sharedBools[value] = obj;
     return obj;
 }
 
 Object* makeSymbolObject(string value) {
-    Object* obj = new Object;
     if (value == "true" || value == "false")
         return makeBoolObject(value == "true");
-    obj->type = AS_SYMBOL;
+    auto it = symbolTable.find(value);
+    if (it != symbolTable.end())
+        return it->second;
+    Object* obj = allocObject(AS_SYMBOL);
+    obj->special = specialTagFor(value);
     obj->strVal = new string(value);
+    heapAllocated(sizeof(string) + value.size());
+    symbolTable[value] = obj;
     return obj;
 }
 
 Object* makeListObject(List* value) {
-    Object* obj = new Object;
-    obj->type = AS_LIST;
+    Object* obj = allocObject(AS_LIST);
     obj->listVal = value;
     return obj;
 }
 
 Object* makeFunctionObject(Procedure* proc) {
-    Object* obj = new Object;
-    obj->type = AS_FUNCTION;
+    Object* obj = allocObject(AS_FUNCTION);
     obj->procedureVal = proc;
     return obj;
 }
 
 Object* makeBindingObject(Binding* value) {
-    Object* obj = new Object;
-    obj->type = AS_BINDING;
+    Object* obj = allocObject(AS_BINDING);
     obj->bindingVal = value;
     return obj;
 }
 
+Object* makeStringObject(const string& value) {
+    Object* obj = allocObject(AS_STRING);
+    char* data = new char[value.size()];
+    memcpy(data, value.data(), value.size());
+    obj->textVal = new Text{data, value.size(), true, nullptr};
+    heapAllocated(sizeof(Text) + value.size());
+    return obj;
+}
+
+//A string over length bytes at data, in file, which it keeps.
+Object* makeStringObject(const char* data, size_t length, FileData* file) {
+    Object* obj = allocObject(AS_STRING);
+    obj->textVal = new Text{data, length, false, file};
+    file->refs++;
+    heapAllocated(sizeof(Text));
+    return obj;
+}
+
+Object* makePortObject(Port* port) {
+    Object* obj = allocObject(AS_PORT);
+    obj->portVal = port;
+    return obj;
+}
+
+Object* makeVectorObject(PersistentVector* vec) {
+    Object* obj = allocObject(AS_VECTOR);
+    obj->vectorVal = vec;
+    return obj;
+}
+
+Object* makeMapObject(PersistentMap* map) {
+    Object* obj = allocObject(AS_MAP);
+    obj->mapVal = map;
+    return obj;
+}
+
+RecordType* makeRecordType(Object* name, List* fields, int size) {
+    heapAllocated(sizeof(RecordType));
+    return new RecordType{name, fields, size};
+}
+
+//A record of type with its slots taken from values, in field order.
+Record* makeRecord(RecordType* type, Object** values) {
+    Object** slots = new Object*[type->size];
+    memcpy(slots, values, type->size * sizeof(Object*));
+    heapAllocated(sizeof(Record) + type->size * sizeof(Object*));
+    return new Record{type, slots};
+}
+
+Object* makeRecordObject(RecordType* type, Object** values) {
+    Object* obj = allocObject(AS_RECORD);
+    obj->recordVal = makeRecord(type, values);
+    return obj;
+}
+
 Object* makeErrorObject(string error) {
-    Object* obj = new Object;
-    obj->type = AS_ERROR;
+    Object* obj = allocObject(AS_ERROR);
     obj->strVal = new string(error);
+    heapAllocated(sizeof(string) + error.size());
     return obj;
 }
 
+bool isNumber(Object* obj) {
+    return obj->type == AS_INT || obj->type == AS_REAL || obj->type == AS_BIGNUM;
+}
+
+bool isExactInteger(Object* obj) {
+    return obj->type == AS_INT || obj->type == AS_BIGNUM;
+}
+
+double numberValue(Object* obj) {
+    switch (obj->type) {
+        case AS_INT: return obj->intVal;
+        case AS_REAL: return obj->realVal;
+        case AS_BIGNUM: return obj->bigVal->toDouble();
+        default:
+            break;
+    }
+    return 0;
+}
+
+BigInt bigValue(Object* obj) {
+    return obj->type == AS_BIGNUM ? *obj->bigVal:BigInt(obj->intVal);
+}
+
+//exact when both are integers, otherwise compared as doubles.
+int compareNumbers(Object* lhs, Object* rhs) {
+    if (lhs->type == AS_INT && rhs->type == AS_INT)
+        return lhs->intVal < rhs->intVal ? -1:(lhs->intVal > rhs->intVal);
+    if (isExactInteger(lhs) && isExactInteger(rhs))
+        return bigValue(lhs).compare(bigValue(rhs));
+    double l = numberValue(lhs), r = numberValue(rhs);
+    return l < r ? -1:(l > r);
+}
+
 void destroyList(List* list);
+void releaseFileData(FileData* file);
+void destroyPort(Port* port);
 void destroyObject(Object* obj) {
     if (obj == nullptr)
         return;
@@ -159,22 +606,47 @@ void destroyObject(Object* obj) {
             destoryBinding(obj->bindingVal);
             break;
         case AS_FUNCTION: 
-            if (obj->procedureVal != nullptr)
+            if (obj->procedureVal != nullptr) {
+                heapFreed(sizeof(Procedure));
                 delete obj->procedureVal;
+            }
             break;
         case AS_LIST:     
             destroyList(obj->listVal);
             break;
+        case AS_BIGNUM:
+            heapFreed(sizeof(BigInt) + obj->bigVal->limbs.size() * sizeof(uint32_t));
+            delete obj->bigVal;
+            break;
+        case AS_PROMISE:
+            heapFreed(sizeof(Promise));
+            delete obj->promiseVal;
+            break;
+        case AS_STRING:
+            heapFreed(sizeof(Text) + (obj->textVal->owned ? obj->textVal->length:0));
+            if (obj->textVal->owned)
+                delete[] obj->textVal->data;
+            if (obj->textVal->file != nullptr)
+                releaseFileData(obj->textVal->file);
+            delete obj->textVal;
+            break;
+        case AS_PORT:
+            destroyPort(obj->portVal);
+            break;
         case AS_ERROR:
         case AS_SYMBOL:   
-            if (obj->strVal != nullptr)
+            if (obj->strVal != nullptr) {
+                heapFreed(sizeof(string) + obj->strVal->size());
                 delete obj->strVal;
+            }
         case AS_INT: 
         case AS_REAL: 
         case AS_BOOL: 
         default:
             break;
     }
+    heapStats.liveObjects[obj->type]--;
+    heapFreed(sizeof(Object));
     delete obj;
 }
 
@@ -0,0 +1,589 @@
+#ifndef persistent_hpp
+#define persistent_hpp
+#include <iostream>
+#include <vector>
+#include <functional>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include "objects.hpp"
+#include "list.hpp"
+using namespace std;
+
+/*
+ * Persistent vectors and hash maps. Both are tries of 32 way nodes, and an
+ * update copies only the path from the root to what changed, sharing the
+ * rest with the version it came from, so it costs O(log32 n) instead of a
+ * copy of the whole thing.
+ *
+ * A transient is a version that may be updated in place: every node it
+ * copies is stamped with its edit token, and later updates through the
+ * same transient change those nodes directly. Bulk building goes through
+ * a transient so it doesn't copy a path per element. Making it persistent
+ * again gives the transient a new token, so nothing shared is ever
+ * changed after that.
+ */
+
+const int trieBits = 5;
+const int trieWidth = 1 << trieBits;
+const uint32_t trieMask = trieWidth - 1;
+const int hashBits = 32;
+
+typedef char* EditToken;
+
+EditToken newEditToken() {
+    heapAllocated(1);
+    return new char;
+}
+
+//Consistent with compareObject: objects it calls equal hash the same.
+uint32_t hashObject(Object* obj);
+
+struct TrieNode {
+    EditToken edit;
+    void* slots[trieWidth];
+};
+
+TrieNode* allocTrieNode(EditToken edit) {
+    heapAllocated(sizeof(TrieNode));
+    TrieNode* node = new TrieNode;
+    node->edit = edit;
+    memset(node->slots, 0, sizeof(node->slots));
+    return node;
+}
+
+//node itself if edit owns it, otherwise a copy edit does own.
+TrieNode* editableNode(TrieNode* node, EditToken edit) {
+    if (edit != nullptr && node->edit == edit)
+        return node;
+    TrieNode* copy = allocTrieNode(edit);
+    memcpy(copy->slots, node->slots, sizeof(copy->slots));
+    return copy;
+}
+
+/*
+ * A vector keeps its last (up to 32) items in a tail node outside the
+ * trie, so appending usually touches only the tail. shift is the number
+ * of index bits below the root.
+ */
+class PersistentVector {
+    private:
+        int count;
+        int shift;
+        TrieNode* root;
+        TrieNode* tail;
+        EditToken edit;
+        int tailOffset();
+        TrieNode* leafFor(int i);
+        TrieNode* pushTail(int level, TrieNode* parent, TrieNode* tailNode);
+        TrieNode* newPath(int level, TrieNode* node);
+        TrieNode* assocIn(int level, TrieNode* node, int i, Object* value);
+        PersistentVector* updatable();
+    public:
+        PersistentVector();
+        int size();
+        bool isTransient();
+        Object* nth(int i);
+        PersistentVector* conj(Object* value);
+        PersistentVector* assoc(int i, Object* value);
+        PersistentVector* asTransient();
+        PersistentVector* asPersistent();
+        void forEach(const function<void(Object*)>& visit);
+};
+
+PersistentVector::PersistentVector() {
+    heapAllocated(sizeof(PersistentVector));
+    count = 0;
+    shift = trieBits;
+    root = allocTrieNode(nullptr);
+    tail = allocTrieNode(nullptr);
+    edit = nullptr;
+}
+
+int PersistentVector::size() {
+    return count;
+}
+
+bool PersistentVector::isTransient() {
+    return edit != nullptr;
+}
+
+int PersistentVector::tailOffset() {
+    return count < trieWidth ? 0:((count - 1) >> trieBits) << trieBits;
+}
+
+TrieNode* PersistentVector::leafFor(int i) {
+    if (i >= tailOffset())
+        return tail;
+    TrieNode* node = root;
+    for (int level = shift; level > 0; level -= trieBits)
+        node = (TrieNode*)node->slots[(i >> level) & trieMask];
+    return node;
+}
+
+Object* PersistentVector::nth(int i) {
+    return (Object*)leafFor(i)->slots[i & trieMask];
+}
+
+//A transient is changed in place; anything else is copied first.
+PersistentVector* PersistentVector::updatable() {
+    if (edit != nullptr)
+        return this;
+    heapAllocated(sizeof(PersistentVector));
+    return new PersistentVector(*this);
+}
+
+TrieNode* PersistentVector::newPath(int level, TrieNode* node) {
+    if (level == 0)
+        return node;
+    TrieNode* path = allocTrieNode(edit);
+    path->slots[0] = newPath(level - trieBits, node);
+    return path;
+}
+
+//Hangs a full tail off the trie; count is still the size before the append.
+TrieNode* PersistentVector::pushTail(int level, TrieNode* parent, TrieNode* tailNode) {
+    int sub = ((count - 1) >> level) & trieMask;
+    TrieNode* result = editableNode(parent, edit);
+    if (level == trieBits) {
+        result->slots[sub] = tailNode;
+    } else {
+        TrieNode* child = (TrieNode*)parent->slots[sub];
+        result->slots[sub] = child != nullptr ? pushTail(level - trieBits, child, tailNode):newPath(level - trieBits, tailNode);
+    }
+    return result;
+}
+
+PersistentVector* PersistentVector::conj(Object* value) {
+    PersistentVector* result = updatable();
+    if (count - tailOffset() < trieWidth) {
+        result->tail = editableNode(tail, edit);
+        result->tail->slots[count - tailOffset()] = value;
+        result->count++;
+        return result;
+    }
+    if ((count >> trieBits) > (1 << shift)) {
+        TrieNode* newRoot = allocTrieNode(edit);
+        newRoot->slots[0] = root;
+        newRoot->slots[1] = newPath(shift, tail);
+        result->root = newRoot;
+        result->shift += trieBits;
+    } else {
+        result->root = pushTail(shift, root, tail);
+    }
+    result->tail = allocTrieNode(edit);
+    result->tail->slots[0] = value;
+    result->count++;
+    return result;
+}
+
+TrieNode* PersistentVector::assocIn(int level, TrieNode* node, int i, Object* value) {
+    TrieNode* result = editableNode(node, edit);
+    if (level == 0)
+        result->slots[i & trieMask] = value;
+    else
+        result->slots[(i >> level) & trieMask] = assocIn(level - trieBits, (TrieNode*)node->slots[(i >> level) & trieMask], i, value);
+    return result;
+}
+
+//i may be one past the end, which appends.
+PersistentVector* PersistentVector::assoc(int i, Object* value) {
+    if (i == count)
+        return conj(value);
+    PersistentVector* result = updatable();
+    if (i >= tailOffset()) {
+        result->tail = editableNode(tail, edit);
+        result->tail->slots[i & trieMask] = value;
+    } else {
+        result->root = assocIn(shift, root, i, value);
+    }
+    return result;
+}
+
+PersistentVector* PersistentVector::asTransient() {
+    heapAllocated(sizeof(PersistentVector));
+    PersistentVector* result = new PersistentVector(*this);
+    result->edit = newEditToken();
+    return result;
+}
+
+PersistentVector* PersistentVector::asPersistent() {
+    heapAllocated(sizeof(PersistentVector));
+    PersistentVector* result = new PersistentVector(*this);
+    result->edit = nullptr;
+    if (edit != nullptr)
+        edit = newEditToken();
+    return result;
+}
+
+void PersistentVector::forEach(const function<void(Object*)>& visit) {
+    for (int i = 0; i < count; i++)
+        visit(nth(i));
+}
+
+/*
+ * A map node has a bit for each of the 32 values the next five bits of a
+ * hash can take, and an entry for each bit set: a key and its value, or
+ * (with no key) the node for the keys that share those bits. Once the
+ * hash bits run out, keys that still collide go in a plain list.
+ */
+struct MapEntry {
+    Object* key;
+    void* value;
+};
+
+struct MapNode {
+    EditToken edit;
+    uint32_t bitmap;
+    bool collision;
+    int size;
+    int capacity;
+    MapEntry* entries;
+};
+
+class PersistentMap {
+    private:
+        int count;
+        MapNode* root;
+        EditToken edit;
+        MapNode* allocNode(int shift, int capacity);
+        MapNode* editable(MapNode* node, int capacity);
+        MapNode* insertEntry(MapNode* node, int index, Object* key, void* value);
+        MapNode* removeEntry(MapNode* node, int index);
+        MapNode* pairNode(int shift, uint32_t h1, Object* k1, void* v1, uint32_t h2, Object* k2, void* v2);
+        int entryIndex(MapNode* node, uint32_t hash, int shift, Object* key);
+        MapNode* assocIn(MapNode* node, int shift, uint32_t hash, Object* key, Object* value, bool& added);
+        MapNode* withoutIn(MapNode* node, int shift, uint32_t hash, Object* key, bool& removed);
+        void forEachIn(MapNode* node, const function<void(Object*, Object*)>& visit);
+        PersistentMap* updatable();
+    public:
+        PersistentMap();
+        int size();
+        bool isTransient();
+        Object* get(Object* key);
+        PersistentMap* assoc(Object* key, Object* value);
+        PersistentMap* without(Object* key);
+        PersistentMap* asTransient();
+        PersistentMap* asPersistent();
+        void forEach(const function<void(Object*, Object*)>& visit);
+};
+
+PersistentMap::PersistentMap() {
+    heapAllocated(sizeof(PersistentMap));
+    count = 0;
+    edit = nullptr;
+    root = allocNode(0, 0);
+}
+
+int PersistentMap::size() {
+    return count;
+}
+
+bool PersistentMap::isTransient() {
+    return edit != nullptr;
+}
+
+MapNode* PersistentMap::allocNode(int shift, int capacity) {
+    heapAllocated(sizeof(MapNode) + capacity * sizeof(MapEntry));
+    MapNode* node = new MapNode;
+    node->edit = edit;
+    node->bitmap = 0;
+    node->collision = shift >= hashBits;
+    node->size = 0;
+    node->capacity = capacity;
+    node->entries = capacity > 0 ? new MapEntry[capacity]:nullptr;
+    return node;
+}
+
+//node if it's ours to change and has room for capacity entries, otherwise
+//a copy that is. A transient's copies get room to grow.
+MapNode* PersistentMap::editable(MapNode* node, int capacity) {
+    if (edit != nullptr && node->edit == edit && node->capacity >= capacity)
+        return node;
+    if (edit != nullptr && capacity > node->size)
+        capacity = max(capacity, min(2 * node->size, trieWidth));
+    heapAllocated(sizeof(MapNode) + capacity * sizeof(MapEntry));
+    MapNode* copy = new MapNode(*node);
+    copy->edit = edit;
+    copy->capacity = capacity;
+    copy->entries = new MapEntry[capacity];
+    memcpy(copy->entries, node->entries, node->size * sizeof(MapEntry));
+    return copy;
+}
+
+MapNode* PersistentMap::insertEntry(MapNode* node, int index, Object* key, void* value) {
+    MapNode* result = editable(node, node->size + 1);
+    memmove(result->entries + index + 1, result->entries + index, (result->size - index) * sizeof(MapEntry));
+    result->entries[index] = {key, value};
+    result->size++;
+    return result;
+}
+
+MapNode* PersistentMap::removeEntry(MapNode* node, int index) {
+    MapNode* result = editable(node, node->size);
+    memmove(result->entries + index, result->entries + index + 1, (result->size - index - 1) * sizeof(MapEntry));
+    result->size--;
+    return result;
+}
+
+//A node for two keys that agreed on every hash bit before shift.
+MapNode* PersistentMap::pairNode(int shift, uint32_t h1, Object* k1, void* v1, uint32_t h2, Object* k2, void* v2) {
+    MapNode* node = allocNode(shift, 2);
+    if (node->collision) {
+        node->entries[0] = {k1, v1};
+        node->entries[1] = {k2, v2};
+        node->size = 2;
+        return node;
+    }
+    uint32_t b1 = (h1 >> shift) & trieMask, b2 = (h2 >> shift) & trieMask;
+    node->bitmap = (1u << b1) | (1u << b2);
+    if (b1 == b2) {
+        node->entries[0] = {nullptr, pairNode(shift + trieBits, h1, k1, v1, h2, k2, v2)};
+        node->size = 1;
+    } else {
+        node->entries[b1 < b2 ? 0:1] = {k1, v1};
+        node->entries[b1 < b2 ? 1:0] = {k2, v2};
+        node->size = 2;
+    }
+    return node;
+}
+
+//Where key's entry is, or would go, in node.
+int PersistentMap::entryIndex(MapNode* node, uint32_t hash, int shift, Object* key) {
+    if (node->collision) {
+        for (int i = 0; i < node->size; i++)
+            if (compareObject(key, node->entries[i].key))
+                return i;
+        return node->size;
+    }
+    uint32_t bit = 1u << ((hash >> shift) & trieMask);
+    return __builtin_popcount(node->bitmap & (bit - 1));
+}
+
+Object* PersistentMap::get(Object* key) {
+    uint32_t hash = hashObject(key);
+    MapNode* node = root;
+    for (int shift = 0; ; shift += trieBits) {
+        int i = entryIndex(node, hash, shift, key);
+        if (node->collision)
+            return i < node->size ? (Object*)node->entries[i].value:nullptr;
+        if (!(node->bitmap & (1u << ((hash >> shift) & trieMask))))
+            return nullptr;
+        MapEntry& entry = node->entries[i];
+        if (entry.key != nullptr)
+            return compareObject(key, entry.key) ? (Object*)entry.value:nullptr;
+        node = (MapNode*)entry.value;
+    }
+}
+
+MapNode* PersistentMap::assocIn(MapNode* node, int shift, uint32_t hash, Object* key, Object* value, bool& added) {
+    int i = entryIndex(node, hash, shift, key);
+    if (node->collision) {
+        if (i < node->size) {
+            MapNode* result = editable(node, node->size);
+            result->entries[i].value = value;
+            return result;
+        }
+        added = true;
+        return insertEntry(node, i, key, value);
+    }
+    uint32_t bit = 1u << ((hash >> shift) & trieMask);
+    if (!(node->bitmap & bit)) {
+        added = true;
+        MapNode* result = insertEntry(node, i, key, value);
+        result->bitmap |= bit;
+        return result;
+    }
+    MapEntry entry = node->entries[i];
+    MapNode* child;
+    if (entry.key == nullptr) {
+        child = assocIn((MapNode*)entry.value, shift + trieBits, hash, key, value, added);
+        if (child == entry.value)
+            return node;
+    } else if (compareObject(key, entry.key)) {
+        if (entry.value == value)
+            return node;
+        MapNode* result = editable(node, node->size);
+        result->entries[i].value = value;
+        return result;
+    } else {
+        //two keys share these bits, so they move down a level together.
+        added = true;
+        child = pairNode(shift + trieBits, hashObject(entry.key), entry.key, entry.value, hash, key, value);
+    }
+    MapNode* result = editable(node, node->size);
+    result->entries[i] = {nullptr, child};
+    return result;
+}
+
+//node without key; null if that leaves it empty.
+MapNode* PersistentMap::withoutIn(MapNode* node, int shift, uint32_t hash, Object* key, bool& removed) {
+    int i = entryIndex(node, hash, shift, key);
+    if (node->collision) {
+        if (i == node->size)
+            return node;
+        removed = true;
+        return node->size == 1 ? nullptr:removeEntry(node, i);
+    }
+    uint32_t bit = 1u << ((hash >> shift) & trieMask);
+    if (!(node->bitmap & bit))
+        return node;
+    MapEntry entry = node->entries[i];
+    if (entry.key == nullptr) {
+        MapNode* child = withoutIn((MapNode*)entry.value, shift + trieBits, hash, key, removed);
+        if (child == entry.value)
+            return node;
+        if (child != nullptr) {
+            MapNode* result = editable(node, node->size);
+            result->entries[i].value = child;
+            return result;
+        }
+    } else if (!compareObject(key, entry.key)) {
+        return node;
+    }
+    removed = true;
+    if (node->size == 1)
+        return nullptr;
+    MapNode* result = removeEntry(node, i);
+    result->bitmap &= ~bit;
+    return result;
+}
+
+PersistentMap* PersistentMap::updatable() {
+    if (edit != nullptr)
+        return this;
+    heapAllocated(sizeof(PersistentMap));
+    return new PersistentMap(*this);
+}
+
+PersistentMap* PersistentMap::assoc(Object* key, Object* value) {
+    bool added = false;
+    MapNode* newRoot = assocIn(root, 0, hashObject(key), key, value, added);
+    if (newRoot == root && edit == nullptr)
+        return this;
+    PersistentMap* result = updatable();
+    result->root = newRoot;
+    result->count += added;
+    return result;
+}
+
+PersistentMap* PersistentMap::without(Object* key) {
+    bool removed = false;
+    MapNode* newRoot = withoutIn(root, 0, hashObject(key), key, removed);
+    if (!removed)
+        return this;
+    PersistentMap* result = updatable();
+    result->root = newRoot != nullptr ? newRoot:allocNode(0, 0);
+    result->count--;
+    return result;
+}
+
+PersistentMap* PersistentMap::asTransient() {
+    heapAllocated(sizeof(PersistentMap));
+    PersistentMap* result = new PersistentMap(*this);
+    result->edit = newEditToken();
+    return result;
+}
+
+PersistentMap* PersistentMap::asPersistent() {
+    heapAllocated(sizeof(PersistentMap));
+    PersistentMap* result = new PersistentMap(*this);
+    result->edit = nullptr;
+    if (edit != nullptr)
+        edit = newEditToken();
+    return result;
+}
+
+void PersistentMap::forEachIn(MapNode* node, const function<void(Object*, Object*)>& visit) {
+    for (int i = 0; i < node->size; i++) {
+        if (node->entries[i].key == nullptr)
+            forEachIn((MapNode*)node->entries[i].value, visit);
+        else
+            visit(node->entries[i].key, (Object*)node->entries[i].value);
+    }
+}
+
+void PersistentMap::forEach(const function<void(Object*, Object*)>& visit) {
+    forEachIn(root, visit);
+}
+
+uint32_t mixHash(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+uint32_t hashObject(Object* obj) {
+    switch (obj->type) {
+        case AS_INT: return mixHash(obj->intVal);
+        case AS_REAL: return mixHash(hash<double>()(obj->realVal));
+        case AS_BOOL: return obj->boolVal;
+        case AS_BIGNUM: return mixHash(hash<string>()(obj->bigVal->toString()));
+        case AS_SYMBOL:
+        case AS_ERROR: return mixHash(hash<string>()(*obj->strVal));
+        case AS_STRING: return mixHash(hash<string_view>()(string_view(obj->textVal->data, obj->textVal->length)));
+        case AS_PORT: return mixHash((uintptr_t)obj->portVal);
+        case AS_LIST: {
+            uint64_t h = 17;
+            for (Object* it : *obj->listVal)
+                h = h * 31 + hashObject(it);
+            return mixHash(h);
+        }
+        case AS_VECTOR: {
+            uint64_t h = 19;
+            obj->vectorVal->forEach([&](Object* it) { h = h * 31 + hashObject(it); });
+            return mixHash(h);
+        }
+        case AS_MAP: {
+            //independent of the order entries are visited in.
+            uint64_t h = 23;
+            obj->mapVal->forEach([&](Object* key, Object* value) { h += mixHash(hashObject(key) * 31ULL + hashObject(value)); });
+            return mixHash(h);
+        }
+        case AS_RECORD: {
+            uint64_t h = (uintptr_t)obj->recordVal->type;
+            for (int i = 0; i < obj->recordVal->type->size; i++)
+                h = h * 31 + hashObject(obj->recordVal->slots[i]);
+            return mixHash(h);
+        }
+        default:
+            break;
+    }
+    return mixHash((uintptr_t)obj);
+}
+
+bool vectorEquals(PersistentVector* lhs, PersistentVector* rhs) {
+    if (lhs->size() != rhs->size())
+        return false;
+    for (int i = 0; i < lhs->size(); i++)
+        if (!compareObject(lhs->nth(i), rhs->nth(i)))
+            return false;
+    return true;
+}
+
+bool mapEquals(PersistentMap* lhs, PersistentMap* rhs) {
+    if (lhs->size() != rhs->size())
+        return false;
+    bool equal = true;
+    lhs->forEach([&](Object* key, Object* value) {
+        Object* other = rhs->get(key);
+        if (equal && (other == nullptr || !compareObject(value, other)))
+            equal = false;
+    });
+    return equal;
+}
+
+string vectorString(PersistentVector* vec) {
+    string str = "[ ";
+    vec->forEach([&](Object* it) { str += toString(it) + " "; });
+    return str + "]";
+}
+
+string mapString(PersistentMap* map) {
+    string str = "{ ";
+    map->forEach([&](Object* key, Object* value) { str += toString(key) + " " + toString(value) + " "; });
+    return str + "}";
+}
+
+#endif
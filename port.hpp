@@ -0,0 +1,346 @@
+#ifndef port_hpp
+#define port_hpp
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "objects.hpp"
+#include "list.hpp"
+using namespace std;
+
+//bytes an output port holds before writing them out.
+const size_t portBufferSize = 1 << 16;
+
+//files smaller than this are read into memory rather than mapped.
+const size_t portMapMinBytes = 1 << 16;
+
+/*
+ * An input port reads a file through a read only mapping of it, so reading
+ * is just moving a cursor, and lines and whole files are handed out as
+ * slices of the mapping instead of copies. A slice may outlive its port,
+ * so the mapping is counted by the port and each slice, and unmapped when
+ * the last of them goes. Small files, and files that can't be mapped like
+ * pipes, are read into memory whole instead, and counted the same way.
+ *
+ * An output port collects what's written to it in a buffer and writes it
+ * to its file a buffer at a time, or when flushed. A string port has no
+ * file and keeps everything.
+ */
+
+class Port {
+    private:
+        string name;
+        FileData* file;
+        const char* data;
+        size_t size;
+        size_t pos;
+        bool open;
+        bool output;
+        int fd;
+        string out;
+        static bool readAll(int fd, const char*& data, size_t& size);
+    public:
+        Port(string name, FileData* file);
+        Port(string name, int fd);
+        ~Port();
+        static Port* openInput(string path, string& error);
+        static Port* openOutput(string path, string& error);
+        bool isOutput();
+        string getName();
+        bool isOpen();
+        void close();
+        bool readLine(const char*& line, size_t& length);
+        bool readLine(size_t& at, const char*& line, size_t& length);
+        size_t lineEnd(const char* line, size_t length);
+        size_t skipToEnd();
+        bool nextDatum(const char*& start, size_t& length);
+        const char* contents();
+        size_t length();
+        FileData* source();
+        void write(const char* bytes, size_t count);
+        void write(const string& str);
+        void print(Object* obj);
+        bool flush();
+        string& written();
+};
+
+FileData* makeFileData(const char* data, size_t size, bool mapped) {
+    return new FileData{data, size, mapped, 0};
+}
+
+void releaseFileData(FileData* file) {
+    if (--file->refs > 0)
+        return;
+    if (file->mapped)
+        munmap((void*)file->data, file->size);
+    else
+        delete[] file->data;
+    delete file;
+}
+
+//An input port reading file, or a closed port if file is null.
+Port::Port(string name, FileData* file) {
+    this->name = name;
+    this->file = file;
+    data = file == nullptr ? nullptr:file->data;
+    size = file == nullptr ? 0:file->size;
+    if (file != nullptr)
+        file->refs++;
+    pos = 0;
+    open = true;
+    output = false;
+    fd = -1;
+}
+
+//An output port writing to fd, or a string port if fd is -1.
+Port::Port(string name, int fd) : Port(name, nullptr) {
+    this->fd = fd;
+    output = true;
+    out.reserve(fd < 0 ? 0:portBufferSize);
+}
+
+Port::~Port() {
+    close();
+}
+
+void destroyPort(Port* port) {
+    delete port;
+}
+
+bool Port::readAll(int fd, const char*& data, size_t& size) {
+    string buffer;
+    char chunk[65536];
+    ssize_t n;
+    while ((n = read(fd, chunk, sizeof(chunk))) > 0)
+        buffer.append(chunk, n);
+    if (n < 0)
+        return false;
+    char* copy = new char[buffer.size()];
+    memcpy(copy, buffer.data(), buffer.size());
+    data = copy;
+    size = buffer.size();
+    return true;
+}
+
+Port* Port::openInput(string path, string& error) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        error = "could not open " + path;
+        return nullptr;
+    }
+    struct stat st;
+    const char* data = nullptr;
+    size_t size = 0;
+    bool mapped = false;
+    bool ok = fstat(fd, &st) == 0;
+    if (ok && S_ISREG(st.st_mode) && (size_t)st.st_size >= portMapMinBytes) {
+        size = st.st_size;
+        void* base = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ok = base != MAP_FAILED;
+        if (ok) {
+            madvise(base, size, MADV_SEQUENTIAL);
+            data = (const char*)base;
+            mapped = true;
+        }
+    } else if (ok) {
+        ok = readAll(fd, data, size);
+    }
+    ::close(fd);
+    if (!ok) {
+        error = "could not read " + path;
+        return nullptr;
+    }
+    return new Port(path, makeFileData(data, size, mapped));
+}
+
+Port* Port::openOutput(string path, string& error) {
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        error = "could not open " + path + " for writing";
+        return nullptr;
+    }
+    return new Port(path, fd);
+}
+
+bool Port::isOutput() {
+    return output;
+}
+
+string Port::getName() {
+    return name;
+}
+
+bool Port::isOpen() {
+    return open;
+}
+
+//Closing an input port lets go of its file, which stays for any slices
+//of it still around.
+void Port::close() {
+    if (open && fd >= 0) {
+        flush();
+        if (fd > 2)
+            ::close(fd);
+    }
+    if (file != nullptr)
+        releaseFileData(file);
+    file = nullptr;
+    data = nullptr;
+    size = 0;
+    open = false;
+}
+
+//The next line, without its line ending. False at the end of the file.
+bool Port::readLine(const char*& line, size_t& length) {
+    return readLine(pos, line, length);
+}
+
+//The line at offset at, moving at past it, for a reader that keeps its
+//own place in the file.
+bool Port::readLine(size_t& at, const char*& line, size_t& length) {
+    if (!open || at >= size)
+        return false;
+    line = data + at;
+    const char* end = (const char*)memchr(line, '\n', size - at);
+    length = end == nullptr ? size - at:end - line;
+    at += length + (end != nullptr);
+    if (length > 0 && line[length-1] == '\r')
+        length--;
+    return true;
+}
+
+//The offset just past a line readLine gave, and its line ending. The end
+//of the file for anything that isn't a line of this port.
+size_t Port::lineEnd(const char* line, size_t length) {
+    uintptr_t start = (uintptr_t)data, at = (uintptr_t)line;
+    if (data == nullptr || at < start || at - start > size || length > size - (at - start))
+        return size;
+    size_t end = at - start + length;
+    if (end < size && data[end] == '\r')
+        end++;
+    if (end < size && data[end] == '\n')
+        end++;
+    return end;
+}
+
+//Moves to the end of the file, returning where the port was.
+size_t Port::skipToEnd() {
+    size_t at = pos;
+    pos = size;
+    return at;
+}
+
+//The extent of the next datum: a balanced list, a string or an atom. An
+//unbalanced list runs to the end of the file, for the lexer to report.
+bool Port::nextDatum(const char*& start, size_t& length) {
+    while (open && pos < size && isspace(data[pos]))
+        pos++;
+    if (!open || pos >= size)
+        return false;
+    size_t begin = pos;
+    int depth = 0;
+    bool inString = false;
+    for (; pos < size; pos++) {
+        char c = data[pos];
+        if (inString) {
+            if (c == '\\')
+                pos++;
+            else if (c == '"')
+                inString = false;
+        } else if (c == '"') {
+            inString = true;
+        } else if (c == '(') {
+            depth++;
+        } else if (c == ')') {
+            depth--;
+        } else if (depth == 0 && isspace(c)) {
+            break;
+        }
+        if (depth <= 0 && !inString && (c == ')' || c == '"') && pos > begin) {
+            pos++;
+            break;
+        }
+    }
+    if (pos > size)
+        pos = size;
+    start = data + begin;
+    length = pos - begin;
+    return true;
+}
+
+const char* Port::contents() {
+    return data;
+}
+
+size_t Port::length() {
+    return size;
+}
+
+//What slices of this port's contents must keep.
+FileData* Port::source() {
+    return file;
+}
+
+void Port::write(const char* bytes, size_t count) {
+    if (!open)
+        return;
+    out.append(bytes, count);
+    if (fd >= 0 && out.size() >= portBufferSize)
+        flush();
+}
+
+void Port::write(const string& str) {
+    write(str.data(), str.size());
+}
+
+//Writes obj as toString would, but straight into the buffer a piece at a
+//time, so a large list is never built up as one string first.
+void Port::print(Object* obj) {
+    switch (obj->type) {
+        case AS_LIST:
+            write("( ", 2);
+            for (Object* it : *obj->listVal) {
+                print(it);
+                write(" ", 1);
+            }
+            write(")", 1);
+            break;
+        case AS_STRING:
+            write(obj->textVal->data, obj->textVal->length);
+            break;
+        default:
+            write(toString(obj));
+            break;
+    }
+}
+
+//Anything written through stdio goes out first, so output to the same
+//file stays in order.
+bool Port::flush() {
+    if (fd < 0 || out.empty())
+        return true;
+    cout.flush();
+    fflush(stdout);
+    size_t done = 0;
+    while (done < out.size()) {
+        ssize_t n = ::write(fd, out.data() + done, out.size() - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    bool ok = done == out.size();
+    out.clear();
+    return ok;
+}
+
+//What a string port has been given.
+string& Port::written() {
+    return out;
+}
+
+#endif
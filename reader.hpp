@@ -0,0 +1,173 @@
+#ifndef reader_hpp
+#define reader_hpp
+#include <iostream>
+#include <vector>
+#include <unordered_map>
+#include "objects.hpp"
+#include "lex.hpp"
+#include "list.hpp"
+using namespace std;
+
+/*
+ * Literals are shared: a number or string that reads the same as one read
+ * before is the object read before, and so is a quoted constant with the
+ * same structure, so a table of constants repeated across a program is
+ * kept once. That's only safe because a shared literal is never changed.
+ * Nothing changes a number or a string. Code is rewritten in place, by
+ * macro expansion and by call site specialization, but a quoted constant
+ * is data, and its lists are marked shared so that neither touches them
+ * even if a constant ends up evaluated as code; what a macro returns is
+ * copied before it's spliced in. set changes bindings, not the objects
+ * bound. Shared literals are never freed.
+ */
+inline unordered_map<string, Object*> numberLiterals;
+inline unordered_map<string, Object*> stringLiterals;
+inline unordered_multimap<size_t, Object*> constantLiterals;
+
+//The object a single atom reads as.
+Object* readAtom(Lexeme& lexeme) {
+    if (lexeme.token == NUMBER || lexeme.token == REALNUM || lexeme.token == STRING) {
+        auto& literals = lexeme.token == STRING ? stringLiterals:numberLiterals;
+        auto it = literals.find(lexeme.strVal);
+        if (it != literals.end())
+            return it->second;
+    }
+    Object* obj;
+    switch (lexeme.token) {
+        case SYMBOL: return makeSymbolObject(lexeme.strVal);
+        case NUMBER: obj = makeIntegerObject(lexeme.strVal); break;
+        case REALNUM: obj = makeRealObject(stof(lexeme.strVal.c_str())); break;
+        case STRING: obj = makeStringObject(lexeme.strVal); break;
+        default:
+            return makeErrorObject("<Error: unexpected " + lexeme.strVal + ">");
+    }
+    (lexeme.token == STRING ? stringLiterals:numberLiterals)[lexeme.strVal] = obj;
+    return obj;
+}
+
+//The shared copy of a quoted constant. Its atoms are shared already and
+//its sublists are made shared first, so two constants are equal exactly
+//when they hold the same objects, and can be hashed by their addresses.
+Object* sharedConstant(Object* obj) {
+    if (obj->type != AS_LIST)
+        return obj;
+    size_t hash = obj->listVal->size();
+    for (Object*& it : *obj->listVal) {
+        it = sharedConstant(it);
+        hash = hash * 31 + (size_t)it;
+    }
+    auto range = constantLiterals.equal_range(hash);
+    for (auto it = range.first; it != range.second; it++) {
+        List* other = it->second->listVal;
+        if (other->size() != obj->listVal->size())
+            continue;
+        ListNode* a = other->first();
+        ListNode* b = obj->listVal->first();
+        while (a != nullptr && a->info == b->info) {
+            a = a->next;
+            b = b->next;
+        }
+        if (a == nullptr) {
+            //the duplicate's elements all belong to the shared copy now.
+            obj->listVal->clear();
+            destroyObject(obj);
+            return it->second;
+        }
+    }
+    obj->listVal->markShared();
+    constantLiterals.emplace(hash, obj);
+    return obj;
+}
+
+//Makes forms that didn't come through readAtom, like those out of a module
+//cache, share their literals the way freshly read ones do.
+Object* shareLiterals(Object* form) {
+    switch (form->type) {
+        case AS_LIST:
+            for (Object*& it : *form->listVal)
+                it = shareLiterals(it);
+            if (form->listVal->size() == 2) {
+                ListNode* head = form->listVal->first();
+                if (head->info->type == AS_SYMBOL && head->info->special == SF_QUOTE)
+                    head->next->info = sharedConstant(head->next->info);
+            }
+            return form;
+        case AS_STRING:
+        case AS_INT:
+        case AS_REAL:
+        case AS_BIGNUM: {
+            bool text = form->type == AS_STRING;
+            auto& literals = text ? stringLiterals:numberLiterals;
+            string key = text ? string(form->textVal->data, form->textVal->length):toString(form);
+            //a real prints rounded, so it goes by its bits, which no
+            //number as read looks like.
+            if (form->type == AS_REAL) {
+                uint64_t bits;
+                memcpy(&bits, &form->realVal, sizeof(bits));
+                key = "real:" + to_string(bits);
+            }
+            auto it = literals.find(key);
+            if (it != literals.end())
+                return it->second;
+            literals[key] = form;
+            return form;
+        }
+        default:
+            return form;
+    }
+}
+
+//A quote form's constant is swapped for its shared copy as it's read.
+List* shareQuoted(List* form) {
+    if (form->size() == 2 && form->first()->info->type == AS_SYMBOL && form->first()->info->special == SF_QUOTE)
+        form->first()->next->info = sharedConstant(form->first()->next->info);
+    return form;
+}
+
+//Parses the form starting at index, leaving index on its closing paren. A
+//bare atom at top level is quoted, so typing a symbol at the repl gives
+//the symbol back.
+List* parseToList(vector<Lexeme>& lexemes, int& index) {
+    List* result = new List();
+    bool shouldQuote = false;
+    if (lexemes[index].token == LPAREN) index++;
+    else shouldQuote = true;
+    for (; index < (int)lexemes.size(); index++) {
+        switch (lexemes[index].token) {
+            case LPAREN: 
+                result->append(makeListObject(parseToList(lexemes, index)));
+                break;
+            case RPAREN:
+                return shareQuoted(result);
+            case SYMBOL:
+            case NUMBER:
+            case REALNUM:
+            case STRING:
+                result->append(readAtom(lexemes[index]));
+                break;
+            default:
+                break;
+        }
+    }
+    if (shouldQuote) {
+        List* nr = new List();
+        nr->append(makeSymbolObject("'"));
+        nr->append(makeListObject(result));
+        result = nr;
+    }
+    return result;
+}
+
+//The first datum in lexemes as data: a list or an atom, never quoted.
+Object* readDatum(vector<Lexeme>& lexemes) {
+    int index = 0;
+    if (lexemes.empty())
+        return makeErrorObject("<Error: nothing to read>");
+    if (lexemes[0].token == ERROR)
+        return makeErrorObject("<Error: " + lexemes[0].strVal + ">");
+    if (lexemes[0].token == LPAREN)
+        return makeListObject(parseToList(lexemes, index));
+    return readAtom(lexemes[0]);
+}
+
+#endif
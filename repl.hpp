@@ -1,10 +1,16 @@
 #ifndef repl_hpp
 #define repl_hpp
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <vector>
 #include "objects.hpp"
 #include "lex.hpp"
 #include "evalapply.hpp"
+#include "image.hpp"
+#include "reader.hpp"
+#include "module.hpp"
+#include "aot.hpp"
 #include "readline/readline.h"
 using namespace std;
 
@@ -12,21 +18,32 @@ class REPL {
     private:
         Lexer lexer;
         EvalApply evaluator;
-        List* parseToList(vector<Lexeme>& lexemes, int& index);
     public:
         REPL();
         void start();
+        Object* evalInput(string input, List* env);
+        bool loadFile(string filename);
+        EvalApply& getEvaluator();
+        void setJit(bool enabled);
+        void setParallel(bool enabled);
+        void setMemoryLimit(long bytes);
+        bool loadImage(string filename);
+        bool saveImage(string filename);
+        bool compileAot(string source, string output);
+        bool loadCompiled(string filename);
 };
 
 REPL::REPL() {
-    cout<<"[mgclisp repl]"<<endl;
+
 }
 
 void REPL::start() {
+    cout<<"[mgclisp repl]"<<endl;
     string input;
     bool running = true;
     int exprNo = 1;
     bool tracing = false;
+    bool quickening = true;
      while (running) {
         string prompt = "mgclisp(" + to_string(exprNo) + ")> ";
         //If you dont want to use GNU readline, replace the following line
@@ -39,45 +56,121 @@ void REPL::start() {
         } else if (input == ".trace") {
             tracing = !tracing;
             evaluator.setTrace(tracing);
+        } else if (input == ".jit") {
+            evaluator.setJit(!evaluator.getJit());
+            cout<<"jit "<<(evaluator.getJit() ? "on":"off")<<endl;
+        } else if (input == ".quicken") {
+            quickening = !quickening;
+            evaluator.setQuicken(quickening);
+            cout<<"quickening "<<(quickening ? "on":"off")<<endl;
+        } else if (input == ".parallel") {
+            evaluator.setParallel(!evaluator.getParallel());
+            cout<<"parallel "<<(evaluator.getParallel() ? "on":"off")<<endl;
+        } else if (input == ".mem") {
+            cout<<evaluator.memoryReport()<<endl;
+        } else if (input == ".stats") {
+            cout<<evaluator.getStats("json")<<endl;
+        } else if (input == ".stats prometheus") {
+            cout<<evaluator.getStats("prometheus");
+        } else if (input.rfind(".mem-limit ", 0) == 0) {
+            evaluator.setMemoryLimit(atol(input.substr(11).c_str()));
+        } else if (input.rfind(".save-image ", 0) == 0) {
+            saveImage(input.substr(12));
         } else {
-            auto tokens = lexer.lex(input);
-            int inpos = 0;
-            cout<<toString(evaluator.eval(parseToList(tokens, inpos)))<<endl;
+            cout<<toString(evalInput(input, evaluator.getEnvironment()))<<"\n";
         }
         exprNo++;
     }
 }
 
-List* REPL::parseToList(vector<Lexeme>& lexemes, int& index) {
-    List* result = new List();
-    bool shouldQuote = false;
-    if (lexemes[index].token == LPAREN) index++;
-    else shouldQuote = true;
-    for (; index < lexemes.size(); index++) {
-        switch (lexemes[index].token) {
-            case LPAREN: 
-                result->append(makeListObject(parseToList(lexemes, index)));
-                break;
-            case RPAREN:
-                return result;
-            case SYMBOL:
-                result->append(makeSymbolObject(lexemes[index].strVal));
-                break;
-            case NUMBER:
-                result->append(makeIntObject(atoi(lexemes[index].strVal.c_str())));
-                break;
-            case REALNUM:
-                result->append(makeRealObject(stof(lexemes[index].strVal.c_str())));
-                break;
-        }
+//Evaluates the first expression in input.
+Object* REPL::evalInput(string input, List* env) {
+    auto tokens = lexer.lex(input);
+    if (tokens.empty())
+        return makeListObject(new List());
+    if (tokens[0].token == ERROR)
+        return makeErrorObject("<Error: " + tokens[0].strVal + ">");
+    int inpos = 0;
+    return evaluator.eval(parseToList(tokens, inpos), env);
+}
+
+//Evaluates every top level form in a source file, reporting any that fail.
+bool REPL::loadFile(string filename) {
+    ifstream file(filename);
+    if (!file) {
+        cout<<"Error: could not open "<<filename<<endl;
+        return false;
+    }
+    stringstream source;
+    source<<file.rdbuf();
+    auto tokens = lexer.lex(source.str());
+    if (!tokens.empty() && tokens[0].token == ERROR) {
+        cout<<"Error: "<<filename<<": "<<tokens[0].strVal<<endl;
+        return false;
+    }
+    int formNo = 1;
+    for (int index = 0; index < (int)tokens.size(); index++) {
+        if (tokens[index].token != LPAREN)
+            continue;
+        Object* result = evaluator.eval(parseToList(tokens, index));
+        if (result->type == AS_ERROR)
+            cout<<filename<<": form "<<formNo<<": "<<toString(result)<<endl;
+        formNo++;
+    }
+    return true;
+}
+
+EvalApply& REPL::getEvaluator() {
+    return evaluator;
+}
+
+void REPL::setJit(bool enabled) {
+    evaluator.setJit(enabled);
+}
+
+void REPL::setParallel(bool enabled) {
+    evaluator.setParallel(enabled);
+}
+
+void REPL::setMemoryLimit(long bytes) {
+    evaluator.setMemoryLimit(bytes);
+}
+
+bool REPL::loadImage(string filename) {
+    HeapImage image(evaluator);
+    if (!image.load(filename)) {
+        cout<<"Error: "<<image.lastError()<<endl;
+        return false;
+    }
+    return true;
+}
+
+bool REPL::saveImage(string filename) {
+    HeapImage image(evaluator);
+    if (!image.save(filename)) {
+        cout<<"Error: "<<image.lastError()<<endl;
+        return false;
     }
-    if (shouldQuote) {
-        List* nr = new List();
-        nr->append(makeSymbolObject("'"));
-        nr->append(makeListObject(result));
-        result = nr;
+    cout<<"saved image to "<<filename<<endl;
+    return true;
+}
+
+bool REPL::compileAot(string source, string output) {
+    string error;
+    if (!evaluator.compileAot(source, output, error)) {
+        cout<<"Error: "<<error<<endl;
+        return false;
+    }
+    return true;
+}
+
+bool REPL::loadCompiled(string filename) {
+    string error;
+    if (!evaluator.loadCompiled(filename, error)) {
+        cout<<"Error: "<<error<<endl;
+        return false;
     }
-    return result;
+    return true;
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,395 @@
+#ifndef scheduler_hpp
+#define scheduler_hpp
+#include <iostream>
+#include <deque>
+#include <vector>
+#include <functional>
+#include <unordered_map>
+#include <exception>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include "objects.hpp"
+using namespace std;
+
+/*
+ * Green threads. Every task gets its own mmap'd C stack and they all take
+ * turns on the one OS thread. The evaluator calls tick() once per eval
+ * step, and when a task's slice of steps runs out it goes to the back of
+ * the run queue, so one long computation can't starve the others.
+ *
+ * The code that called into the evaluator (the repl, an embedder) is
+ * task 0. It is never spawned and runs on the process stack.
+ *
+ * A task's C stack isn't a hard limit on how deep it can recurse. When it
+ * runs low, onNewStack carries on in a fresh segment and comes back when
+ * that returns, so deep recursion is a chain of segments and runs out only
+ * when memory does.
+ */
+
+enum taskState { TASK_RUNNABLE, TASK_WAITING, TASK_DONE };
+
+//A C stack segment, kept around after use since deep recursion tends to
+//go in and out of the same few.
+struct StackSegment {
+    void* stack;
+    ucontext_t context;
+    ucontext_t caller;
+    function<Object*()>* body;
+    Object* result;
+    exception_ptr error;
+    StackSegment* next;
+};
+
+//Evaluated call arguments. Every task pushes onto its own, since a task
+//can be switched out halfway through evaluating a call's operands.
+struct ArgStack {
+    Object** base;
+    Object** top;
+    Object** limit;
+};
+
+struct Task {
+    int id;
+    taskState state;
+    ucontext_t context;
+    void* stack;
+    size_t stackSize;
+    char* stackLimit;
+    ArgStack args;
+    deque<Object*> mailbox;
+    function<Object*()> body;
+};
+
+const int taskSliceSteps = 10000;
+const size_t taskStackSize = 1 << 20;
+const size_t argStackSlots = 1 << 26;
+const size_t stackSegmentSize = 16 << 20;
+//how close to the end of a stack stackLow starts saying so. Enough for
+//whatever runs between two checks.
+const size_t stackReserve = 256 << 10;
+const int spareSegmentsKept = 4;
+
+class Scheduler {
+    private:
+        Task mainTask;
+        Task* current;
+        unordered_map<int, Task*> tasks;
+        deque<Task*> runQueue;
+        vector<Task*> finished;
+        int nextId;
+        int slice;
+        StackSegment* spareSegments;
+        int spareCount;
+        static Scheduler* running;
+        static StackSegment* entering;
+        static void taskEntry();
+        static void segmentEntry();
+        Task* nextRunnable();
+        void switchTo(Task* next);
+        void reap();
+        static bool allocArgStack(ArgStack& args);
+        static void freeArgStack(ArgStack& args);
+        StackSegment* takeSegment();
+        void keepSegment(StackSegment* segment);
+    public:
+        Scheduler();
+        ~Scheduler();
+        bool active();
+        void tick();
+        int spawn(function<Object*()> body);
+        bool send(int id, Object* message);
+        bool receive(Object*& message);
+        void yield();
+        void runUntilIdle();
+        int self();
+        ArgStack& argStack();
+        bool stackLow(size_t needed = 0);
+        Object* onNewStack(function<Object*()> body);
+};
+
+Scheduler* Scheduler::running = nullptr;
+StackSegment* Scheduler::entering = nullptr;
+
+Scheduler::Scheduler() {
+    mainTask.id = 0;
+    mainTask.state = TASK_RUNNABLE;
+    mainTask.stack = nullptr;
+    mainTask.stackSize = 0;
+    //the process stack can grow as far as its rlimit allows, measured
+    //from about here.
+    size_t size = 8 << 20;
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_STACK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+        size = limit.rlim_cur;
+    char here;
+    mainTask.stackLimit = &here - size + stackReserve;
+    allocArgStack(mainTask.args);
+    current = &mainTask;
+    tasks[0] = &mainTask;
+    nextId = 1;
+    slice = taskSliceSteps;
+    spareSegments = nullptr;
+    spareCount = 0;
+}
+
+//Only ever run from the main task, so every other task's stack is free
+//to go.
+Scheduler::~Scheduler() {
+    reap();
+    for (auto& it : tasks) {
+        Task* task = it.second;
+        if (task == &mainTask)
+            continue;
+        munmap(task->stack, task->stackSize);
+        freeArgStack(task->args);
+        delete task;
+    }
+    freeArgStack(mainTask.args);
+    while (spareSegments != nullptr) {
+        StackSegment* segment = spareSegments;
+        spareSegments = segment->next;
+        munmap(segment->stack, stackSegmentSize);
+        delete segment;
+    }
+}
+
+bool Scheduler::active() {
+    return tasks.size() > 1;
+}
+
+//One eval step. Cheap unless the slice is used up.
+void Scheduler::tick() {
+    if (--slice > 0)
+        return;
+    slice = taskSliceSteps;
+    if (!runQueue.empty())
+        yield();
+}
+
+int Scheduler::self() {
+    return current->id;
+}
+
+ArgStack& Scheduler::argStack() {
+    return current->args;
+}
+
+//True once the current stack has less than stackReserve plus needed
+//bytes left.
+bool Scheduler::stackLow(size_t needed) {
+    char here;
+    return &here < current->stackLimit + needed;
+}
+
+StackSegment* Scheduler::takeSegment() {
+    if (spareSegments != nullptr) {
+        StackSegment* segment = spareSegments;
+        spareSegments = segment->next;
+        spareCount--;
+        return segment;
+    }
+    void* stack = mmap(nullptr, stackSegmentSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (stack == MAP_FAILED)
+        return nullptr;
+    mprotect(stack, getpagesize(), PROT_NONE);
+    StackSegment* segment = new StackSegment;
+    segment->stack = stack;
+    return segment;
+}
+
+void Scheduler::keepSegment(StackSegment* segment) {
+    if (spareCount >= spareSegmentsKept) {
+        munmap(segment->stack, stackSegmentSize);
+        delete segment;
+        return;
+    }
+    segment->next = spareSegments;
+    spareSegments = segment;
+    spareCount++;
+}
+
+//An exception can't unwind past the bottom of a segment, so it's caught
+//there and thrown again on the stack below.
+void Scheduler::segmentEntry() {
+    StackSegment* segment = entering;
+    try {
+        segment->result = (*segment->body)();
+    } catch (...) {
+        segment->error = current_exception();
+    }
+    swapcontext(&segment->context, &segment->caller);
+}
+
+//Runs body on a fresh stack segment and returns what it did, or nullptr
+//if there was no memory for one. Other tasks may run in the meantime;
+//the segment belongs to this one until body returns.
+Object* Scheduler::onNewStack(function<Object*()> body) {
+    StackSegment* segment = takeSegment();
+    if (segment == nullptr)
+        return nullptr;
+    Task* task = current;
+    char* outerLimit = task->stackLimit;
+    task->stackLimit = (char*)segment->stack + getpagesize() + stackReserve;
+    segment->body = &body;
+    segment->result = nullptr;
+    segment->error = nullptr;
+    getcontext(&segment->context);
+    segment->context.uc_stack.ss_sp = segment->stack;
+    segment->context.uc_stack.ss_size = stackSegmentSize;
+    segment->context.uc_link = nullptr;
+    makecontext(&segment->context, &Scheduler::segmentEntry, 0);
+    entering = segment;
+    swapcontext(&segment->caller, &segment->context);
+    task->stackLimit = outerLimit;
+    Object* result = segment->result;
+    exception_ptr error = segment->error;
+    segment->error = nullptr;
+    keepSegment(segment);
+    if (error)
+        rethrow_exception(error);
+    return result;
+}
+
+//Reserved, not committed: pages are only touched as deep as calls go.
+bool Scheduler::allocArgStack(ArgStack& args) {
+    size_t bytes = argStackSlots * sizeof(Object*);
+    void* mem = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) {
+        args = {nullptr, nullptr, nullptr};
+        return false;
+    }
+    args.base = args.top = (Object**)mem;
+    args.limit = args.base + argStackSlots;
+    return true;
+}
+
+void Scheduler::freeArgStack(ArgStack& args) {
+    if (args.base != nullptr)
+        munmap(args.base, argStackSlots * sizeof(Object*));
+}
+
+Task* Scheduler::nextRunnable() {
+    while (!runQueue.empty()) {
+        Task* next = runQueue.front();
+        runQueue.pop_front();
+        if (next->state == TASK_RUNNABLE)
+            return next;
+    }
+    return nullptr;
+}
+
+void Scheduler::switchTo(Task* next) {
+    Task* prev = current;
+    current = next;
+    slice = taskSliceSteps;
+    running = this;
+    swapcontext(&prev->context, &next->context);
+    reap();
+}
+
+//A finished task can't free the stack it's running on, so whoever runs
+//next does it.
+void Scheduler::reap() {
+    for (Task* task : finished) {
+        munmap(task->stack, task->stackSize);
+        freeArgStack(task->args);
+        delete task;
+    }
+    finished.clear();
+}
+
+void Scheduler::taskEntry() {
+    Scheduler* sched = running;
+    Task* task = sched->current;
+    task->body();
+    task->state = TASK_DONE;
+    sched->tasks.erase(task->id);
+    sched->finished.push_back(task);
+    Task* next = sched->nextRunnable();
+    //task 0 is always either queued or waiting in receive, and in the
+    //second case it has to get to find out nothing will ever arrive.
+    sched->switchTo(next != nullptr ? next:&sched->mainTask);
+}
+
+int Scheduler::spawn(function<Object*()> body) {
+    Task* task = new Task;
+    task->id = nextId++;
+    task->state = TASK_RUNNABLE;
+    task->body = body;
+    task->stackSize = taskStackSize;
+    task->stack = mmap(nullptr, taskStackSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (task->stack == MAP_FAILED) {
+        delete task;
+        return -1;
+    }
+    if (!allocArgStack(task->args)) {
+        munmap(task->stack, taskStackSize);
+        delete task;
+        return -1;
+    }
+    //guard page, so running off the end of the stack faults instead of
+    //scribbling over whatever is mapped below it.
+    mprotect(task->stack, getpagesize(), PROT_NONE);
+    task->stackLimit = (char*)task->stack + getpagesize() + stackReserve;
+    getcontext(&task->context);
+    task->context.uc_stack.ss_sp = task->stack;
+    task->context.uc_stack.ss_size = taskStackSize;
+    task->context.uc_link = nullptr;
+    makecontext(&task->context, &Scheduler::taskEntry, 0);
+    tasks[task->id] = task;
+    runQueue.push_back(task);
+    return task->id;
+}
+
+bool Scheduler::send(int id, Object* message) {
+    auto it = tasks.find(id);
+    if (it == tasks.end())
+        return false;
+    Task* task = it->second;
+    task->mailbox.push_back(message);
+    if (task->state == TASK_WAITING) {
+        task->state = TASK_RUNNABLE;
+        runQueue.push_back(task);
+    }
+    return true;
+}
+
+//Blocks the current task until a message arrives. Returns false if
+//nothing else can run, since then nothing ever will.
+bool Scheduler::receive(Object*& message) {
+    while (current->mailbox.empty()) {
+        current->state = TASK_WAITING;
+        Task* next = nextRunnable();
+        if (next == nullptr) {
+            if (current == &mainTask) {
+                current->state = TASK_RUNNABLE;
+                return false;
+            }
+            next = &mainTask;
+        }
+        switchTo(next);
+    }
+    current->state = TASK_RUNNABLE;
+    message = current->mailbox.front();
+    current->mailbox.pop_front();
+    return true;
+}
+
+void Scheduler::yield() {
+    Task* next = nextRunnable();
+    if (next == nullptr)
+        return;
+    runQueue.push_back(current);
+    switchTo(next);
+}
+
+//Lets every other task run until they have all finished or are waiting
+//for messages.
+void Scheduler::runUntilIdle() {
+    while (current == &mainTask && !runQueue.empty())
+        yield();
+}
+
+#endif
@@ -0,0 +1,220 @@
+#ifndef server_hpp
+#define server_hpp
+#include <iostream>
+#include <vector>
+#include <csignal>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "repl.hpp"
+using namespace std;
+
+/*
+ * mgclisp --serve path keeps a warm interpreter behind a unix domain socket.
+ * The parent loads the prelude once and then forks a pool of workers, each
+ * of which inherits the loaded heap and accepts connections on the shared
+ * socket.
+ *
+ * The protocol is line based, the same as the repl: every line a client
+ * sends is one expression, and one line comes back for each, in order.
+ * Clients may send any number of lines without waiting for the replies.
+ * Each expression is evaluated in a child the worker forks for it, so a
+ * request sees the heap as the prelude left it, and nothing it does, from
+ * a define or set to a new macro or the memory it allocates, is seen by
+ * the next one or stays behind when it's done. Whatever a request prints
+ * comes back ahead of its result, and a request still running after the
+ * time limit is killed and answered with an error.
+ */
+
+class Server {
+    private:
+        REPL& repl;
+        string path;
+        int numWorkers;
+        int timeout;
+        int listenFd;
+        vector<pid_t> workers;
+        static volatile sig_atomic_t stopping;
+        static void onSignal(int);
+        pid_t startWorker();
+        void workerLoop();
+        void serveConnection(int fd);
+        string evalRequest(const string& line);
+        bool writeAll(int fd, const string& data);
+    public:
+        Server(REPL& repl, string path, int workers, int timeout);
+        int run();
+};
+
+volatile sig_atomic_t Server::stopping = 0;
+
+Server::Server(REPL& r, string p, int n, int t) : repl(r), path(p), numWorkers(n), timeout(t), listenFd(-1) {
+    if (numWorkers < 1)
+        numWorkers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (numWorkers < 1)
+        numWorkers = 1;
+}
+
+void Server::onSignal(int) {
+    stopping = 1;
+}
+
+bool Server::writeAll(int fd, const string& data) {
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = write(fd, data.data() + done, data.size() - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+//Replies for every complete line in a read are written back together, so
+//a pipelining client gets one write per batch rather than one per line.
+void Server::serveConnection(int fd) {
+    string pending;
+    char buffer[65536];
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        pending.append(buffer, n);
+        string replies;
+        size_t start = 0;
+        size_t newline;
+        while ((newline = pending.find('\n', start)) != string::npos) {
+            string line = pending.substr(start, newline - start);
+            start = newline + 1;
+            if (line.find_first_not_of(" \t\r") == string::npos)
+                continue;
+            replies += evalRequest(line);
+        }
+        pending.erase(0, start);
+        if (!replies.empty() && !writeAll(fd, replies))
+            break;
+    }
+    close(fd);
+}
+
+//The reply comes back through a pipe, which is also the child's stdout,
+//read to the end before the child is reaped, so a child that dies still
+//gets its request an answer. Only a child that exits normally has written
+//its result; the alarm kills one that runs past the time limit.
+string Server::evalRequest(const string& line) {
+    int out[2];
+    if (pipe(out) < 0)
+        return "<Error: could not start request: " + string(strerror(errno)) + ">\n";
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(out[0]);
+        dup2(out[1], STDOUT_FILENO);
+        signal(SIGALRM, SIG_DFL);
+        alarm(timeout);
+        string result = toString(repl.evalInput(line, repl.getEvaluator().getEnvironment())) + "\n";
+        cout.flush();
+        writeAll(out[1], result);
+        _exit(0);
+    }
+    close(out[1]);
+    string reply;
+    char buffer[4096];
+    ssize_t n;
+    while (pid > 0 && (n = read(out[0], buffer, sizeof(buffer))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        reply.append(buffer, n);
+    }
+    close(out[0]);
+    if (pid < 0)
+        return "<Error: could not start request: " + string(strerror(errno)) + ">\n";
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+        ;
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+        return reply;
+    if (!reply.empty() && reply.back() != '\n')
+        reply += "\n";
+    if (WIFSIGNALED(status) && WTERMSIG(status) == SIGALRM)
+        return reply + "<Error: request ran past the limit of " + to_string(timeout) + " seconds>\n";
+    return reply + "<Error: request did not finish>\n";
+}
+
+void Server::workerLoop() {
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    while (true) {
+        int fd = accept(listenFd, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            _exit(1);
+        }
+        serveConnection(fd);
+    }
+}
+
+pid_t Server::startWorker() {
+    pid_t pid = fork();
+    if (pid == 0) {
+        workerLoop();
+        _exit(0);
+    }
+    return pid;
+}
+
+int Server::run() {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        cout<<"Error: socket path too long: "<<path<<endl;
+        return 1;
+    }
+    strcpy(addr.sun_path, path.c_str());
+    listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path.c_str());
+    if (listenFd < 0 || bind(listenFd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(listenFd, 128) < 0) {
+        cout<<"Error: could not listen on "<<path<<": "<<strerror(errno)<<endl;
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = &Server::onSignal;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+    cout<<"[mgclisp serving on "<<path<<" with "<<numWorkers<<" workers]"<<endl;
+    for (int i = 0; i < numWorkers; i++)
+        workers.push_back(startWorker());
+    //the parent only keeps the pool full.
+    while (!stopping) {
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0)
+            continue;
+        for (pid_t& worker : workers)
+            if (worker == pid && !stopping)
+                worker = startWorker();
+    }
+    for (pid_t worker : workers)
+        kill(worker, SIGTERM);
+    while (wait(nullptr) > 0)
+        ;
+    close(listenFd);
+    unlink(path.c_str());
+    return 0;
+}
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef sort_hpp
+#define sort_hpp
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include "threadpool.hpp"
+using namespace std;
+
+//below this many items sorting isn't worth handing to other threads.
+const size_t parallelSortThreshold = 1 << 14;
+
+//Stable, and cheap on input that is already in order.
+template <class T, class Less>
+void adaptiveStableSort(vector<T>& items, Less less) {
+    if (is_sorted(items.begin(), items.end(), less))
+        return;
+    stable_sort(items.begin(), items.end(), less);
+}
+
+/*
+ * Merge sort over a pool: each thread stable sorts one run, then
+ * neighbouring runs are merged in rounds, half as many each time. Merging
+ * always takes from the left run on ties, so the result is stable. less
+ * must be safe to call from several threads at once.
+ */
+template <class T, class Less>
+void parallelStableSort(vector<T>& items, Less less, ThreadPool& pool) {
+    size_t n = items.size();
+    size_t runs = pool.size();
+    if (n < parallelSortThreshold || runs < 2) {
+        adaptiveStableSort(items, less);
+        return;
+    }
+    vector<size_t> bounds;
+    for (size_t i = 0; i <= runs; i++)
+        bounds.push_back(n * i / runs);
+    vector<function<void()>> jobs;
+    for (size_t i = 0; i < runs; i++) {
+        size_t lo = bounds[i], hi = bounds[i+1];
+        jobs.push_back([&items, lo, hi, less]() { stable_sort(items.begin() + lo, items.begin() + hi, less); });
+    }
+    pool.run(jobs);
+    vector<T> buffer(n);
+    vector<T>* from = &items;
+    vector<T>* to = &buffer;
+    while (bounds.size() > 2) {
+        vector<size_t> merged;
+        jobs.clear();
+        for (size_t i = 0; i + 1 < bounds.size(); i += 2) {
+            size_t lo = bounds[i];
+            size_t mid = bounds[i+1];
+            size_t hi = i + 2 < bounds.size() ? bounds[i+2]:mid;
+            merged.push_back(lo);
+            jobs.push_back([from, to, lo, mid, hi, less]() {
+                merge(from->begin() + lo, from->begin() + mid, from->begin() + mid, from->begin() + hi, to->begin() + lo, less);
+            });
+        }
+        merged.push_back(n);
+        pool.run(jobs);
+        swap(from, to);
+        bounds.swap(merged);
+    }
+    if (from != &items)
+        items.swap(buffer);
+}
+
+#endif
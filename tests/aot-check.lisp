@@ -0,0 +1,10 @@
+; Run against a shared object compiled from tests/aot.lisp, see there.
+(print (eq (fib 20) 6765))
+(print (eq (sq 12) 144))
+(print (eq (sq 3037000500) 9223372037000250000))
+(print (eq (sq 1.5) 2.25))
+(print (eq (pick 0) (' zero)))
+(print (eq (pick 1) (' (some list))))
+(print (eq (steps 4) 5))
+(print (eq (add3 4) 7))
+(print (eq count 7))
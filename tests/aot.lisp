@@ -0,0 +1,12 @@
+; Compiled procedures have to give what the interpreter does. Compile this
+; file, to a path with a quote in it to check the compiler gets it as is,
+; then load it and run the checks, which print true for each case:
+;     mgclisp --aot tests/aot.lisp -o "/tmp/mgclisp's aot.so"
+;     mgclisp --load-compiled "/tmp/mgclisp's aot.so" --load tests/aot-check.lisp
+(define fib (lambda (x) (if (< x 2) x (+ (fib (- x 1)) (fib (- x 2))))))
+(define sq (lambda (x) (* x x)))
+(define pick (lambda (x) (if (eq x 0) (' zero) (' (some list)))))
+(define steps (lambda (x) (do (sq x) (+ x 1))))
+(define make-adder (lambda (k) (lambda (x) (+ x k))))
+(define add3 (make-adder 3))
+(define count 7)
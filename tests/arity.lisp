@@ -0,0 +1,14 @@
+; Primitives read their arguments off a shared stack, so each checks how
+; many it was given rather than reading what an earlier call left there.
+; Each line prints true:
+;     mgclisp --load tests/arity.lisp
+(print (eq (list (< 1 2) (write-to-string (< 1))) (list true "<Error: < requires two arguments>")))
+(print (eq (list (> 2 1) (write-to-string (> 3))) (list true "<Error: > requires two arguments>")))
+(print (eq (list (eq 1 1) (write-to-string (eq 1))) (list true "<Error: eq requires two arguments>")))
+(print (eq (write-to-string (car)) "<Error: car requires one argument>"))
+(print (eq (write-to-string (car (list 1 2) 3)) "<Error: car requires one argument>"))
+(print (eq (write-to-string (cdr)) "<Error: cdr requires one argument>"))
+(print (eq (write-to-string (push 1)) "<Error: push requires a value and a list>"))
+(print (eq (write-to-string (gensym 1)) "<Error: gensym takes no arguments>"))
+(print (eq (write-to-string (self 1)) "<Error: self takes no arguments>"))
+(print (eq (push 1 (list 2)) (list 1 2)))
@@ -0,0 +1,20 @@
+; Integers that don't fit in an int, against known values. Each line
+; prints true:
+;     mgclisp --load tests/bignum.lisp
+(define fact (lambda (x) (if (eq x 0) 1 (* x (fact (- x 1))))))
+(define pow (lambda (b n) (if (eq n 0) 1 (* b (pow b (- n 1))))))
+(print (eq (fact 30) 265252859812191058636308480000000))
+(print (eq (string-length (write-to-string (fact 100))) 158))
+(print (eq (pow 2 100) 1267650600228229401496703205376))
+(print (eq (- (pow 2 64) 1) 18446744073709551615))
+(print (eq (+ (- 0 (pow 2 70)) 5) -1180591620717411303419))
+(print (eq (* (pow 2 64) (pow 2 64)) 340282366920938463463374607431768211456))
+(print (eq (* 12345678901234567890 98765432109876543210) 1219326311370217952237463801111263526900))
+(print (eq (+ 2147483647 1) 2147483648))
+(print (eq (- -2147483648 1) -2147483649))
+(print (eq (- (pow 2 40) (pow 2 40)) 0))
+(print (eq (- (+ (pow 2 40) 7) (pow 2 40)) 7))
+(print (< (pow 2 64) (pow 2 65)))
+(print (> (- 0 (pow 2 64)) (- 0 (pow 2 65))))
+(print (< 5 (pow 2 64)))
+(print (eq (/ (pow 2 40) 2) 549755813888.0))
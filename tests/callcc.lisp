@@ -0,0 +1,25 @@
+; Deep recursion runs in fresh stack segments, and call/cc escapes from
+; however deep it's called.
+(define sum (lambda (n) (if (eq n 0) 0 (+ n (sum (- n 1))))))
+(print (eq (sum 1000000) 500000500000))
+(define build (lambda (n) (if (eq n 0) () (push n (build (- n 1))))))
+(print (eq (length (build 2000)) 2000))
+(print (eq (call/cc (lambda (k) 5)) 5))
+(print (eq (call/cc (lambda (k) (+ 1 (k 10)))) 10))
+(print (eq (call/cc (lambda (k) (map (lambda (x) (if (> x 2) (k x) x)) (list 1 2 3 4)))) 3))
+(print (eq (call-with-current-continuation (lambda (k) (k (' out)))) (' out)))
+; escaping from deep inside a recursion unwinds all of it
+(define find-deep (lambda (n k) (if (eq n 0) (k (' found)) (+ 1 (find-deep (- n 1) k)))))
+(print (eq (call/cc (lambda (k) (find-deep 100000 k))) (' found)))
+(print (eq (sum 1000) 500500))
+; evaluation carries on normally after an escape
+(define escapes 0)
+(define count-escape (lambda (x) (call/cc (lambda (k) (do (set escapes (+ escapes 1)) (k x) (' not-reached))))))
+(print (eq (map count-escape (list 1 2 3)) (list 1 2 3)))
+(print (eq escapes 3))
+; nested escapes go to their own call/cc
+(print (eq (call/cc (lambda (outer) (+ 1 (call/cc (lambda (inner) (inner 1)))))) 2))
+(print (eq (call/cc (lambda (outer) (+ 1 (call/cc (lambda (inner) (outer 1)))))) 1))
+; a continuation used after its call/cc has returned is an error
+(define saved (call/cc (lambda (k) k)))
+(print (eq (write-to-string (saved 1)) "<Error: continuation called after its call/cc returned>"))
@@ -0,0 +1,32 @@
+; Reading files, both small ones, which are read into memory, and ones
+; over 64K, which are mapped.
+(define write-lines (lambda (path n)
+  (do (define f (open-output-file path))
+      (stream-fold (lambda (acc i) (do (write "a line of text padded out to be long enough " f) (write i f) (newline f) acc)) 0 (stream-range 0 n))
+      (close-port f))))
+(write-lines "/tmp/mgclisp-files-small.txt" 3)
+(write-lines "/tmp/mgclisp-files-big.txt" 3000)
+(define in (open-input-file "/tmp/mgclisp-files-small.txt"))
+(print (eq (read-line in) "a line of text padded out to be long enough 0"))
+(print (eq (read-line in) "a line of text padded out to be long enough 1"))
+(print (eq (read-line in) "a line of text padded out to be long enough 2"))
+(print (eq (read-line in) false))
+(close-port in)
+(print (eq (with-lines "/tmp/mgclisp-files-small.txt" (lambda (line) line)) 3))
+(print (eq (with-lines "/tmp/mgclisp-files-big.txt" (lambda (line) line)) 3000))
+(print (eq (string-length (read-file-bytes "/tmp/mgclisp-files-small.txt")) 138))
+(define big (open-input-file "/tmp/mgclisp-files-big.txt"))
+(print (eq (stream-fold (lambda (acc line) (+ acc (string-length line))) 0 (stream-lines big)) 142890))
+(close-port big)
+(define again (open-input-file "/tmp/mgclisp-files-big.txt"))
+(print (eq (stream-list (stream-take 2 (stream-lines again))) (list "a line of text padded out to be long enough 0" "a line of text padded out to be long enough 1")))
+(close-port again)
+(define forms (open-output-file "/tmp/mgclisp-files-forms.txt"))
+(write "(+ 1 2) (a (b c))" forms)
+(close-port forms)
+(define source (open-input-file "/tmp/mgclisp-files-forms.txt"))
+(print (eq (read source) (' (+ 1 2))))
+(print (eq (read source) (' (a (b c)))))
+(print (eq (read source) false))
+(print (eq (string-length "tab\there") 8))
+(print (eq (string-length "") 0))
@@ -0,0 +1,15 @@
+; Run against an image saved from tests/image.lisp, see there.
+(print (eq n 42))
+(print (eq big 123456789012345678901234567890))
+(print (eq (+ big 1) 123456789012345678901234567891))
+(print (eq r 2.5))
+(print (eq s "a \"quoted\" line"))
+(print (eq xs (' (1 (2 3) four))))
+(print (eq (vector-list v) (' (1 2 3))))
+(print (eq (map-get m (' b)) 2))
+(print (eq (fib 15) 987))
+(print (eq (add3 4) 7))
+(print (eq (unless false 5) 5))
+(print (eq (point-y p) 2))
+(print (point? p))
+(print (eq (force later) 43))
@@ -0,0 +1,19 @@
+; Values saved in a heap image have to come back as they went in. Save an
+; image from this file, then load it and run the checks, which print true
+; for each case:
+;     (cat tests/image.lisp; echo ".save-image /tmp/test.img") | mgclisp
+;     mgclisp --image /tmp/test.img --load tests/image-check.lisp
+(define n 42)
+(define big 123456789012345678901234567890)
+(define r 2.5)
+(define s "a \"quoted\" line")
+(define xs (' (1 (2 3) four)))
+(define v (vector 1 2 3))
+(define m (map-put (map-put (hash-map) (' a) 1) (' b) 2))
+(define fib (lambda (x) (if (< x 2) 1 (+ (fib (- x 1)) (fib (- x 2))))))
+(define make-adder (lambda (k) (lambda (x) (+ x k))))
+(define add3 (make-adder 3))
+(defmacro unless (c body) (list (' if) c () body))
+(define-record point x y)
+(define p (make-point 1 2))
+(define later (delay (+ n 1)))
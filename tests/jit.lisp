@@ -0,0 +1,32 @@
+; Lambdas called often enough are compiled to native code, which has to
+; agree with the interpreter, including where it has to give up and let
+; the interpreter run the call. Each line prints true, with or without
+; --no-jit:
+;     mgclisp --load tests/jit.lisp
+(define fib (lambda (x) (if (< x 2) 1 (+ (fib (- x 1)) (fib (- x 2))))))
+(print (eq (fib 20) 10946))
+(define sq (lambda (x) (* x x)))
+(define warm (lambda (f n) (if (eq n 0) 0 (do (f n) (warm f (- n 1))))))
+(warm sq 300)
+(print (eq (sq 46340) 2147395600))
+(print (eq (sq 100000) 10000000000))
+(print (eq (sq -100000) 10000000000))
+(print (eq (sq 1.5) 2.25))
+(print (eq (sq 100000) 10000000000))
+(print (eq (sq 100000) 10000000000))
+(print (eq (sq 100000) 10000000000))
+(print (eq (sq 100000) 10000000000))
+(print (eq (sq 12) 144))
+(define down (lambda (n) (if (eq n 0) 0 (down (- n 1)))))
+(warm down 300)
+(print (eq (down 100000) 0))
+(define g (lambda (x) (+ x 1)))
+(define h (lambda (x) (g x)))
+(warm h 300)
+(print (eq (h 1) 2))
+(set g (lambda (x) (+ x 2)))
+(print (eq (h 1) 3))
+(define add (lambda (a b) (+ a b)))
+(warm (lambda (n) (add n n)) 300)
+(print (eq (add 2147483647 1) 2147483648))
+(print (eq (add -2147483648 -1) -2147483649))
@@ -0,0 +1,29 @@
+; The built in list procedures, on ordinary, empty and mismatched lists.
+(define xs (list 1 2 3 4))
+(print (eq (length xs) 4))
+(print (eq (length ()) 0))
+(print (eq (append xs (list 5)) (list 1 2 3 4 5)))
+(print (eq (append () xs) xs))
+(print (eq (reverse xs) (list 4 3 2 1)))
+(print (eq (reverse ()) ()))
+(print (eq (nth 0 xs) 1))
+(print (eq (nth 3 xs) 4))
+(print (eq (assoc (' b) (' ((a 1) (b 2)))) (' (b 2))))
+(print (eq (assoc (' c) (' ((a 1) (b 2)))) false))
+(print (eq (member 3 xs) (list 3 4)))
+(print (eq (member 9 xs) false))
+(print (eq (map (lambda (x) (* x x)) xs) (list 1 4 9 16)))
+(print (eq (map + xs (list 10 20 30 40)) (list 11 22 33 44)))
+(print (eq (map + xs (list 10 20)) (list 11 22)))
+(print (eq (filter (lambda (x) (< 2 x)) xs) (list 3 4)))
+(print (eq (filter (lambda (x) (< 9 x)) xs) ()))
+(print (eq (fold-left - 0 xs) -10))
+(print (eq (fold-right - 0 xs) -2))
+(print (eq (fold-left (lambda (acc x) (push x acc)) () xs) (list 4 3 2 1)))
+(print (eq (last xs) 4))
+(define long (stream-list (stream-range 0 100000)))
+(print (eq (length long) 100000))
+(print (eq (fold-left + 0 long) 4999950000))
+(print (eq (length (reverse long)) 100000))
+(print (eq (last (map (lambda (x) (* 2 x)) long)) 199998))
+(print (eq (length (filter (lambda (x) (< x 10)) long)) 10))
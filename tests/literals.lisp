@@ -0,0 +1,19 @@
+; Equal literals are read as one object, and nothing may change one.
+; Each line prints true:
+;     mgclisp --load tests/literals.lisp
+(define a (' (1 (2 3) "s" 2.5)))
+(define b (' (1 (2 3) "s" 2.5)))
+(print (eq a b))
+(print (eq (' (2 3)) (car (cdr a))))
+(print (eq 2.5 (car (cdr (cdr (cdr a))))))
+(print (eq (list 2.5 2.50) (list 2.5 2.5)))
+(defmacro code () (' (+ 1 2)))
+(print (eq (code) 3))
+(print (eq (' (+ 1 2)) (list (' +) 1 2)))
+(defmacro twice (x) (list (' +) x x))
+(define table (' ((twice 1) (let ((x 1)) x))))
+(print (eq (car table) (list (' twice) 1)))
+(define f (lambda (x) (+ x (twice 2))))
+(print (eq (f 1) 5))
+(print (eq table (' ((twice 1) (let ((x 1)) x)))))
+(print (eq (car (car table)) (' twice)))
@@ -0,0 +1,24 @@
+; Macros are expanded once, when a top level form is read or a lambda is
+; made, so a macro body runs once per use in the source, not per call.
+(define expansions 0)
+(defmacro unless (c a b) (do (set expansions (+ expansions 1)) (list (' if) c b a)))
+(print (eq (unless (< 1 2) 10 20) 20))
+(print (eq (unless (< 2 1) 10 20) 10))
+(set expansions 0)
+(define pick (lambda (x) (unless (< x 0) (' positive) (' negative))))
+(print (eq expansions 1))
+(pick 1)
+(pick -1)
+(pick 2)
+(print (eq expansions 1))
+(print (eq (pick -5) (' negative)))
+; nested uses expand inside out
+(print (eq (unless (< 1 2) 1 (unless (< 1 2) 2 3)) 3))
+; a macro using gensym binds a name the caller's code can't see
+(defmacro swap-add (a b) (let ((tmp (gensym))) (list (list (' lambda) (list tmp) (list (' +) tmp b)) a)))
+(define tmp 100)
+(print (eq (swap-add 1 tmp) 101))
+(print (eq (eq (gensym) (gensym)) false))
+; let is rewritten into a lambda application
+(print (eq (let ((x 2) (y 3)) (* x y)) 6))
+(print (eq (let ((x 1)) (let ((x 2) (y x)) (+ x y))) 3))
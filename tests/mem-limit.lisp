@@ -0,0 +1,9 @@
+; The memory limit is on how far the live heap grows, not on what's
+; allocated along the way. A million stream steps, whose cells are freed as
+; they're passed and whose elements are all shared small ints, allocate far
+; more than the limit but keep next to nothing, and print true:
+;     mgclisp --mem-limit 1000000 --load tests/mem-limit.lisp
+(define inner (lambda (acc x) acc))
+(define outer (lambda (acc x) (stream-fold inner acc (stream-range 0 1000))))
+(print (eq (stream-fold outer 0 (stream-range 0 1000)) 0))
+(print (eq (length (stream-list (stream-map (lambda (x) (+ x 1)) (stream-range 0 1000)))) 1000))
@@ -0,0 +1,8 @@
+; Run after tests/modules.lisp, see there.
+(define expansions 0)
+(defmacro times (a b) (do (set expansions (+ expansions 1)) (list (' *) a b)))
+(import shapes)
+(print (eq (area 3 4) 12))
+(print (eq expansions 0))
+(print (eq (perimeter 3 4) 14))
+(print (eq unit 1))
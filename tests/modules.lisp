@@ -0,0 +1,16 @@
+; Imports load a module the first time one of its exports is used, and
+; cache it expanded under tests/modules/.mgclisp-cache. The first run
+; expands times in shapes and the second, a cache hit, doesn't:
+;     rm -rf tests/modules/.mgclisp-cache
+;     MGCLISP_PATH=tests/modules mgclisp --load tests/modules.lisp
+;     MGCLISP_PATH=tests/modules mgclisp --load tests/modules-cached.lisp
+(define expansions 0)
+(defmacro times (a b) (do (set expansions (+ expansions 1)) (list (' *) a b)))
+(import shapes)
+(print (eq expansions 0))
+(print (eq (area 3 4) 12))
+(print (eq expansions 1))
+(print (eq (perimeter 3 4) 14))
+(print (eq unit 1))
+(print (eq (write-to-string autoload) "<Error: autoload Not Found>"))
+(print (eq (write-to-string (import nothing)) "<Error: no module nothing>"))
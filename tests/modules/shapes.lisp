@@ -0,0 +1,4 @@
+(module shapes (area perimeter unit)
+  (define area (lambda (w h) (times w h)))
+  (define perimeter (lambda (w h) (* 2 (+ w h))))
+  (define unit (area 1 1)))
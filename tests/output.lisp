@@ -0,0 +1,17 @@
+; Output ports. Each line prints true:
+;     mgclisp --load tests/output.lisp
+(define p (open-output-string))
+(write (list 1 (list 2 3)) p)
+(newline p)
+(write "s" p)
+(print (eq (get-output-string p) "( 1 ( 2 3 ) )
+s"))
+(print (eq (write-to-string (list 1 (list 2 3))) "( 1 ( 2 3 ) )"))
+(print (eq (write-to-string (open-output-string 1)) "<Error: open-output-string takes no arguments>"))
+(define f (open-output-file "/tmp/mgclisp-output-test.txt"))
+(write "line" f)
+(newline f)
+(close-port f)
+(define in (open-input-file "/tmp/mgclisp-output-test.txt"))
+(print (eq (read-line in) "line"))
+(print (eq (read-line in) false))
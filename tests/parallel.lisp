@@ -0,0 +1,19 @@
+; Independent calls to slow compiled lambdas run side by side with
+; --parallel; the results have to be the ones they give in order. Each
+; line prints true with or without it:
+;     mgclisp --parallel --load tests/parallel.lisp
+(define fib (lambda (x) (if (< x 2) 1 (+ (fib (- x 1)) (fib (- x 2))))))
+(print (eq (fib 27) 317811))
+(print (eq (+ (fib 26) (fib 25)) 317811))
+(print (eq (list (fib 24) (fib 23) (fib 22)) (list 75025 46368 28657)))
+; operands that aren't compiled calls are still evaluated in order
+(define order ())
+(define note (lambda (x) (do (set order (push x order)) x)))
+(print (eq (list (note 1) (fib 25) (note 2) (fib 24) (note 3)) (list 1 121393 2 75025 3)))
+(print (eq order (list 3 2 1)))
+; compiled code that overflows falls back to the interpreter
+(define grow (lambda (x n) (if (eq n 0) x (grow (* x 3) (- n 1)))))
+(define warm (lambda (n) (if (eq n 0) 0 (do (grow 1 2) (warm (- n 1))))))
+(warm 200)
+(print (eq (+ (grow 1 50) (grow 1 40)) (+ 717897987691852588770249 12157665459056928801)))
+(print (eq (- (fib 26) (fib 26)) 0))
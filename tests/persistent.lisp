@@ -0,0 +1,53 @@
+; Updating a vector or map returns a new version and leaves the old one as
+; it was; a transient is changed in place until it's made persistent.
+(define v (vector 1 2 3))
+(define w (vector-set v 0 9))
+(print (eq (vector-list v) (list 1 2 3)))
+(print (eq (vector-list w) (list 9 2 3)))
+(print (eq (vector-length (vector-push v 4)) 4))
+(print (eq (vector-length v) 3))
+(print (eq (write-to-string (vector-ref v 3)) "<Error: vector index 3 out of range>"))
+; past one leaf and past one level of the tree
+(define big (persistent (stream-fold vector-push (transient (vector)) (stream-range 0 5000))))
+(print (eq (vector-length big) 5000))
+(print (eq (vector-ref big 31) 31))
+(print (eq (vector-ref big 32) 32))
+(print (eq (vector-ref big 1024) 1024))
+(print (eq (vector-ref big 4999) 4999))
+(define big2 (vector-set big 1500 (' x)))
+(print (eq (vector-ref big2 1500) (' x)))
+(print (eq (vector-ref big 1500) 1500))
+(print (eq (vector-ref big2 1501) 1501))
+(define m (hash-map "a" 1 "b" 2))
+(define n (map-put m "c" 3))
+(print (eq (map-count m) 2))
+(print (eq (map-count n) 3))
+(print (eq (map-has? m "c") false))
+(print (eq (map-get n "c") 3))
+(print (eq (map-get m "c" (' none)) (' none)))
+(print (eq (map-count (map-remove n "a")) 2))
+(print (eq (map-get n "a") 1))
+(print (eq (map-get (map-put m "a" 10) "a") 10))
+(print (eq (map-get m "a") 1))
+(print (eq (map-entries (hash-map 1 2)) (' ((1 2)))))
+(define many (persistent (stream-fold (lambda (acc i) (map-put acc i (* i i))) (transient (hash-map)) (stream-range 0 5000))))
+(print (eq (map-count many) 5000))
+(print (eq (map-get many 4321) 18671041))
+(define fewer (stream-fold (lambda (acc i) (map-remove acc i)) many (stream-range 0 4990)))
+(print (eq (map-count fewer) 10))
+(print (eq (map-count many) 5000))
+(print (eq (map-get fewer 4995) 24950025))
+; a transient changes in place, and the persistent version made from it
+; doesn't change after that
+(define t (transient (vector 1 2)))
+(print (eq (vector-push t 3) t))
+(print (eq (vector-length t) 3))
+(define p (persistent t))
+(vector-push t 4)
+(print (eq (vector-length p) 3))
+(define tm (transient (hash-map)))
+(map-put tm (' k) 1)
+(print (eq (map-get tm (' k)) 1))
+(define pm (persistent tm))
+(map-put tm (' j) 2)
+(print (eq (map-count pm) 1))
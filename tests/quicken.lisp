@@ -0,0 +1,32 @@
+; A call site specializes on what it saw the first time it ran, and has
+; to give the same answers when what it sees changes afterwards.
+(define add (lambda (a b) (+ a b)))
+(print (eq (add 1 2) 3))
+(print (eq (add 1.5 2) 3.5))
+(print (eq (add 9223372036854775807 1) 9223372036854775808))
+(print (eq (add 4 5) 9))
+(print (eq (write-to-string (add (' a) 1)) (write-to-string (+ (' a) 1))))
+(print (eq (add -3 3) 0))
+; the symbol a site calls through can be rebound to another procedure
+(define op (lambda (a b) (* a b)))
+(define apply-op (lambda (a b) (op a b)))
+(print (eq (apply-op 3 4) 12))
+(set op (lambda (a b) (- a b)))
+(print (eq (apply-op 3 4) -1))
+(set op +)
+(print (eq (apply-op 3 4) 7))
+; a site that reads a variable from a frame reads the frame of each call
+(define outer (lambda (k) (lambda (x) (+ x k))))
+(define add10 (outer 10))
+(define add20 (outer 20))
+(print (eq (add10 1) 11))
+(print (eq (add20 1) 21))
+(print (eq (add10 2) 12))
+; comparisons switch between ints and reals
+(define less (lambda (a b) (< a b)))
+(print (less 1 2))
+(print (eq (less 2.5 1) false))
+(print (less 1 1.5))
+; a site that keeps failing its guard still calls correctly
+(define mixed (lambda (xs) (fold-left (lambda (acc x) (+ acc x)) 0 xs)))
+(print (eq (mixed (list 1 2.5 3 0.5 9223372036854775807 1)) (+ 9223372036854775807 8.0)))
@@ -0,0 +1,27 @@
+; Records made by define-record: constructors, predicates and accessors,
+; which check the type of what they're given.
+(define-record point x y)
+(define-record size x y)
+(define-record event id kind ts source note)
+(define p (make-point 1 2))
+(print (eq (point-x p) 1))
+(print (eq (point-y p) 2))
+(print (point? p))
+(print (eq (point? (make-size 1 2)) false))
+(print (eq (point? (list 1 2)) false))
+(print (eq (point? 5) false))
+(print (eq p (make-point 1 2)))
+(print (eq (eq p (make-point 1 3)) false))
+(print (eq (eq p (make-size 1 2)) false))
+(print (eq (write-to-string p) "#<point x 1 y 2>"))
+(print (eq (write-to-string (point-x (make-size 1 2))) "<Error: point-x requires a record of type point>"))
+(print (eq (write-to-string (make-point 1)) "<Error: make-point requires 2 arguments>"))
+(define e (make-event 7 (' click) 1700 (list 1 2) (make-point 3 4)))
+(print (eq (event-note e) (make-point 3 4)))
+(print (eq (point-y (event-note e)) 4))
+(print (eq (event-source e) (list 1 2)))
+; accessors used from a hot loop stay correct once compiled
+(define sum-x (lambda (ps acc) (if (eq ps ()) acc (sum-x (cdr ps) (+ acc (point-x (car ps)))))))
+(define points (map (lambda (i) (make-point i 0)) (stream-list (stream-range 0 1000))))
+(print (eq (sum-x points 0) 499500))
+(print (eq (sum-x points 0) 499500))
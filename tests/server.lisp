@@ -0,0 +1,12 @@
+; Requests for a server, one per line, sent down one connection. Every
+; reply is true, apart from the output of the one that prints, which comes
+; ahead of its result, and the last, which never finishes and is answered
+; with an error once it runs past the time limit:
+;     mgclisp --timeout 1 --serve /tmp/test.sock &
+;     grep -v '^;' tests/server.lisp | nc -U /tmp/test.sock
+(do (set car cdr) (eq (car (' (1 2))) (' (2))))
+(eq (car (' (1 2))) 1)
+(do (define spin (lambda (n) (if (eq n 0) 0 (do (spin (- n 1)))))) (eq (spin 10) 0))
+(do (print 7) true)
+(eq (vector-length (vector 1 2 3)) 3)
+(do (define forever (lambda (n) (if (eq n 0) 0 (do (forever n))))) (forever 1))
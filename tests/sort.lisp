@@ -0,0 +1,24 @@
+; sort is stable, and lists of more than 16K items sorted with < or > are
+; merge sorted in parallel; either way the result has to be the same.
+(print (eq (sort (list 3 1 2) <) (list 1 2 3)))
+(print (eq (sort (list 3 1 2) >) (list 3 2 1)))
+(print (eq (sort (list 2 1.5 3) <) (list 1.5 2 3)))
+(print (eq (sort (list 1 -4 99999999999999999999 0) <) (list -4 0 1 99999999999999999999)))
+(print (eq (sort (' (pear apple fig)) <) (' (apple fig pear))))
+(print (eq (sort (list 1) <) (list 1)))
+(print (eq (sort (list 3 1 2) (lambda (a b) (< a b))) (list 1 2 3)))
+; equal keys keep their order
+(define by-key (lambda (a b) (< (car a) (car b))))
+(print (eq (sort (' ((2 a) (1 b) (2 c) (1 d) (2 e))) by-key) (' ((1 b) (1 d) (2 a) (2 c) (2 e)))))
+(print (eq (sort (' ((1 x) (1 y) (1 z))) by-key) (' ((1 x) (1 y) (1 z)))))
+(print (eq (write-to-string (sort (vector 3 1 2) <)) "<Error: sort requires a list and a comparison function>"))
+; big enough to sort in parallel
+(define up (stream-list (stream-range 0 40000)))
+(define down (reverse up))
+(define shuffled (append (stream-list (stream-range 20000 40000)) (reverse (stream-list (stream-range 0 20000)))))
+(print (eq (sort down <) up))
+(print (eq (sort shuffled <) up))
+(print (eq (sort shuffled >) down))
+(print (eq (sort (map (lambda (x) (+ x 0.5)) down) <) (map (lambda (x) (+ x 0.5)) up)))
+(print (eq (length (sort (append up up) <)) 80000))
+(print (eq (nth 1 (sort (append up down) <)) 0))
@@ -0,0 +1,22 @@
+; Special forms are dispatched by the tag their symbol is read with, and
+; check their operand counts before running.
+(define x 1)
+(print (eq x 1))
+(print (eq (if (< 1 2) (' yes) (' no)) (' yes)))
+(print (eq (if (< 2 1) (' yes) (' no)) (' no)))
+(print (eq ((lambda (a b) (- a b)) 5 3) 2))
+(print (eq ((\ (a) (* a a)) 5) 25))
+(print (eq (' (if do lambda)) (list (' if) (' do) (' lambda))))
+(print (eq (car (' (define x))) (' define)))
+(set x 2)
+(print (eq x 2))
+(print (eq (do 1 2 3) 3))
+(print (eq (let ((y 4)) (+ x y)) 6))
+(print (eq (force (delay (+ x 1))) 3))
+(print (eq (stream-car (stream-cdr (stream-cons 1 (stream-cons 2 ())))) 2))
+; a special form's name that's been quoted is data, not syntax
+(define forms (list (' if) (' set) (' quote)))
+(print (eq (length forms) 3))
+(print (eq (write-to-string (if 1)) "<Error: if requires 3 arguments>"))
+(print (eq (write-to-string (define)) "<Error: define requires 2 arguments>"))
+(print (eq (write-to-string (lambda (a))) "<Error: lambda requires 2 arguments>"))
@@ -0,0 +1,22 @@
+; Streams are built lazily and consumed one element at a time.
+(define forced 0)
+(define p (delay (do (set forced (+ forced 1)) 42)))
+(print (eq forced 0))
+(print (eq (force p) 42))
+(print (eq (force p) 42))
+(print (eq forced 1))
+(define ints (lambda (n) (stream-cons n (ints (+ n 1)))))
+(print (eq (stream-car (stream-cdr (stream-cdr (ints 5)))) 7))
+(print (eq (stream-list (stream-take 3 (stream-map (lambda (x) (* x x)) (ints 1)))) (list 1 4 9)))
+(print (eq (stream-list (stream-take 4 (stream-filter (lambda (x) (< 10 x)) (ints 0)))) (list 11 12 13 14)))
+(print (eq (stream-list (stream-range 0 5)) (list 0 1 2 3 4)))
+(print (eq (stream-list (stream-range 3 3)) ()))
+(print (eq (stream-fold + 0 (stream-range 0 100000)) 4999950000))
+; only the elements taken are computed
+(define calls 0)
+(define counted (stream-map (lambda (x) (do (set calls (+ calls 1)) x)) (ints 0)))
+(print (eq calls 1))
+(print (eq (stream-list (stream-take 5 counted)) (list 0 1 2 3 4)))
+(print (< calls 7))
+; a long pipeline runs in constant space
+(print (eq (stream-fold + 0 (stream-take 1000000 (stream-filter (lambda (x) (< 0 x)) (stream-map (lambda (x) (- x 500000)) (ints 0))))) 500000500000))
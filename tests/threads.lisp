@@ -0,0 +1,12 @@
+; Green threads and their mailboxes. Each line prints true:
+;     mgclisp --load tests/threads.lisp
+(define worker (lambda (parent n) (send parent (* n n))))
+(print (eq (do (spawn worker (self) 7) (receive)) 49))
+; do keeps spin interpreted, and so preempted, even once it's hot.
+(define spin (lambda (n) (if (eq n 0) 0 (do (spin (- n 1))))))
+(define racer (lambda (parent n) (do (spin n) (send parent n))))
+(print (eq (do (spawn racer (self) 20000) (spawn racer (self) 10) (receive)) 10))
+(print (eq (receive) 20000))
+(define relay (lambda (parent) (send parent (+ (receive) 1))))
+(print (eq (do (send (spawn relay (self)) 41) (receive)) 42))
+(print (eq (self) 0))
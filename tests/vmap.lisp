@@ -0,0 +1,12 @@
+; vmap has to give what map gives, one item at a time. Each line prints
+; true when it does:
+;     mgclisp --load tests/vmap.lisp
+(define same (lambda (f v) (eq (vector-list (vmap f v)) (map f (vector-list v)))))
+(print (same (lambda (x) (eq (* x 1.5) 3)) (vector 2 3 -2)))
+(print (same (lambda (x) (* x 0.5)) (vector 1 2 3 4 -4 0 3000000000)))
+(print (same (lambda (x) (+ x 0.25 0.75)) (vector 1 -1 2.5 7)))
+(print (same (lambda (x) (/ x 2)) (vector 4 5 -6 0)))
+(print (same (lambda (x) (eq (/ x 2) 2)) (vector 4 5)))
+(print (same (lambda (x) (if (< x 0) 0 (* x 1.5))) (vector -2 4 3.5 2)))
+(print (same (lambda (x) (- (* x 4294967296.0) 1)) (vector 0 1 -1)))
+(print (same (lambda (x) (* x 1073741824)) (vector 1 2 -2 4)))
@@ -0,0 +1,102 @@
+#ifndef threadpool_hpp
+#define threadpool_hpp
+#include <iostream>
+#include <vector>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unistd.h>
+using namespace std;
+
+/*
+ * A fixed set of OS threads for work that never touches the interpreter:
+ * nothing run here may allocate objects, evaluate code or talk to the
+ * scheduler, since none of that is thread safe. Callers hand over a batch
+ * of jobs and help run them until the batch is done.
+ *
+ * Threads don't survive fork. A process that forks after making a pool
+ * has to leave the child's copy alone and make a new one.
+ */
+
+class ThreadPool {
+    private:
+        vector<thread> workers;
+        deque<function<void()>> jobs;
+        mutex lock;
+        condition_variable ready;
+        condition_variable finished;
+        int pending;
+        bool stopping;
+        void workerLoop();
+        bool runOne(unique_lock<mutex>& held);
+    public:
+        ThreadPool(int threads = 0);
+        ~ThreadPool();
+        int size();
+        void run(vector<function<void()>>& batch);
+};
+
+ThreadPool::ThreadPool(int threads) {
+    if (threads < 1)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1)
+        threads = 1;
+    pending = 0;
+    stopping = false;
+    //the caller is one of the threads doing the work.
+    for (int i = 1; i < threads; i++)
+        workers.push_back(thread(&ThreadPool::workerLoop, this));
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        lock_guard<mutex> held(lock);
+        stopping = true;
+    }
+    ready.notify_all();
+    for (thread& worker : workers)
+        worker.join();
+}
+
+int ThreadPool::size() {
+    return workers.size() + 1;
+}
+
+//Runs one queued job with the lock released. Returns false if there were none.
+bool ThreadPool::runOne(unique_lock<mutex>& held) {
+    if (jobs.empty())
+        return false;
+    function<void()> job = move(jobs.front());
+    jobs.pop_front();
+    held.unlock();
+    job();
+    held.lock();
+    if (--pending == 0)
+        finished.notify_all();
+    return true;
+}
+
+void ThreadPool::workerLoop() {
+    unique_lock<mutex> held(lock);
+    while (true) {
+        ready.wait(held, [this]() { return stopping || !jobs.empty(); });
+        if (stopping)
+            return;
+        runOne(held);
+    }
+}
+
+void ThreadPool::run(vector<function<void()>>& batch) {
+    unique_lock<mutex> held(lock);
+    for (auto& job : batch)
+        jobs.push_back(move(job));
+    pending += batch.size();
+    ready.notify_all();
+    while (runOne(held))
+        ;
+    finished.wait(held, [this]() { return pending == 0; });
+}
+
+#endif
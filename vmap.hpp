@@ -0,0 +1,367 @@
+#ifndef vmap_hpp
+#define vmap_hpp
+#include <iostream>
+#include <vector>
+#include <cstring>
+#include <functional>
+#include "objects.hpp"
+#include "list.hpp"
+using namespace std;
+
+/*
+ * Batch kernels for vmap. A lambda whose body is made only of its
+ * parameters, number and bool constants, if, + - * / < > and eq is lowered
+ * to a straight line program over registers that each hold a block of
+ * items, and the program runs a block at a time with GCC vector
+ * extensions, vmapLanes items per operation. Both arms of an if are
+ * computed and the test selects between them lane by lane.
+ *
+ * Each lane keeps the interpreter's idea of what its number is, an int or
+ * a real, so (if (< x 0) 0 (* x 1.5)) still gives an int or a real where
+ * the interpreter would. A lane whose input isn't an int or a real, or
+ * whose int result leaves int range, is marked slow, and the caller applies
+ * the lambda to that item the ordinary way.
+ */
+
+//lanes per operation: two 64 bit lanes are one SSE2 register, which any
+//x86-64 has.
+const int vmapLanes = 2;
+const int vmapBlock = 256;
+
+typedef long VmapInts __attribute__((vector_size(vmapLanes * sizeof(long))));
+typedef unsigned long VmapBits __attribute__((vector_size(vmapLanes * sizeof(long))));
+typedef double VmapReals __attribute__((vector_size(vmapLanes * sizeof(double))));
+
+enum VmapOp {
+    VMAP_CONST, VMAP_ADD, VMAP_SUB, VMAP_MUL, VMAP_DIV, VMAP_LT, VMAP_GT, VMAP_EQ, VMAP_IF, VMAP_UNKNOWN
+};
+
+enum VmapType { VMAP_NUMBER, VMAP_BOOL };
+
+//dst = op(a, b), or for VMAP_IF dst = a ? b:c.
+struct VmapStep {
+    VmapOp op;
+    int dst;
+    int a, b, c;
+    Object* constant;
+};
+
+//Masks are 0 or -1 in every lane, which is what vector comparisons give
+//and what vector selects take. A bool is kept in ints as a mask.
+struct alignas(32) VmapRegister {
+    long ints[vmapBlock];
+    double reals[vmapBlock];
+    long isReal[vmapBlock];
+    long slow[vmapBlock];
+};
+
+typedef function<VmapOp(Object*)> VmapResolver;
+
+template <class V, class T>
+V loadLanes(const T* at) {
+    V lanes;
+    memcpy(&lanes, at, sizeof(lanes));
+    return lanes;
+}
+
+template <class V, class T>
+void storeLanes(T* at, V lanes) {
+    memcpy(at, &lanes, sizeof(lanes));
+}
+
+class VmapKernel {
+    private:
+        int arity;
+        int result;
+        List* params;
+        VmapResolver resolve;
+        vector<VmapType> types;
+        vector<VmapStep> constants;
+        vector<VmapStep> steps;
+        int newRegister(VmapType type);
+        int paramIndex(Object* symbol);
+        int lower(Object* form);
+        int lowerCall(VmapOp op, ListNode* args);
+        void load(VmapRegister& reg, Object** items, size_t count);
+        void loadConstant(VmapRegister& reg, Object* constant);
+        template <VmapOp op> void arith(VmapStep& step, vector<VmapRegister>& regs);
+        void compare(VmapStep& step, vector<VmapRegister>& regs);
+        void select(VmapStep& step, vector<VmapRegister>& regs);
+        Object* box(VmapRegister& reg, int lane);
+    public:
+        static VmapKernel* compile(Procedure* proc, VmapResolver resolver);
+        int getArity();
+        void run(vector<Object**>& columns, size_t count, Object** out);
+};
+
+int VmapKernel::newRegister(VmapType type) {
+    types.push_back(type);
+    return types.size() - 1;
+}
+
+int VmapKernel::paramIndex(Object* symbol) {
+    int i = 0;
+    for (Object* it : *params) {
+        if (compareObject(it, symbol))
+            return i;
+        i++;
+    }
+    return -1;
+}
+
+//The register holding form's value, or -1 if form can't be lowered.
+int VmapKernel::lower(Object* form) {
+    switch (form->type) {
+        case AS_INT:
+        case AS_REAL:
+        case AS_BOOL: {
+            int reg = newRegister(form->type == AS_BOOL ? VMAP_BOOL:VMAP_NUMBER);
+            constants.push_back({VMAP_CONST, reg, -1, -1, -1, form});
+            return reg;
+        }
+        case AS_SYMBOL:
+            //parameters are the first registers.
+            return paramIndex(form);
+        case AS_LIST:
+            break;
+        default:
+            return -1;
+    }
+    List* list = form->listVal;
+    if (list->empty() || list->first()->info->type != AS_SYMBOL)
+        return -1;
+    Object* head = list->first()->info;
+    ListNode* args = list->first()->next;
+    if (head->special == SF_IF) {
+        if (list->size() != 4)
+            return -1;
+        int test = lower(args->info);
+        int pos = lower(args->next->info);
+        int neg = lower(args->next->next->info);
+        if (test == -1 || pos == -1 || neg == -1 || types[pos] != types[neg])
+            return -1;
+        //anything but a bool counts as true to the interpreter.
+        if (types[test] != VMAP_BOOL)
+            return pos;
+        int reg = newRegister(types[pos]);
+        steps.push_back({VMAP_IF, reg, test, pos, neg, nullptr});
+        return reg;
+    }
+    if (head->special != SF_NONE || paramIndex(head) != -1)
+        return -1;
+    VmapOp op = resolve(head);
+    if (op == VMAP_UNKNOWN)
+        return -1;
+    return lowerCall(op, args);
+}
+
+int VmapKernel::lowerCall(VmapOp op, ListNode* args) {
+    vector<int> kids;
+    for (ListNode* it = args; it != nullptr; it = it->next) {
+        int kid = lower(it->info);
+        if (kid == -1)
+            return -1;
+        kids.push_back(kid);
+    }
+    switch (op) {
+        case VMAP_ADD:
+        case VMAP_SUB:
+        case VMAP_MUL:
+        case VMAP_DIV: {
+            //n-ary arithmetic folds left. A single operand is returned as
+            //is, except by /, which makes it a real.
+            if (kids.empty() || (op == VMAP_DIV && kids.size() < 2))
+                return -1;
+            for (int kid : kids)
+                if (types[kid] != VMAP_NUMBER)
+                    return -1;
+            int acc = kids[0];
+            for (size_t i = 1; i < kids.size(); i++) {
+                int reg = newRegister(VMAP_NUMBER);
+                steps.push_back({op, reg, acc, kids[i], -1, nullptr});
+                acc = reg;
+            }
+            return acc;
+        }
+        case VMAP_LT:
+        case VMAP_GT:
+        case VMAP_EQ: {
+            if (kids.size() != 2 || types[kids[0]] != types[kids[1]])
+                return -1;
+            if (op != VMAP_EQ && types[kids[0]] != VMAP_NUMBER)
+                return -1;
+            int reg = newRegister(VMAP_BOOL);
+            steps.push_back({op, reg, kids[0], kids[1], -1, nullptr});
+            return reg;
+        }
+        default:
+            break;
+    }
+    return -1;
+}
+
+VmapKernel* VmapKernel::compile(Procedure* proc, VmapResolver resolver) {
+    if (proc->type != LAMBDA || proc->freeVars->empty())
+        return nullptr;
+    for (Object* it : *proc->freeVars)
+        if (it->type != AS_SYMBOL)
+            return nullptr;
+    VmapKernel* kernel = new VmapKernel;
+    kernel->params = proc->freeVars;
+    kernel->arity = proc->freeVars->size();
+    kernel->resolve = resolver;
+    for (int i = 0; i < kernel->arity; i++)
+        kernel->newRegister(VMAP_NUMBER);
+    kernel->result = kernel->lower(proc->code);
+    if (kernel->result == -1) {
+        delete kernel;
+        return nullptr;
+    }
+    return kernel;
+}
+
+int VmapKernel::getArity() {
+    return arity;
+}
+
+void VmapKernel::load(VmapRegister& reg, Object** items, size_t count) {
+    for (size_t i = 0; i < vmapBlock; i++) {
+        Object* item = i < count ? items[i]:nullptr;
+        bool isInt = item != nullptr && item->type == AS_INT;
+        bool isReal = item != nullptr && item->type == AS_REAL;
+        reg.ints[i] = isInt ? item->intVal:0;
+        reg.reals[i] = isReal ? item->realVal:0;
+        reg.isReal[i] = isReal ? -1:0;
+        reg.slow[i] = isInt || isReal ? 0:-1;
+    }
+}
+
+void VmapKernel::loadConstant(VmapRegister& reg, Object* constant) {
+    for (size_t i = 0; i < vmapBlock; i++) {
+        reg.ints[i] = constant->type == AS_INT ? constant->intVal:(constant->type == AS_BOOL && constant->boolVal ? -1:0);
+        reg.reals[i] = constant->type == AS_REAL ? constant->realVal:0;
+        reg.isReal[i] = constant->type == AS_REAL ? -1:0;
+        reg.slow[i] = 0;
+    }
+}
+
+//Ints are worked in 64 bits, which can't overflow on int operands, and a
+//result outside int range is sent back to the interpreter, which would
+//have made it a bignum. A lane with a real operand is worked in doubles,
+//and a whole real result in int range becomes an int, as makeRealObject
+//does.
+template <VmapOp op>
+void VmapKernel::arith(VmapStep& step, vector<VmapRegister>& regs) {
+    VmapRegister& a = regs[step.a];
+    VmapRegister& b = regs[step.b];
+    VmapRegister& dst = regs[step.dst];
+    VmapInts zero = {};
+    for (int i = 0; i < vmapBlock; i += vmapLanes) {
+        VmapInts ia = loadLanes<VmapInts>(a.ints + i), ib = loadLanes<VmapInts>(b.ints + i);
+        VmapInts ka = loadLanes<VmapInts>(a.isReal + i), kb = loadLanes<VmapInts>(b.isReal + i);
+        VmapReals x = ka ? loadLanes<VmapReals>(a.reals + i):__builtin_convertvector(ia, VmapReals);
+        VmapReals y = kb ? loadLanes<VmapReals>(b.reals + i):__builtin_convertvector(ib, VmapReals);
+        VmapInts slow = loadLanes<VmapInts>(a.slow + i) | loadLanes<VmapInts>(b.slow + i);
+        VmapInts real = ka | kb;
+        VmapBits u = (VmapBits)ia, v = (VmapBits)ib;
+        VmapInts n;
+        VmapReals r;
+        if constexpr (op == VMAP_ADD) { n = (VmapInts)(u + v); r = x + y; }
+        if constexpr (op == VMAP_SUB) { n = (VmapInts)(u - v); r = x - y; }
+        if constexpr (op == VMAP_MUL) { n = (VmapInts)(u * v); r = x * y; }
+        if constexpr (op == VMAP_DIV) { n = zero; r = x / y; real = ~zero; }
+        VmapInts wide = n != ((VmapInts)((VmapBits)n << 32) >> 32);
+        VmapInts inRange = (VmapInts)(r >= (double)INT_MIN) & (VmapInts)(r <= (double)INT_MAX);
+        VmapReals bounded = inRange ? r:(VmapReals)zero;
+        VmapInts whole = __builtin_convertvector(bounded, VmapInts);
+        VmapInts demote = real & inRange & (VmapInts)(__builtin_convertvector(whole, VmapReals) == bounded);
+        real &= ~demote;
+        storeLanes(dst.ints + i, demote ? whole:(real ? zero:n));
+        storeLanes(dst.reals + i, r);
+        storeLanes(dst.isReal + i, real);
+        storeLanes(dst.slow + i, slow | (~real & wide));
+    }
+}
+
+//< and > compare two ints exactly and anything else as doubles, and eq
+//is only true of two ints or two reals, as in the interpreter.
+void VmapKernel::compare(VmapStep& step, vector<VmapRegister>& regs) {
+    VmapRegister& a = regs[step.a];
+    VmapRegister& b = regs[step.b];
+    VmapRegister& dst = regs[step.dst];
+    bool bools = types[step.a] == VMAP_BOOL;
+    VmapInts zero = {};
+    for (int i = 0; i < vmapBlock; i += vmapLanes) {
+        VmapInts ia = loadLanes<VmapInts>(a.ints + i), ib = loadLanes<VmapInts>(b.ints + i);
+        VmapInts ka = loadLanes<VmapInts>(a.isReal + i), kb = loadLanes<VmapInts>(b.isReal + i);
+        VmapReals x = ka ? loadLanes<VmapReals>(a.reals + i):__builtin_convertvector(ia, VmapReals);
+        VmapReals y = kb ? loadLanes<VmapReals>(b.reals + i):__builtin_convertvector(ib, VmapReals);
+        VmapInts real = ka | kb;
+        VmapInts t;
+        if (step.op == VMAP_LT)
+            t = real ? (VmapInts)(x < y):(VmapInts)(ia < ib);
+        else if (step.op == VMAP_GT)
+            t = real ? (VmapInts)(x > y):(VmapInts)(ia > ib);
+        else if (bools)
+            t = (VmapInts)(ia == ib);
+        else
+            t = (VmapInts)(ka == kb) & (real ? (VmapInts)(x == y):(VmapInts)(ia == ib));
+        storeLanes(dst.ints + i, t);
+        storeLanes(dst.reals + i, (VmapReals)zero);
+        storeLanes(dst.isReal + i, zero);
+        storeLanes(dst.slow + i, loadLanes<VmapInts>(a.slow + i) | loadLanes<VmapInts>(b.slow + i));
+    }
+}
+
+//A lane is slow if its test is, or if the arm it takes is.
+void VmapKernel::select(VmapStep& step, vector<VmapRegister>& regs) {
+    VmapRegister& test = regs[step.a];
+    VmapRegister& pos = regs[step.b];
+    VmapRegister& neg = regs[step.c];
+    VmapRegister& dst = regs[step.dst];
+    for (int i = 0; i < vmapBlock; i += vmapLanes) {
+        VmapInts t = loadLanes<VmapInts>(test.ints + i);
+        storeLanes(dst.ints + i, t ? loadLanes<VmapInts>(pos.ints + i):loadLanes<VmapInts>(neg.ints + i));
+        storeLanes(dst.reals + i, t ? loadLanes<VmapReals>(pos.reals + i):loadLanes<VmapReals>(neg.reals + i));
+        storeLanes(dst.isReal + i, t ? loadLanes<VmapInts>(pos.isReal + i):loadLanes<VmapInts>(neg.isReal + i));
+        VmapInts slow = t ? loadLanes<VmapInts>(pos.slow + i):loadLanes<VmapInts>(neg.slow + i);
+        storeLanes(dst.slow + i, slow | loadLanes<VmapInts>(test.slow + i));
+    }
+}
+
+Object* VmapKernel::box(VmapRegister& reg, int lane) {
+    if (reg.slow[lane])
+        return nullptr;
+    if (types[result] == VMAP_BOOL)
+        return makeBoolObject(reg.ints[lane] != 0);
+    if (reg.isReal[lane])
+        return makeRealObject(reg.reals[lane]);
+    return makeIntObject(reg.ints[lane]);
+}
+
+//Fills out[i] with the result for the ith item of each column, or with
+//nullptr where the item has to be applied by the interpreter.
+void VmapKernel::run(vector<Object**>& columns, size_t count, Object** out) {
+    vector<VmapRegister> regs(types.size());
+    for (VmapStep& step : constants)
+        loadConstant(regs[step.dst], step.constant);
+    for (size_t start = 0; start < count; start += vmapBlock) {
+        size_t n = min(count - start, (size_t)vmapBlock);
+        for (int p = 0; p < arity; p++)
+            load(regs[p], columns[p] + start, n);
+        for (VmapStep& step : steps) {
+            switch (step.op) {
+                case VMAP_ADD: arith<VMAP_ADD>(step, regs); break;
+                case VMAP_SUB: arith<VMAP_SUB>(step, regs); break;
+                case VMAP_MUL: arith<VMAP_MUL>(step, regs); break;
+                case VMAP_DIV: arith<VMAP_DIV>(step, regs); break;
+                case VMAP_IF: select(step, regs); break;
+                default: compare(step, regs); break;
+            }
+        }
+        for (size_t i = 0; i < n; i++)
+            out[start + i] = box(regs[result], i);
+    }
+}
+
+#endif